@@ -0,0 +1,57 @@
+#ifndef __cuANN_AttributeStore__
+#define __cuANN_AttributeStore__
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include "AttributeStore.h"
+
+namespace cuANN {
+	AttributeStore::AttributeStore(unsigned N) {
+		this->N = N;
+	}
+
+	int AttributeStore::addField(const int* values) {
+		std::vector<std::pair<int, unsigned>> field(N);
+		for (unsigned idx = 0; idx < N; ++idx) {
+			field[idx] = std::make_pair(values[idx], idx);
+		}
+		std::sort(field.begin(), field.end());
+		fields.push_back(std::move(field));
+		return fields.size() - 1;
+	}
+
+	int AttributeStore::getFieldsNumber() const {
+		return fields.size();
+	}
+
+	Bitmap AttributeStore::matchTags(int field, const std::vector<int>& tags) const {
+		std::vector<unsigned> idxs;
+		for (int tag : tags) {
+			appendIdxs(field, tag, tag, idxs);
+		}
+		std::sort(idxs.begin(), idxs.end());
+		return Bitmap::fromSorted(idxs.data(), idxs.size());
+	}
+
+	Bitmap AttributeStore::matchRange(int field, int low, int high) const {
+		std::vector<unsigned> idxs;
+		appendIdxs(field, low, high, idxs);
+		std::sort(idxs.begin(), idxs.end());
+		return Bitmap::fromSorted(idxs.data(), idxs.size());
+	}
+
+	void AttributeStore::appendIdxs(int field, int low, int high, std::vector<unsigned>& idxs) const {
+		if (field < 0 || field >= (int) fields.size()) {
+			throw std::runtime_error("No such attribute field");
+		}
+		const auto& values = fields[field];
+		auto begin = std::lower_bound(values.begin(), values.end(), std::make_pair(low, 0u));
+		auto end = std::upper_bound(begin, values.end(), std::make_pair(high, std::numeric_limits<unsigned>::max()));
+		for (auto it = begin; it != end; ++it) {
+			idxs.push_back(it->second);
+		}
+	}
+}
+
+#endif // !__cuANN_AttributeStore__
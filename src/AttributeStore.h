@@ -0,0 +1,39 @@
+#ifndef __cuANN_ATTRIBUTESTORE_H_
+#define __cuANN_ATTRIBUTESTORE_H_
+
+#include <utility>
+#include <vector>
+#include "Bitmap.h"
+
+namespace cuANN {
+	/*
+	 * Integer attributes of the dataset vectors, one value per vector in every field, that
+	 * queries can be filtered on. Each field is kept sorted by value, so both tag sets and
+	 * ranges turn into a few binary searches.
+	 */
+	class AttributeStore
+	{
+	public:
+		explicit AttributeStore(unsigned N);
+
+		// values holds one entry per vector, the returned index names the field
+		int addField(const int* values);
+
+		int getFieldsNumber() const;
+
+		// vectors whose value is one of tags
+		Bitmap matchTags(int field, const std::vector<int>& tags) const;
+
+		// vectors whose value is in [low, high]
+		Bitmap matchRange(int field, int low, int high) const;
+
+	private:
+		unsigned N;
+		// (value, vector id) by increasing value, then id
+		std::vector<std::vector<std::pair<int, unsigned>>> fields;
+
+		void appendIdxs(int field, int low, int high, std::vector<unsigned>& idxs) const;
+	};
+}
+
+#endif /* __cuANN_ATTRIBUTESTORE_H_ */
@@ -0,0 +1,224 @@
+#ifndef __cuANN_Benchmark__
+#define __cuANN_Benchmark__
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <random>
+#include "commons.h"
+#include "utils.h"
+#include "Benchmark.h"
+#include "HashTable.h"
+#include "Index.h"
+#include "QueryBinCalculator.h"
+
+namespace cuANN {
+	Benchmark::Benchmark(const BenchmarkOptions& options) {
+		this->options = options;
+		dataset = SyntheticData::generateVectors(options.distribution, options.N, options.d, options.clusters, options.spread, options.seed);
+		queries = SyntheticData::generateVectors(options.distribution, options.Q, options.d, options.clusters, options.spread, options.seed + 1);
+	}
+
+	Benchmark::~Benchmark() {
+		delete queries;
+		delete dataset;
+	}
+
+	void Benchmark::run(std::ostream& out) {
+		int N = options.N, Q = options.Q, d = options.d, k = options.k, L = options.L;
+		cudaStream_t stream = context.getStream();
+		measures.clear();
+		auto nothing = [] {};
+
+		ThrustFloatV dDataset(dataset->dataset, dataset->dataset + (size_t) N * d);
+		ThrustFloatV dQueries(queries->dataset, queries->dataset + (size_t) Q * d);
+
+		// a dense projection of k Gaussian rows and its offsets, as a p-stable table has
+		std::mt19937_64 generator(options.seed + 2);
+		std::normal_distribution<float> normal;
+		std::uniform_real_distribution<float> uniform(0.0f, options.w);
+		std::vector<float> projections((size_t) k * d), offsets(k);
+		for (auto& value : projections) {
+			value = normal(generator);
+		}
+		for (auto& value : offsets) {
+			value = uniform(generator);
+		}
+		ThrustFloatV dProjections(projections.begin(), projections.end());
+		ThrustFloatV dOffsets(offsets.begin(), offsets.end());
+		ThrustFloatV dProjected((size_t) N * k);
+		ThrustSizetV dRowHashes(N);
+
+		measure("multiplyMatrix", N, ((double) N * d + (double) d * k + (double) N * k) * sizeof(float), 2.0 * N * d * k, nothing, [&] {
+			multiplyMatrix(
+				context.getCublasHandle(),
+				thrust::raw_pointer_cast(dDataset.data()),
+				thrust::raw_pointer_cast(dProjections.data()),
+				thrust::raw_pointer_cast(dProjected.data()),
+				N, d, k
+			);
+		});
+
+		// three passes reading and writing the projections, then one reading them and writing the hashes
+		double quantizeBytes = 7.0 * N * k * sizeof(float) + (double) N * sizeof(size_t);
+		measure("quantize + hashRange", N, quantizeBytes, 3.0 * N * k, nothing, [&] {
+			dim3 dimBlock(BLOCK_SIZE, BLOCK_SIZE);
+			dim3 dimGrid((k + dimBlock.x - 1)/dimBlock.x, (N + dimBlock.y - 1)/dimBlock.y);
+			float * dMatrix = thrust::raw_pointer_cast(dProjected.data());
+			addVectorFromMatrix<<<dimGrid, dimBlock, 0, stream>>>(dMatrix, thrust::raw_pointer_cast(dOffsets.data()), N, k);
+			divideMatrixByScalar<<<dimGrid, dimBlock, 0, stream>>>(dMatrix, options.w, N, k);
+			floorMatrix<<<dimGrid, dimBlock, 0, stream>>>(dMatrix, N, k);
+
+			dim3 dimBlockRows(BLOCK_SIZE * BLOCK_SIZE);
+			dim3 dimGridRows((N + dimBlockRows.x - 1)/dimBlockRows.x);
+			hashMatrixRows<<<dimGridRows, dimBlockRows, 0, stream>>>(dMatrix, N, k, thrust::raw_pointer_cast(dRowHashes.data()));
+		});
+
+		// the sort moves the codes and the row ids at least once each way
+		std::vector<size_t> hashes = SyntheticData::generateSkewedHashes(N, options.bins, options.skew, options.seed + 3);
+		ThrustSizetV dSkewedHashes(hashes.begin(), hashes.end());
+		ThrustSizetV dHashes(N);
+		HashTable table(k, d, options.w, IndexOptions());
+		measure("calcBins", N, 2.0 * N * (sizeof(size_t) + sizeof(unsigned)), 0.0, [&] {
+			thrust::copy(dSkewedHashes.begin(), dSkewedHashes.end(), dHashes.begin());
+		}, [&] {
+			table.buildBins(thrust::raw_pointer_cast(dHashes.data()), N, context);
+		});
+
+		// a lookup per query and table, each a binary search in the sorted codes
+		std::vector<size_t> binCodes(hashes);
+		std::sort(binCodes.begin(), binCodes.end());
+		binCodes.erase(std::unique(binCodes.begin(), binCodes.end()), binCodes.end());
+		int binsNumber = binCodes.size();
+		int lookups = Q * L;
+		std::vector<size_t> lookupHashes(lookups);
+		for (int i = 0; i < lookups; ++i) {
+			lookupHashes[i] = hashes[i % N];
+		}
+		ThrustSizetV dBinCodes(binCodes.begin(), binCodes.end());
+		ThrustSizetV dLookupHashes(lookupHashes.begin(), lookupHashes.end());
+		ThrustIntV dBinIdxs(lookups);
+		double searchSteps = std::ceil(std::log2(binsNumber + 1.0));
+		measure("QueryBinCalculator", lookups, (double) lookups * (sizeof(size_t) * (searchSteps + 1) + sizeof(int)), 0.0, nothing, [&] {
+			QueryBinCalculator::getBinsForQueryHashes(
+				thrust::raw_pointer_cast(dLookupHashes.data()), lookups,
+				binsNumber, thrust::raw_pointer_cast(dBinCodes.data()),
+				thrust::raw_pointer_cast(dBinIdxs.data()), context
+			);
+		});
+
+		// the candidates of every table, each table drawing its own
+		int C = options.candidatesPerTable;
+		Index index(k, L, dataset, options.w, IndexOptions());
+		std::vector<ThrustQueryResult> tableResults(L);
+		for (int t = 0; t < L; ++t) {
+			std::vector<unsigned> idxs = SyntheticData::generateIdxs(Q, C, N, options.seed + 4 + t);
+			ThrustQueryResult& result = tableResults[t];
+			result.Q = Q;
+			result.resultSetSize = idxs.size();
+			result.resultSet.assign(idxs.begin(), idxs.end());
+			result.resultStartingIdxs.resize(Q);
+			result.resultSizes.resize(Q);
+			for (int query = 0; query < Q; ++query) {
+				result.resultStartingIdxs[query] = query * C;
+				result.resultSizes[query] = C;
+			}
+		}
+		double candidates = (double) Q * L * C;
+		ThrustQueryResult mergedResult;
+		measure("mergeQueryResults", candidates, 2.0 * candidates * sizeof(unsigned), 0.0, nothing, [&] {
+			index.mergeQueryResults(tableResults, Q, 0, QueryOptions(), mergedResult);
+		});
+
+		// the merged candidates, with duplicates dropped, are the ones reranked
+		unsigned pairs = mergedResult.resultSetSize;
+		ThrustUnsignedV dCandidatesIdxs(mergedResult.resultSet.begin(), mergedResult.resultSet.begin() + pairs);
+		ThrustUnsignedV dQueriesIdxs(pairs);
+		ThrustFloatV dDistances(pairs);
+		index.uploadCandidates(mergedResult, thrust::raw_pointer_cast(dCandidatesIdxs.data()), thrust::raw_pointer_cast(dQueriesIdxs.data()), context);
+		context.synchronize();
+
+		double distancesBytes = 2.0 * pairs * d * sizeof(float) + (double) pairs * (2 * sizeof(unsigned) + sizeof(float));
+		measure("calcSquaredDistances", pairs, distancesBytes, 3.0 * pairs * d, nothing, [&] {
+			dim3 dimBlock(BLOCK_SIZE_STRIDE_X, BLOCK_SIZE_STRIDE_Y);
+			dim3 dimGrid((pairs + dimBlock.x - 1)/ dimBlock.x);
+			calcSquaredDistances<<<dimGrid, dimBlock, 0, stream>>>(
+				thrust::raw_pointer_cast(dDataset.data()),
+				thrust::raw_pointer_cast(dQueries.data()),
+				d,
+				thrust::raw_pointer_cast(dCandidatesIdxs.data()),
+				thrust::raw_pointer_cast(dQueriesIdxs.data()),
+				pairs,
+				thrust::raw_pointer_cast(dDistances.data())
+			);
+		});
+
+		// the keys and the ids they carry, read and written once each, then the distances split back out
+		measure("top-K sort", pairs, 2.0 * pairs * (sizeof(unsigned long long) + sizeof(unsigned)) + pairs * (sizeof(unsigned long long) + sizeof(float)), 0.0, nothing, [&] {
+			index.sortDistancesAndTheirIdxs(
+				thrust::raw_pointer_cast(dDistances.data()),
+				thrust::raw_pointer_cast(dCandidatesIdxs.data()),
+				thrust::raw_pointer_cast(dQueriesIdxs.data()),
+				pairs, context
+			);
+		});
+
+		report(out);
+	}
+
+	void Benchmark::measure(const std::string& stage, double items, double bytes, double flops, const std::function<void()>& prepare, const std::function<void()>& stageRun) {
+		std::vector<double> times;
+		for (int repetition = 0; repetition <= std::max(1, options.repetitions); ++repetition) {
+			prepare();
+			context.synchronize();
+
+			auto startTime = std::chrono::high_resolution_clock::now();
+			stageRun();
+			context.synchronize();
+			auto endTime = std::chrono::high_resolution_clock::now();
+
+			// the first run warms the arenas and the caches up
+			if (repetition > 0) {
+				times.push_back(std::chrono::duration<double, std::milli>(endTime - startTime).count());
+			}
+		}
+
+		std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+		measures.push_back({ stage, times[times.size() / 2], items, bytes, flops });
+	}
+
+	/*
+	 * Double data rate memory moves two words of the bus per clock.
+	 */
+	double Benchmark::getPeakBandwidth() {
+		int device;
+		cudaDeviceProp properties;
+		if (cudaGetDevice(&device) != cudaSuccess || cudaGetDeviceProperties(&properties, device) != cudaSuccess) {
+			return 0.0;
+		}
+		return 2.0 * properties.memoryClockRate * 1e3 * (properties.memoryBusWidth / 8) / 1e9;
+	}
+
+	void Benchmark::report(std::ostream& out) const {
+		double peakBandwidth = getPeakBandwidth();
+		out << "N " << options.N << ", Q " << options.Q << ", d " << options.d << ", k " << options.k << ", L " << options.L
+			<< ", peak bandwidth " << std::fixed << std::setprecision(1) << peakBandwidth << " GB/s" << std::endl;
+		out << std::left << std::setw(24) << "Stage" << std::right
+			<< std::setw(12) << "ms" << std::setw(14) << "Mitems/s" << std::setw(10) << "GB/s"
+			<< std::setw(10) << "% peak" << std::setw(10) << "GFLOP/s" << std::endl;
+		for (const auto& measure : measures) {
+			double seconds = measure.millis / 1e3;
+			double bandwidth = seconds > 0 ? measure.bytes / seconds / 1e9 : 0.0;
+			out << std::left << std::setw(24) << measure.stage << std::right << std::setprecision(3)
+				<< std::setw(12) << measure.millis
+				<< std::setprecision(1)
+				<< std::setw(14) << (seconds > 0 ? measure.items / seconds / 1e6 : 0.0)
+				<< std::setw(10) << bandwidth
+				<< std::setw(10) << (peakBandwidth > 0 ? 100.0 * bandwidth / peakBandwidth : 0.0)
+				<< std::setw(10) << (seconds > 0 ? measure.flops / seconds / 1e9 : 0.0) << std::endl;
+		}
+	}
+}
+
+#endif // !__cuANN_Benchmark__
@@ -0,0 +1,87 @@
+#ifndef __cuANN_BENCHMARK_H_
+#define __cuANN_BENCHMARK_H_
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "Dataset.h"
+#include "ExecutionContext.h"
+#include "SyntheticData.h"
+
+namespace cuANN {
+	/*
+	 * Sizes and inputs of the microbenchmarks.
+	 */
+	struct BenchmarkOptions {
+		int N;
+		int Q;
+		int d;
+		int k;
+		int L;
+		float w;
+
+		// how the dataset and the queries are drawn
+		Distribution distribution;
+		int clusters;
+		float spread;
+
+		// the bucket codes bucketed and looked up, over bins buckets of Zipf sizes
+		int bins;
+		float skew;
+
+		// candidates of every query in every table, merged and reranked
+		int candidatesPerTable;
+		unsigned numberOfNeighbors;
+
+		// timed runs of every stage, after one untimed warm-up run
+		int repetitions;
+		unsigned long long seed;
+
+		BenchmarkOptions() : N(1 << 20), Q(1000), d(128), k(16), L(10), w(4.0f), distribution(UNIFORM), clusters(64), spread(0.1f),
+			bins(1 << 16), skew(1.0f), candidatesPerTable(100), numberOfNeighbors(10), repetitions(10), seed(1) {}
+	};
+
+	/*
+	 * Times every stage of the build and of the queries in isolation, on synthetic inputs: the
+	 * projections, their quantization and hashing, the bucketing, the bin lookups, the merge of the
+	 * candidates, their distances and the top-K sort. Each stage reports its median time, its
+	 * throughput in items/s and GB/s and, for the GB/s, how far it is from the bandwidth of the device.
+	 * The bytes are those a stage has to move at least, so the bandwidth is an effective one.
+	 */
+	class Benchmark
+	{
+	public:
+		Benchmark(const BenchmarkOptions& options);
+
+		Benchmark(const Benchmark &) = delete;
+
+		~Benchmark();
+
+		void run(std::ostream& out);
+
+	private:
+		struct Measure {
+			std::string stage;
+			double millis;
+			double items;
+			double bytes;
+			double flops;
+		};
+
+		BenchmarkOptions options;
+		Dataset * dataset;
+		Dataset * queries;
+		ExecutionContext context;
+		std::vector<Measure> measures;
+
+		// median over the repetitions of stageRun, prepare running untimed before each of them
+		void measure(const std::string& stage, double items, double bytes, double flops, const std::function<void()>& prepare, const std::function<void()>& stageRun);
+
+		static double getPeakBandwidth();
+
+		void report(std::ostream& out) const;
+	};
+}
+
+#endif /* __cuANN_BENCHMARK_H_ */
@@ -0,0 +1,269 @@
+#ifndef __cuANN_Bitmap__
+#define __cuANN_Bitmap__
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include "Bitmap.h"
+
+namespace cuANN {
+	constexpr unsigned Bitmap::ARRAY_LIMIT;
+	constexpr unsigned Bitmap::BITSET_WORDS;
+
+	static unsigned countBits(uint64_t word) {
+		return __builtin_popcountll(word);
+	}
+
+	Bitmap::Bitmap() {
+	}
+
+	unsigned long long Bitmap::Version::next() {
+		static std::atomic<unsigned long long> lastVersion(0);
+		return ++lastVersion;
+	}
+
+	Bitmap Bitmap::fromSorted(const unsigned* ids, size_t size) {
+		Bitmap bitmap;
+		size_t i = 0;
+		while (i < size) {
+			Container container;
+			container.key = ids[i] >> 16;
+			container.cardinality = 0;
+			for (; i < size && (ids[i] >> 16) == container.key; ++i) {
+				uint16_t value = ids[i] & 0xffff;
+				if (container.values.empty() || container.values.back() != value) {
+					container.values.push_back(value);
+				}
+			}
+			container.cardinality = container.values.size();
+			container.normalize();
+			bitmap.containers.push_back(std::move(container));
+		}
+		return bitmap;
+	}
+
+	void Bitmap::add(unsigned id) {
+		version.value = Version::next();
+		uint16_t key = id >> 16;
+		auto it = std::lower_bound(containers.begin(), containers.end(), key, [](const Container& container, uint16_t key) {
+			return container.key < key;
+		});
+		if (it == containers.end() || it->key != key) {
+			Container container;
+			container.key = key;
+			container.cardinality = 0;
+			it = containers.insert(it, std::move(container));
+		}
+		it->add(id & 0xffff);
+	}
+
+	bool Bitmap::contains(unsigned id) const {
+		uint16_t key = id >> 16;
+		auto it = std::lower_bound(containers.begin(), containers.end(), key, [](const Container& container, uint16_t key) {
+			return container.key < key;
+		});
+		return it != containers.end() && it->key == key && it->contains(id & 0xffff);
+	}
+
+	size_t Bitmap::getCardinality() const {
+		size_t cardinality = 0;
+		for (const auto& container : containers) {
+			cardinality += container.cardinality;
+		}
+		return cardinality;
+	}
+
+	Bitmap Bitmap::intersect(const Bitmap& other) const {
+		Bitmap result;
+		auto a = containers.begin();
+		auto b = other.containers.begin();
+		while (a != containers.end() && b != other.containers.end()) {
+			if (a->key < b->key) {
+				++a;
+			} else if (b->key < a->key) {
+				++b;
+			} else {
+				Container container = intersectContainers(*a, *b);
+				if (container.cardinality > 0) {
+					result.containers.push_back(std::move(container));
+				}
+				++a;
+				++b;
+			}
+		}
+		return result;
+	}
+
+	Bitmap Bitmap::unite(const Bitmap& other) const {
+		Bitmap result;
+		auto a = containers.begin();
+		auto b = other.containers.begin();
+		while (a != containers.end() || b != other.containers.end()) {
+			if (b == other.containers.end() || (a != containers.end() && a->key < b->key)) {
+				result.containers.push_back(*a++);
+			} else if (a == containers.end() || b->key < a->key) {
+				result.containers.push_back(*b++);
+			} else {
+				result.containers.push_back(uniteContainers(*a++, *b++));
+			}
+		}
+		return result;
+	}
+
+	void Bitmap::copyIds(std::vector<unsigned>& ids) const {
+		for (const auto& container : containers) {
+			unsigned high = (unsigned) container.key << 16;
+			if (!container.isBitset()) {
+				for (uint16_t value : container.values) {
+					ids.push_back(high | value);
+				}
+				continue;
+			}
+			for (unsigned word = 0; word < BITSET_WORDS; ++word) {
+				uint64_t bits = container.bits[word];
+				while (bits) {
+					ids.push_back(high | (word * 64 + __builtin_ctzll(bits)));
+					bits &= bits - 1;
+				}
+			}
+		}
+	}
+
+	unsigned long long Bitmap::getVersion() const {
+		return version.value;
+	}
+
+	/*
+	 * Both the list and the containers are sorted, so the matching container only moves forward.
+	 */
+	unsigned Bitmap::filterSorted(unsigned* ids, unsigned size) const {
+		unsigned kept = 0;
+		auto container = containers.begin();
+		for (unsigned i = 0; i < size; ++i) {
+			uint16_t key = ids[i] >> 16;
+			while (container != containers.end() && container->key < key) {
+				++container;
+			}
+			if (container == containers.end()) {
+				break;
+			}
+			if (container->key == key && container->contains(ids[i] & 0xffff)) {
+				ids[kept++] = ids[i];
+			}
+		}
+		return kept;
+	}
+
+	bool Bitmap::Container::isBitset() const {
+		return !bits.empty();
+	}
+
+	bool Bitmap::Container::contains(uint16_t value) const {
+		if (isBitset()) {
+			return (bits[value >> 6] >> (value & 63)) & 1;
+		}
+		return std::binary_search(values.begin(), values.end(), value);
+	}
+
+	void Bitmap::Container::add(uint16_t value) {
+		if (isBitset()) {
+			uint64_t mask = (uint64_t) 1 << (value & 63);
+			if (!(bits[value >> 6] & mask)) {
+				bits[value >> 6] |= mask;
+				++cardinality;
+			}
+			return;
+		}
+
+		auto it = std::lower_bound(values.begin(), values.end(), value);
+		if (it == values.end() || *it != value) {
+			values.insert(it, value);
+			++cardinality;
+			normalize();
+		}
+	}
+
+	/*
+	 * Picks the representation that fits the cardinality: an array takes 2 bytes per value,
+	 * the bit set always 8 KB.
+	 */
+	void Bitmap::Container::normalize() {
+		if (!isBitset() && cardinality > ARRAY_LIMIT) {
+			bits = toBits(*this);
+			values.clear();
+			values.shrink_to_fit();
+		} else if (isBitset() && cardinality <= ARRAY_LIMIT) {
+			values.clear();
+			values.reserve(cardinality);
+			for (unsigned word = 0; word < BITSET_WORDS; ++word) {
+				uint64_t wordBits = bits[word];
+				while (wordBits) {
+					values.push_back(word * 64 + __builtin_ctzll(wordBits));
+					wordBits &= wordBits - 1;
+				}
+			}
+			bits.clear();
+			bits.shrink_to_fit();
+		}
+	}
+
+	Bitmap::Container Bitmap::intersectContainers(const Container& a, const Container& b) {
+		Container result;
+		result.key = a.key;
+		if (a.isBitset() && b.isBitset()) {
+			result.bits.resize(BITSET_WORDS);
+			result.cardinality = 0;
+			for (unsigned word = 0; word < BITSET_WORDS; ++word) {
+				result.bits[word] = a.bits[word] & b.bits[word];
+				result.cardinality += countBits(result.bits[word]);
+			}
+		} else if (a.isBitset() || b.isBitset()) {
+			const Container& array = a.isBitset() ? b : a;
+			const Container& bitset = a.isBitset() ? a : b;
+			for (uint16_t value : array.values) {
+				if (bitset.contains(value)) {
+					result.values.push_back(value);
+				}
+			}
+			result.cardinality = result.values.size();
+		} else {
+			std::set_intersection(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(), std::back_inserter(result.values));
+			result.cardinality = result.values.size();
+		}
+		result.normalize();
+		return result;
+	}
+
+	Bitmap::Container Bitmap::uniteContainers(const Container& a, const Container& b) {
+		Container result;
+		result.key = a.key;
+		if (!a.isBitset() && !b.isBitset() && a.cardinality + b.cardinality <= ARRAY_LIMIT) {
+			std::set_union(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(), std::back_inserter(result.values));
+			result.cardinality = result.values.size();
+			return result;
+		}
+
+		result.bits = toBits(a);
+		std::vector<uint64_t> otherBits = toBits(b);
+		result.cardinality = 0;
+		for (unsigned word = 0; word < BITSET_WORDS; ++word) {
+			result.bits[word] |= otherBits[word];
+			result.cardinality += countBits(result.bits[word]);
+		}
+		result.normalize();
+		return result;
+	}
+
+	std::vector<uint64_t> Bitmap::toBits(const Container& container) {
+		if (container.isBitset()) {
+			return container.bits;
+		}
+		std::vector<uint64_t> bits(BITSET_WORDS, 0);
+		for (uint16_t value : container.values) {
+			bits[value >> 6] |= (uint64_t) 1 << (value & 63);
+		}
+		return bits;
+	}
+}
+
+#endif // !__cuANN_Bitmap__
@@ -0,0 +1,90 @@
+#ifndef __cuANN_BITMAP_H_
+#define __cuANN_BITMAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace cuANN {
+	/*
+	 * Compressed set of 32 bit ids in the Roaring layout: the ids are split by their upper 16 bits
+	 * into containers holding the lower 16 bits, either as a sorted array while they are few or as
+	 * a 65536 bit set once they are more than ARRAY_LIMIT.
+	 */
+	class Bitmap
+	{
+	public:
+		Bitmap();
+
+		// the ids must be in increasing order, repeated ones are kept once
+		static Bitmap fromSorted(const unsigned* ids, size_t size);
+
+		void add(unsigned id);
+
+		bool contains(unsigned id) const;
+
+		size_t getCardinality() const;
+
+		Bitmap intersect(const Bitmap& other) const;
+
+		Bitmap unite(const Bitmap& other) const;
+
+		// appends the ids in increasing order
+		void copyIds(std::vector<unsigned>& ids) const;
+
+		// compacts a sorted list to the ids in the bitmap and returns how many are left
+		unsigned filterSorted(unsigned* ids, unsigned size) const;
+
+		// changes whenever the ids may have changed, so two bitmaps of the same version hold the same ids
+		unsigned long long getVersion() const;
+
+	private:
+		static constexpr unsigned ARRAY_LIMIT = 4096;
+		static constexpr unsigned BITSET_WORDS = 1024;
+
+		struct Container {
+			uint16_t key;
+			unsigned cardinality;
+			// the lower halves in increasing order while the container is an array
+			std::vector<uint16_t> values;
+			// BITSET_WORDS words once it is a bit set
+			std::vector<uint64_t> bits;
+
+			bool isBitset() const;
+
+			bool contains(uint16_t value) const;
+
+			void add(uint16_t value);
+
+			void normalize();
+		};
+
+		// unique to every new or modified set of ids, kept by copies; a bitmap moved from gets a new one
+		struct Version {
+			unsigned long long value;
+
+			Version() : value(next()) {}
+
+			Version(const Version &) = default;
+
+			Version(Version && other) : value(other.value) { other.value = next(); }
+
+			Version& operator=(const Version &) = default;
+
+			Version& operator=(Version && other) { value = other.value; other.value = next(); return *this; }
+
+			static unsigned long long next();
+		};
+
+		std::vector<Container> containers;
+		Version version;
+
+		static Container intersectContainers(const Container& a, const Container& b);
+
+		static Container uniteContainers(const Container& a, const Container& b);
+
+		static std::vector<uint64_t> toBits(const Container& container);
+	};
+}
+
+#endif /* __cuANN_BITMAP_H_ */
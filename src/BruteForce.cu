@@ -0,0 +1,129 @@
+#ifndef __cuANN_BruteForce__
+#define __cuANN_BruteForce__
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <thrust/fill.h>
+#include "BruteForce.h"
+#include "utils.h"
+
+namespace cuANN {
+	constexpr int BruteForce::TILE_ROWS;
+	constexpr int BruteForce::QUERIES_BLOCK;
+
+	BruteForce::BruteForce(Dataset * data) {
+		if (!data->hasRows()) {
+			throw std::runtime_error("The exhaustive search needs the vectors in memory, not in a vector file");
+		}
+		this->dataset = data;
+	}
+
+	BruteForce::~BruteForce() {
+	}
+
+	QueryResult BruteForce::query(Dataset* queries, unsigned numberOfNeighbors) {
+		unsigned Q = queries->N;
+		int d = dataset->d;
+		unsigned K = std::min(numberOfNeighbors, (unsigned) dataset->N);
+
+		// every query has exactly K neighbors, so the rows are the top lists as they are
+		QueryResult result;
+		result.offsets.resize(Q + 1);
+		for (unsigned query = 0; query <= Q; ++query) {
+			result.offsets[query] = query * K;
+		}
+		if (K == 0) {
+			return result;
+		}
+
+		ExecutionContext context;
+		ScratchArena& deviceArena = context.getDeviceArena();
+		cudaStream_t stream = context.getStream();
+
+		ScratchBuffer<float> dQueries(deviceArena, (size_t) Q * d);
+		ScratchBuffer<float> dQueriesNorms(deviceArena, Q);
+		uploadRows(*queries, 0, Q, dQueries.data(), context);
+		dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
+		dim3 dimGrid((Q + dimBlock.x - 1)/dimBlock.x);
+		calcSquaredNorms<<<dimGrid, dimBlock, 0, stream>>>(dQueries.data(), Q, d, dQueriesNorms.data());
+
+		ScratchBuffer<float> dTopDistances(deviceArena, (size_t) Q * K);
+		ScratchBuffer<int> dTopIdxs(deviceArena, (size_t) Q * K);
+		thrust::fill(onContext(context), dTopDistances.begin(), dTopDistances.end(), std::numeric_limits<float>::max());
+		thrust::fill(onContext(context), dTopIdxs.begin(), dTopIdxs.end(), -1);
+		for (int tileStart = 0; tileStart < dataset->N; tileStart += TILE_ROWS) {
+			int tileRows = std::min(TILE_ROWS, dataset->N - tileStart);
+			searchTile(dQueries.data(), dQueriesNorms.data(), Q, tileStart, tileRows, K, dTopDistances.data(), dTopIdxs.data(), context);
+		}
+
+		result.idxs.resize((size_t) Q * K);
+		result.distances.resize((size_t) Q * K);
+		cudaMemcpyAsync(result.idxs.data(), dTopIdxs.data(), (size_t) Q * K * sizeof(int), cudaMemcpyDeviceToHost, stream);
+		cudaMemcpyAsync(result.distances.data(), dTopDistances.data(), (size_t) Q * K * sizeof(float), cudaMemcpyDeviceToHost, stream);
+		context.synchronize();
+
+		// the expansion through the norms can go slightly below zero
+		for (auto& distance : result.distances) {
+			distance = std::sqrt(std::max(distance, 0.0f));
+		}
+		return result;
+	}
+
+	void BruteForce::searchTile(
+		const float* dQueries, const float* dQueriesNorms, unsigned Q,
+		int tileStart, int tileRows, unsigned K,
+		float* dTopDistances, int* dTopIdxs,
+		ExecutionContext& context
+	) {
+		int d = dataset->d;
+		ScratchBuffer<float> dTile(context.getDeviceArena(), (size_t) tileRows * d);
+		uploadRows(*dataset, tileStart, tileRows, dTile.data(), context);
+		mergeTile(dQueries, dQueriesNorms, Q, d, dTile.data(), tileStart, tileRows, K, dTopDistances, dTopIdxs, context);
+	}
+
+	void BruteForce::mergeTile(
+		const float* dQueries, const float* dQueriesNorms, unsigned Q, int d,
+		const float* dTile, int tileStart, int tileRows, unsigned K,
+		float* dTopDistances, int* dTopIdxs,
+		ExecutionContext& context
+	) {
+		ScratchArena& deviceArena = context.getDeviceArena();
+		cudaStream_t stream = context.getStream();
+
+		ScratchBuffer<float> dTileNorms(deviceArena, tileRows);
+		dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
+		dim3 dimGrid((tileRows + dimBlock.x - 1)/dimBlock.x);
+		calcSquaredNorms<<<dimGrid, dimBlock, 0, stream>>>(dTile, tileRows, d, dTileNorms.data());
+
+		// queries are processed in blocks to bound the size of the dot products matrix
+		ScratchBuffer<float> dDots(deviceArena, (size_t) std::min<unsigned>(Q, QUERIES_BLOCK) * tileRows);
+		ScratchBuffer<float> dSpareDistances(deviceArena, (size_t) std::min<unsigned>(Q, QUERIES_BLOCK) * K);
+		ScratchBuffer<int> dSpareIdxs(deviceArena, (size_t) std::min<unsigned>(Q, QUERIES_BLOCK) * K);
+		for (unsigned blockStart = 0; blockStart < Q; blockStart += QUERIES_BLOCK) {
+			unsigned blockQueries = std::min<unsigned>(QUERIES_BLOCK, Q - blockStart);
+
+			multiplyMatrixTransposed(
+				context.getCublasHandle(),
+				dQueries + (size_t) blockStart * d,
+				dTile,
+				dDots.data(),
+				blockQueries, d, tileRows
+			);
+
+			selectTopKFromTile<<<blockQueries, SELECTION_THREADS, 0, stream>>>(
+				dDots.data(),
+				dTileNorms.data(),
+				dQueriesNorms + blockStart,
+				blockQueries, tileRows, tileStart, K,
+				dTopDistances + (size_t) blockStart * K,
+				dTopIdxs + (size_t) blockStart * K,
+				dSpareDistances.data(),
+				dSpareIdxs.data()
+			);
+		}
+	}
+}
+
+#endif // !__cuANN_BruteForce__
@@ -0,0 +1,48 @@
+#ifndef __cuANN_BRUTEFORCE_H_
+#define __cuANN_BRUTEFORCE_H_
+
+#include <vector>
+#include "commons.h"
+#include "Dataset.h"
+#include "QueryResult.h"
+#include "ExecutionContext.h"
+
+namespace cuANN {
+	/*
+	 * Exact k-NN by exhaustive search. The dataset is streamed to the device in tiles,
+	 * the dot products with a block of queries come from a single SGEMM and the
+	 * squared distances are merged into the running top K of each query as they are formed.
+	 */
+	class BruteForce
+	{
+	public:
+		BruteForce(Dataset * data);
+
+		~BruteForce();
+
+		QueryResult query(Dataset* queries, unsigned numberOfNeighbors);
+
+		static constexpr int TILE_ROWS = 16384;
+
+		// merges a tile of d dimensional rows already on the device, numbered from tileStart on, into the top K of the queries
+		static void mergeTile(
+			const float* dQueries, const float* dQueriesNorms, unsigned Q, int d,
+			const float* dTile, int tileStart, int tileRows, unsigned K,
+			float* dTopDistances, int* dTopIdxs,
+			ExecutionContext& context
+		);
+
+	private:
+		Dataset * dataset;
+		static constexpr int QUERIES_BLOCK = 1024;
+
+		void searchTile(
+			const float* dQueries, const float* dQueriesNorms, unsigned Q,
+			int tileStart, int tileRows, unsigned K,
+			float* dTopDistances, int* dTopIdxs,
+			ExecutionContext& context
+		);
+	};
+}
+
+#endif /* __cuANN_BRUTEFORCE_H_ */
@@ -4,13 +4,27 @@
 #include <iostream>
 #include <iomanip>
 #include <chrono>
+#include <ctime>
+#include <unordered_set>
+#include <fstream>
+#include <memory>
+#include <thread>
 #include "CLI.h"
 #include "LSH.h"
-#include "FvecsReader.h"
-#include "IvecsReader.h"
+#include "ParameterTuner.h"
+#include "BruteForce.h"
+#include "QueryServer.h"
+#include "VectorFileReader.h"
+#include "VectorStore.h"
+#include "IvecsWriter.h"
+#include "Benchmark.h"
+#include "AttributeStore.h"
+#include "HostAllocator.h"
 
 namespace cuANN {
-	CLI::CLI(int argc, char** argv) : argcount(argc), argvalue(argv), argparser(getParser())
+	constexpr unsigned CLI::DEFAULT_QUERY_BATCH;
+
+	CLI::CLI(int argc, char** argv) : argcount(argc), argvalue(argv), argparser(getParser()), groundtruthDimension(0)
 	{
 	}
 
@@ -34,35 +48,197 @@ namespace cuANN {
 			std::cerr << "Check that all the args are provided" << std::endl;
 			return EXIT_FAILURE;
 		}
+		// before any dataset or table is allocated
+		try {
+			HostAllocator::setHugePages(HostAllocator::parseHugePages(args["hugePages"].as<std::string>("transparent")));
+		}
+		catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		if (args["tune"]) {
+			return startTuner(args);
+		}
+		if (args["writeGroundtruth"]) {
+			return startGroundTruthWriter(args);
+		}
+		if (args["comparePrecision"]) {
+			return startPrecisionComparison(args);
+		}
+		if (args["selfJoin"]) {
+			return startSelfJoin(args);
+		}
+		if (args["benchmark"]) {
+			return startBenchmark(args);
+		}
 
 		try
 		{
 			std::string datasetFilePath = args["dataset"];
 			std::string queriesFilePath = args["queries"];
-			std::string groundtruthFilePath = args["groundtruth"];
+			int numberOfQueries = args["numberOfQueries"].as<int>(0);
+			int numberOfNeighbors = args["neighbors"].as<int>(0);
+			bool isRangeSearch = args["radius"];
+			unsigned queryBatch = args["queryBatch"].as<unsigned>(queriesFilePath == "-" ? DEFAULT_QUERY_BATCH : 0);
+
+			if (args["vectorFile"] && args["exact"]) {
+				throw std::runtime_error("The exhaustive search needs the vectors in memory, not in a vector file");
+			}
+			if (queryBatch && args["clients"]) {
+				throw std::runtime_error("The query server takes all the queries at once, not in batches");
+			}
+			Dataset * dataset = args["vectorFile"] ? getStoredDataset(datasetFilePath, args["vectorFile"]) : getDataset(datasetFilePath);
+			// in batches the queries are streamed, read ahead of the search a few batches at a time
+			std::unique_ptr<Dataset> queries;
+			std::unique_ptr<QueryStream> queryStream;
+			if (queryBatch) {
+				queryStream.reset(new QueryStream(queriesFilePath, args["queryFormat"].as<std::string>(""), queryBatch, numberOfQueries));
+			} else {
+				queries.reset(getDataset(queriesFilePath, numberOfQueries));
+			}
+			if (args["groundtruth"]) {
+				loadGroundTruthIdxs(args["groundtruth"], numberOfQueries);
+			}
+
+			auto startTime = std::chrono::high_resolution_clock::now();
+
+			QueryOptions queryOptions;
+			Bitmap filter;
+			if (loadFilter(args, dataset->N, filter)) {
+				if (args["exact"] || args["clients"]) {
+					throw std::runtime_error("Filters are only applied by the index queried directly");
+				}
+				queryOptions.filter = &filter;
+			}
+			queryOptions.bruteForceSelectivity = args["bruteForceSelectivity"].as<float>(queryOptions.bruteForceSelectivity);
+			queryOptions.maxMatches = args["maxMatches"].as<unsigned>(0);
+			queryOptions.minCollisions = args["minCollisions"].as<unsigned>(1);
+			queryOptions.maxRerankCandidates = args["rerankCandidates"].as<unsigned>(0);
+			queryOptions.probes = args["probes"].as<int>(1);
+			if (args["candidateBudget"]) {
+				std::string budget = args["candidateBudget"];
+				queryOptions.candidateBudget = budget == "auto" ? QueryOptions::AUTO_CANDIDATE_BUDGET : std::stoul(budget);
+			}
+			queryOptions.stopDistance = args["stopDistance"].as<float>(0.0f);
+			queryOptions.tablesPerRound = args["tablesPerRound"].as<int>(queryOptions.tablesPerRound);
+			if (isRangeSearch && (args["exact"] || args["clients"])) {
+				throw std::runtime_error("Range searches are only run by the index queried directly");
+			}
+
+			// the results of a batch are written out while the next one is searched
+			ResultWriter writer(openResultSink(args));
+			if (args["exact"]) {
+				BruteForce bruteForce(dataset);
+				queryInBatches(queries.get(), queryStream.get(), writer, [&](Dataset* batch) {
+					return bruteForce.query(batch, numberOfNeighbors);
+				});
+				delete dataset;
+			} else {
+				int numberOfHashFuncs = args["hashFunc"];
+				int numberOfProjTables = args["tables"];
+				float binWidth = args["binWidth"].as<float>(0.0f);
+
+				LSH lsh(numberOfHashFuncs, numberOfProjTables, binWidth, dataset, getIndexOptions(args));
+				lsh.buildIndex();
+				reportBuild(lsh, args);
+				if (args["clients"]) {
+					writer.submit(queryConcurrently(lsh.getIndex(), queries.get(), numberOfNeighbors, args));
+				} else {
+					float radius = args["radius"].as<float>(0.0f);
+					queryInBatches(queries.get(), queryStream.get(), writer, [&](Dataset* batch) {
+						return isRangeSearch ? lsh.rangeQueryIndex(batch, radius, queryOptions) : lsh.queryIndex(batch, numberOfNeighbors, queryOptions);
+					});
+				}
+			}
+			writer.finish();
+
+			// search and output overlap, so the time is the one until the last result is out
+			auto endTime = std::chrono::high_resolution_clock::now();
+			auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
+
+			std::cout << "==========================" << std::endl;
+			std::cout << "Elapsed " << duration << " ms" << std::endl;
+			std::cout << "==========================" << std::endl;
+		}
+		catch (const std::exception& e )
+		{
+			std::cerr << e.what();
+			return EXIT_FAILURE;
+		}
+
+
+		return 0;
+	}
+
+	int CLI::startGroundTruthWriter(const argagg::parser_results& args) {
+		try
+		{
+			std::string datasetFilePath = args["dataset"];
+			std::string queriesFilePath = args["queries"];
+			std::string outputFilePath = args["writeGroundtruth"];
 			int numberOfQueries = args["numberOfQueries"];
-			int numberOfHashFuncs = args["hashFunc"];
-			int numberOfProjTables = args["tables"];
 			int numberOfNeighbors = args["neighbors"];
-			float binWidth = args["binWidth"];
 
 			Dataset * dataset = getDataset(datasetFilePath);
 			Dataset * queries = getDataset(queriesFilePath, numberOfQueries);
-			this->groundtruthIdxs = loadGroundTruthIdxs(groundtruthFilePath, numberOfQueries);
 
-			auto startTime = std::chrono::high_resolution_clock::now();
+			BruteForce bruteForce(dataset);
+			auto results = bruteForce.query(queries, numberOfNeighbors);
 
-			LSH lsh(numberOfHashFuncs, numberOfProjTables, binWidth, dataset);
-			lsh.buildIndex();
-			auto results = lsh.queryIndex(queries, numberOfNeighbors);
+			IvecsWriter writer(outputFilePath);
+			writer.writeResults(results);
 
+			delete queries;
+			delete dataset;
+		}
+		catch (const std::exception& e )
+		{
+			std::cerr << e.what();
+			return EXIT_FAILURE;
+		}
+
+		return 0;
+	}
+
+	/*
+	 * Joins the dataset with itself through the buckets of the index: the pairs within --radius or,
+	 * without it, the graph of the -n nearest neighbors of every vector.
+	 */
+	int CLI::startSelfJoin(const argagg::parser_results& args) {
+		try
+		{
+			std::string datasetFilePath = args["dataset"];
+			Dataset * dataset = getDataset(datasetFilePath);
+
+			JoinOptions joinOptions;
+			joinOptions.radius = args["radius"].as<float>(0.0f);
+			joinOptions.numberOfNeighbors = args["neighbors"].as<unsigned>(0);
+			joinOptions.maxBinSize = args["maxBinSize"].as<unsigned>(0);
+			if (joinOptions.radius <= 0 && joinOptions.numberOfNeighbors == 0) {
+				throw std::runtime_error("The self-join needs --radius, or -n for the neighbor graph");
+			}
+
+			auto startTime = std::chrono::high_resolution_clock::now();
+			LSH lsh(args["hashFunc"], args["tables"], args["binWidth"].as<float>(0.0f), dataset, getIndexOptions(args));
+			lsh.buildIndex();
+			reportBuild(lsh, args);
+			QueryResult results = lsh.selfJoin(joinOptions);
 			auto endTime = std::chrono::high_resolution_clock::now();
 			auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
 
 			std::cout << "==========================" << std::endl;
 			std::cout << "Elapsed " << duration << " ms" << std::endl;
+			std::cout << (joinOptions.radius > 0 ? "Pairs " : "Edges ") << results.idxs.size() << std::endl;
 			std::cout << "==========================" << std::endl;
-			printResults(results);
+			if (args["writeGraph"]) {
+				IvecsWriter writer(args["writeGraph"].as<std::string>());
+				writer.writeResults(results);
+			} else {
+				ResultWriter writer(openResultSink(args));
+				writer.submit(std::move(results));
+				writer.finish();
+			}
 		}
 		catch (const std::exception& e )
 		{
@@ -70,64 +246,570 @@ namespace cuANN {
 			return EXIT_FAILURE;
 		}
 
+		return 0;
+	}
+
+	/*
+	 * Times every stage of the index on synthetic data, no file is read.
+	 */
+	int CLI::startBenchmark(const argagg::parser_results& args) {
+		try
+		{
+			BenchmarkOptions options;
+			options.N = args["rows"].as<int>(options.N);
+			options.Q = args["numberOfQueries"].as<int>(options.Q);
+			options.d = args["dimension"].as<int>(options.d);
+			options.k = args["hashFunc"].as<int>(options.k);
+			options.L = args["tables"].as<int>(options.L);
+			options.w = args["binWidth"].as<float>(options.w);
+			options.distribution = SyntheticData::parse(args["distribution"].as<std::string>("uniform"));
+			options.clusters = args["clusters"].as<int>(options.clusters);
+			options.spread = args["spread"].as<float>(options.spread);
+			options.bins = args["bins"].as<int>(options.bins);
+			options.skew = args["skew"].as<float>(options.skew);
+			options.candidatesPerTable = args["candidates"].as<int>(options.candidatesPerTable);
+			options.numberOfNeighbors = args["neighbors"].as<unsigned>(options.numberOfNeighbors);
+			options.repetitions = args["repetitions"].as<int>(options.repetitions);
+			options.seed = args["seed"].as<unsigned long long>(options.seed);
+
+			Benchmark benchmark(options);
+			benchmark.run(std::cout);
+		}
+		catch (const std::exception& e )
+		{
+			std::cerr << e.what();
+			return EXIT_FAILURE;
+		}
 
 		return 0;
 	}
 
-	void CLI::printResults(const std::vector<QueryResult>& results) {
-		for(const auto& result : results) {
-			std::cout << "Query idx: " << result.queryIdx << std::endl;
-			std::cout << "Result idx   Groundtruth" << std::endl;
-			for (int i = 0; i < result.resultIdx.size(); ++i) {
-				std::cout << std::right
-					<< std::setw(10) << result.resultIdx[i]
-					<< std::setw(14) << groundtruthIdxs[result.queryIdx][i]
+	/*
+	 * Builds the same index, with the same seed, once with fp32 rows and once with the asked 16 bit
+	 * storage, then reports how far the latter drifts: the rows that land in another bucket, the
+	 * recall of both and the share of answers they have in common, next to their build and query times.
+	 */
+	int CLI::startPrecisionComparison(const argagg::parser_results& args) {
+		try
+		{
+			std::string datasetFilePath = args["dataset"];
+			std::string queriesFilePath = args["queries"];
+			int numberOfQueries = args["numberOfQueries"];
+			int numberOfNeighbors = args["neighbors"];
+			int numberOfHashFuncs = args["hashFunc"];
+			int numberOfProjTables = args["tables"];
+			float binWidth = args["binWidth"];
+			Precision precision = PrecisionConverter::parse(args["precision"].as<std::string>("fp16"));
+
+			Dataset * dataset = getDataset(datasetFilePath);
+			Dataset * queries = getDataset(queriesFilePath, numberOfQueries);
+
+			std::vector<int> exactIdxs;
+			int exactDimension;
+			if (args["groundtruth"]) {
+				loadGroundTruthIdxs(args["groundtruth"], numberOfQueries);
+				exactIdxs = groundtruthIdxs;
+				exactDimension = groundtruthDimension;
+			} else {
+				BruteForce bruteForce(dataset);
+				auto exactResults = bruteForce.query(queries, numberOfNeighbors);
+				// there are no more exact neighbors than rows
+				exactDimension = std::min(numberOfNeighbors, dataset->N);
+				exactIdxs.assign((size_t) queries->N * exactDimension, -1);
+				for (unsigned query = 0; query < exactResults.getQueriesNumber(); ++query) {
+					std::copy_n(exactResults.getIdxs(query), exactResults.getMatchesNumber(query), exactIdxs.begin() + (size_t) query * exactDimension);
+				}
+			}
+
+			IndexOptions options;
+			options.compressPostings = args["compress"];
+			options.buildThreads = args["buildThreads"].as<int>(0);
+			options.seed = (unsigned long long) time(0);
+
+			Precision precisions[] = { FLOAT32, precision };
+			std::vector<std::vector<size_t>> referenceCodes(numberOfProjTables);
+			QueryResult results[2];
+			std::cout << "==========================" << std::endl;
+			for (int run = 0; run < 2; ++run) {
+				options.storagePrecision = precisions[run];
+				Index index(numberOfHashFuncs, numberOfProjTables, dataset, binWidth, options);
+
+				auto buildStart = std::chrono::high_resolution_clock::now();
+				index.buildIndex();
+				auto buildEnd = std::chrono::high_resolution_clock::now();
+				results[run] = index.query(queries, numberOfNeighbors);
+				auto queryEnd = std::chrono::high_resolution_clock::now();
+
+				size_t movedRows = 0;
+				for (int table = 0; table < numberOfProjTables; ++table) {
+					std::vector<size_t> codes(dataset->N);
+					index.copyRowCodes(table, codes.data());
+					if (run == 0) {
+						referenceCodes[table] = std::move(codes);
+						continue;
+					}
+					for (int row = 0; row < dataset->N; ++row) {
+						movedRows += codes[row] != referenceCodes[table][row];
+					}
+				}
+
+				double buildMillis = std::chrono::duration<double, std::milli>(buildEnd - buildStart).count();
+				double queryMillis = std::chrono::duration<double, std::milli>(queryEnd - buildEnd).count() / queries->N;
+				size_t rowsBytes = (size_t) dataset->N * dataset->d * PrecisionConverter::getElementSize(precisions[run]);
+				std::cout << PrecisionConverter::getName(precisions[run])
+					<< ": device rows " << rowsBytes / (1024 * 1024) << " MB"
+					<< ", build " << buildMillis << " ms"
+					<< ", query " << queryMillis << " ms/query"
+					<< ", recall@" << numberOfNeighbors << " " << ParameterTuner::measureRecall(results[run], exactIdxs, exactDimension, numberOfNeighbors)
 					<< std::endl;
+				if (run == 1) {
+					std::cout << "Rows in another bucket than with fp32: "
+						<< 100.0 * movedRows / ((double) dataset->N * numberOfProjTables) << "%" << std::endl;
+				}
 			}
 
+			size_t sharedAnswers = 0, answers = 0;
+			for (int query = 0; query < queries->N; ++query) {
+				const unsigned * reference = results[0].getIdxs(query);
+				std::unordered_set<unsigned> referenceIdxs(reference, reference + results[0].getMatchesNumber(query));
+				for (unsigned match = 0; match < results[1].getMatchesNumber(query); ++match) {
+					sharedAnswers += referenceIdxs.count(results[1].getIdxs(query)[match]);
+				}
+				answers += results[0].getMatchesNumber(query);
+			}
+			std::cout << "Answers in common with fp32: " << (answers ? 100.0 * sharedAnswers / answers : 100.0) << "%" << std::endl;
+			std::cout << "==========================" << std::endl;
+
+			delete queries;
+			delete dataset;
+		}
+		catch (const std::exception& e )
+		{
+			std::cerr << e.what();
+			return EXIT_FAILURE;
+		}
+
+		return 0;
+	}
+
+	int CLI::startTuner(const argagg::parser_results& args) {
+		try
+		{
+			std::string datasetFilePath = args["dataset"];
+			std::string queriesFilePath = args["queries"];
+			int numberOfQueries = args["numberOfQueries"];
+			int numberOfNeighbors = args["neighbors"];
+			float targetRecall = args["recall"].as<float>(0.9f);
+			size_t memoryBudget = args["memoryBudget"].as<size_t>(0) * 1024 * 1024;
+
+			Dataset * dataset = getDataset(datasetFilePath);
+			Dataset * queries = getDataset(queriesFilePath, numberOfQueries);
+
+			ParameterTuner tuner(dataset, queries, numberOfNeighbors);
+			if (args["groundtruth"]) {
+				loadGroundTruthIdxs(args["groundtruth"], numberOfQueries);
+				tuner.setGroundTruth(groundtruthIdxs, groundtruthDimension);
+			}
+			if (args["sampleSize"]) {
+				tuner.setSampleSize(args["sampleSize"]);
+			}
+			if (args["tables"]) {
+				tuner.setMaxTables(args["tables"]);
+			}
+
+			auto best = tuner.tune(targetRecall, memoryBudget);
+
+			std::cout << "==========================" << std::endl;
+			if (!best.targetReached) {
+				std::cout << "Target recall not reached, best found:" << std::endl;
+			}
+			std::cout << "-k " << best.k << " -L " << best.L << " -w " << best.w << std::endl;
+			std::cout << "Recall@" << numberOfNeighbors << " " << best.recall << std::endl;
+			// the recall is always the one of the sample, the rest may have been measured on the dataset
+			const char * measuredOn = best.isValidated ? " (whole dataset)" : "";
+			std::cout << "Query time " << best.queryMillis << " ms/query" << measuredOn << std::endl;
+			std::cout << "Index memory " << best.indexBytes / (1024 * 1024) << " MB" << measuredOn << std::endl;
 			std::cout << "==========================" << std::endl;
+
+			delete queries;
+			delete dataset;
+		}
+		catch (const std::exception& e )
+		{
+			std::cerr << e.what();
+			return EXIT_FAILURE;
+		}
+
+		return 0;
+	}
+
+	/*
+	 * Every client thread sends its share of the queries one at a time, waiting for each answer,
+	 * so the server has to coalesce them into batches on its own.
+	 */
+	QueryResult CLI::queryConcurrently(const Index* index, Dataset* queries, int numberOfNeighbors, const argagg::parser_results& args) {
+		int clientsNumber = args["clients"];
+		int workersNumber = args["workers"].as<int>(2);
+		unsigned maxBatchSize = args["maxBatch"].as<unsigned>(64);
+		std::chrono::microseconds maxDelay(args["maxDelay"].as<int>(500));
+
+		QueryServer server(index, queries->d, workersNumber, maxBatchSize, maxDelay);
+		std::vector<QueryResult> rows(queries->N);
+		std::vector<std::exception_ptr> errors(clientsNumber);
+		std::vector<std::thread> clients;
+
+		std::exception_ptr reloadError;
+		std::thread reloader;
+		if (args["reload"]) {
+			reloader = std::thread([&] {
+				try
+				{
+					reloadIndex(server, args);
+				}
+				catch (...)
+				{
+					reloadError = std::current_exception();
+				}
+			});
+		}
+
+		auto startTime = std::chrono::high_resolution_clock::now();
+		for (int client = 0; client < clientsNumber; ++client) {
+			clients.emplace_back([&, client] {
+				try
+				{
+					// the server copies the query, uint8 ones are widened into the same row every time
+					std::vector<float> row(queries->d);
+					for (int query = client; query < queries->N; query += clientsNumber) {
+						queries->copyRows(query, 1, row.data());
+						auto result = server.submit(row.data(), numberOfNeighbors);
+						rows[query] = result.get();
+					}
+				}
+				catch (...)
+				{
+					errors[client] = std::current_exception();
+				}
+			});
+		}
+		for (auto& client : clients) {
+			client.join();
+		}
+		auto endTime = std::chrono::high_resolution_clock::now();
+		if (reloader.joinable()) {
+			reloader.join();
+		}
+		server.stop();
+
+		for (const auto& error : errors) {
+			if (error) {
+				std::rethrow_exception(error);
+			}
+		}
+		if (reloadError) {
+			std::rethrow_exception(reloadError);
+		}
+
+		double seconds = std::chrono::duration<double>(endTime - startTime).count();
+		std::cout << "Served " << queries->N << " queries from " << clientsNumber << " clients at "
+			<< queries->N / seconds << " QPS" << std::endl;
+
+		QueryResult results;
+		results.offsets.push_back(0);
+		for (const auto& row : rows) {
+			results.idxs.insert(results.idxs.end(), row.idxs.begin(), row.idxs.end());
+			results.distances.insert(results.distances.end(), row.distances.begin(), row.distances.end());
+			results.offsets.push_back(results.idxs.size());
+		}
+		return results;
+	}
+
+	/*
+	 * The new index is built on this thread, beside the one being served, then swapped in: the
+	 * server frees the old one as soon as its last batch is answered.
+	 */
+	void CLI::reloadIndex(QueryServer& server, const argagg::parser_results& args) {
+		std::string datasetFilePath = args["dataset"];
+		Dataset * dataset = args["vectorFile"] ? getStoredDataset(datasetFilePath, args["vectorFile"]) : getDataset(datasetFilePath);
+		std::unique_ptr<LSH> lsh(new LSH(args["hashFunc"], args["tables"], args["binWidth"].as<float>(0.0f), dataset, getIndexOptions(args)));
+		lsh->buildIndex();
+		reportBuild(*lsh, args);
+
+		const Index * index = lsh->getIndex();
+		LSH * owner = lsh.release();
+		server.swapIndex(index, [owner] { delete owner; });
+		std::cout << "Swapped in the rebuilt index" << std::endl;
+	}
+
+	/*
+	 * Runs the queries a batch at a time as the stream reads them, or all at once without a stream,
+	 * and hands the results of every batch to the writer as soon as they are ready.
+	 */
+	void CLI::queryInBatches(Dataset* queries, QueryStream* queryStream, ResultWriter& writer, const std::function<QueryResult(Dataset*)>& query) {
+		if (!queryStream) {
+			writer.submit(query(queries));
+			return;
+		}
+
+		while (std::unique_ptr<Dataset> batch = queryStream->next()) {
+			writer.submit(query(batch.get()));
+		}
+	}
+
+	/*
+	 * What the memory budget took from the build goes to stderr, with --memoryReport what the index
+	 * holds goes to the output.
+	 */
+	void CLI::reportBuild(const LSH& lsh, const argagg::parser_results& args) {
+		for (const auto& step : lsh.getIndex()->getBudgetSteps()) {
+			std::cerr << "Memory budget: " << step << std::endl;
+		}
+		if (args["memoryReport"]) {
+			lsh.getMemoryUsage().report(std::cout);
+		}
+	}
+
+	std::unique_ptr<ResultSink> CLI::openResultSink(const argagg::parser_results& args) {
+		std::string fileName = args["output"].as<std::string>("-");
+		switch (ResultSink::parseFormat(args["format"].as<std::string>("text"))) {
+		case JSON_LINES:
+			return std::unique_ptr<ResultSink>(new JsonLinesResultSink(fileName));
+		case VECS:
+			if (fileName == "-") {
+				throw std::runtime_error("The vecs format needs an --output file");
+			}
+			return std::unique_ptr<ResultSink>(new VecsResultSink(fileName));
+		default:
+			return std::unique_ptr<ResultSink>(new TextResultSink(fileName, groundtruthIdxs, groundtruthDimension));
 		}
 	}
 
 	argagg::parser CLI::getParser()
 	{
 		argagg::parser argparser{{
-			{ "dataset", { "--dataset" }, "The dataset file in .fvecs format", 1 },
-			{ "queries", { "--queries" }, "The queries file in .fvecs format", 1 },
-			{ "groundtruth", { "--groundtruth" }, "The groundtruth file in .ivecs format", 1 },
+			{ "dataset", { "--dataset" }, "The dataset file in .fvecs, .bvecs, .fbin or .u8bin format", 1 },
+			{ "queries", { "--queries" }, "The queries file in .fvecs, .bvecs, .fbin or .u8bin format", 1 },
+			{ "groundtruth", { "--groundtruth" }, "The groundtruth file in .ivecs or .ibin format", 1 },
+			{ "exact", { "--exact" }, "Search exhaustively instead of using LSH", 0 },
+			{ "writeGroundtruth", { "--writeGroundtruth" }, "Compute the exact neighbors of the queries and write them to this .ivecs file", 1 },
 			{ "binWidth", { "-w" }, "", 1},
 			{ "numberOfQueries", { "-q" }, "How many query vectors to load", 1 },
 			{ "neighbors", { "-n" }, "How many neighbors to return per query", 1 },
 			{ "tables", { "-L" }, "The number of hash tables.", 1 },
-			{ "hashFunc", { "-k" }, "The number of hash functions used to project the dataset.", 1 }
+			{ "hashFunc", { "-k" }, "The number of hash functions used to project the dataset.", 1 },
+			{ "compress", { "--compress" }, "Keep the bins delta-encoded and bit-packed to save memory", 0 },
+			{ "buildThreads", { "--buildThreads" }, "How many threads hash the tables during the build (default one per core)", 1 },
+			{ "reorder", { "--reorder" }, "Lay the vectors out on the device in the bucket order of the first table", 0 },
+			{ "family", { "--family" }, "The hash functions of the tables: pstable (default) or crosspolytope, which needs no -w", 1 },
+			{ "probes", { "--probes" }, "How many bins each cross-polytope table looks up per query, the closest first (default 1)", 1 },
+			{ "structured", { "--structured" }, "Compute the p-stable projections with fast Hadamard transforms instead of a dense matrix", 0 },
+			{ "shareFunctions", { "--shareFunctions" }, "Build the tables from pairs of m shared groups of k/2 functions, m(m-1)/2 >= L (k must be even)", 0 },
+			{ "precision", { "--precision" }, "How the vectors are stored on the device: fp32 (default), fp16 or bf16", 1 },
+			{ "vectorFile", { "--vectorFile" }, "Keep the vectors in this store file on the SSD instead of in memory, written from the dataset if missing", 1 },
+			{ "vectorCache", { "--vectorCache" }, "How many vectors of the store file are cached in memory (default 0)", 1 },
+			{ "attributes", { "--attributes" }, "Integer attributes of the dataset vectors in .ivecs or .ibin format, one field per component", 1 },
+			{ "filterTags", { "--filterTags" }, "Only return vectors whose attribute field:tag,tag,... is one of the tags", 1 },
+			{ "filterRange", { "--filterRange" }, "Only return vectors whose attribute field:low:high is in the range", 1 },
+			{ "bruteForceSelectivity", { "--bruteForceSelectivity" }, "Filters matching at most this fraction of the dataset are searched exhaustively (default 0.01)", 1 },
+			{ "minCollisions", { "--minCollisions" }, "Only rerank the candidates found in at least this many tables (default 1)", 1 },
+			{ "rerankCandidates", { "--rerankCandidates" }, "Rerank at most this many candidates per query, those found in the most tables (default all)", 1 },
+			{ "candidateBudget", { "--candidateBudget" }, "Stop probing tables for a query once it has this many candidates, auto for 3*L*K as in E2LSH (default unbounded)", 1 },
+			{ "stopDistance", { "--stopDistance" }, "Stop probing tables for a query once its nth neighbor is within this distance", 1 },
+			{ "tablesPerRound", { "--tablesPerRound" }, "With a budget or a stop distance, how many tables are probed between two reranks (default 4)", 1 },
+			{ "radius", { "--radius" }, "Return all the vectors within this distance of each query instead of the n nearest", 1 },
+			{ "maxMatches", { "--maxMatches" }, "With --radius, stop looking for matches of a query once it has this many (default all)", 1 },
+			{ "selfJoin", { "--selfJoin" }, "Join the dataset with itself instead of querying: the pairs within --radius, or the graph of the n nearest neighbors", 0 },
+			{ "maxBinSize", { "--maxBinSize" }, "With --selfJoin, skip the bins holding more vectors than this (default 4096 with --radius, 64*n for the graph)", 1 },
+			{ "output", { "--output" }, "Write the results to this file instead of stdout, as the batches of queries complete", 1 },
+			{ "format", { "--format" }, "The format of the results: text (default), jsonl, or vecs for the ids in <output>.ivecs and the distances in <output>.fvecs", 1 },
+			{ "queryBatch", { "--queryBatch" }, "Stream the queries this many at a time, reading and writing around the search of a batch (default all at once, 1024 from stdin)", 1 },
+			{ "queryFormat", { "--queryFormat" }, "The format of queries read from stdin with --queries -: fvecs, bvecs, fbin or u8bin", 1 },
+			{ "writeGraph", { "--writeGraph" }, "With --selfJoin, write the neighbors of every vector to this .ivecs file instead of printing them", 1 },
+			{ "benchmark", { "--benchmark" }, "Time every stage of the index on synthetic data, -q, -k, -L, -w and -n set its sizes", 0 },
+			{ "rows", { "--rows" }, "With --benchmark, how many vectors are generated (default 1048576)", 1 },
+			{ "dimension", { "--dimension" }, "With --benchmark, the dimension of the vectors (default 128)", 1 },
+			{ "distribution", { "--distribution" }, "With --benchmark, how the vectors are drawn: uniform (default) or gaussian clusters", 1 },
+			{ "clusters", { "--clusters" }, "With --distribution gaussian, how many clusters (default 64)", 1 },
+			{ "spread", { "--spread" }, "With --distribution gaussian, the standard deviation around the centers (default 0.1)", 1 },
+			{ "bins", { "--bins" }, "With --benchmark, over how many buckets the codes are drawn (default 65536)", 1 },
+			{ "skew", { "--skew" }, "With --benchmark, the Zipf exponent of the bucket sizes, 0 for even ones (default 1)", 1 },
+			{ "candidates", { "--candidates" }, "With --benchmark, the candidates of every query in every table (default 100)", 1 },
+			{ "repetitions", { "--repetitions" }, "With --benchmark, the timed runs of every stage (default 10)", 1 },
+			{ "seed", { "--seed" }, "With --benchmark, the seed of the synthetic data (default 1)", 1 },
+			{ "comparePrecision", { "--comparePrecision" }, "Build the index in fp32 and in --precision (default fp16) and compare buckets, recall and times", 0 },
+			{ "clients", { "--clients" }, "Send the queries one by one from this many threads through the query server", 1 },
+			{ "workers", { "--workers" }, "How many worker threads the query server runs (default 2)", 1 },
+			{ "maxBatch", { "--maxBatch" }, "The largest batch the query server coalesces (default 64)", 1 },
+			{ "maxDelay", { "--maxDelay" }, "How long in microseconds a query may wait for its batch to fill (default 500)", 1 },
+			{ "reload", { "--reload" }, "Rebuild the index from the dataset file while the clients query, and swap it into the query server", 0 },
+			{ "tune", { "--tune" }, "Search k, L and w instead of querying. -L becomes the maximum number of tables", 0 },
+			{ "recall", { "--recall" }, "The recall@n the tuner has to reach (default 0.9)", 1 },
+			{ "hugePages", { "--hugePages" }, "Back the datasets and tables with none, transparent or explicit (reserved) huge pages, falling back to normal ones (default transparent)", 1 },
+			{ "memoryBudget", { "--memoryBudget" }, "The memory in MB the index, or the tuned one, may take on the host and device together (default unlimited)", 1 },
+			{ "memoryReport", { "--memoryReport" }, "Print the memory the index holds once built, by category", 0 },
+			{ "sampleSize", { "--sampleSize" }, "How many dataset vectors the tuner samples when no groundtruth is given", 1 }
 		}};
 		return argparser;
 	}
 
 	bool CLI::checkArgs(argagg::parser_results* args)
 	{
-		std::string requiredArgs[] = { "dataset", "queries", "groundtruth", "numberOfQueries", "neighbors", "tables", "hashFunc", "binWidth" };
+		if ((*args)["benchmark"]) {
+			return true;
+		}
+		std::vector<std::string> requiredArgs = { "dataset" };
+		if (!(*args)["selfJoin"]) {
+			requiredArgs.push_back("queries");
+			// only the plain search streams its queries, read to the end of their input unless -q caps them
+			bool isStreamed = ((*args)["queryBatch"] || (*args)["queries"].as<std::string>("") == "-")
+				&& !((*args)["tune"] || (*args)["writeGroundtruth"] || (*args)["comparePrecision"]);
+			if (!isStreamed) {
+				requiredArgs.push_back("numberOfQueries");
+			}
+		}
+		if (!(*args)["radius"]) {
+			requiredArgs.push_back("neighbors");
+			// the neighbor graph of a self-join without neighbors would be empty
+			if ((*args)["selfJoin"] && (*args)["neighbors"].as<int>(0) <= 0) {
+				return false;
+			}
+		}
+		if (!((*args)["tune"] || (*args)["exact"] || (*args)["writeGroundtruth"])) {
+			requiredArgs.insert(requiredArgs.end(), { "tables", "hashFunc" });
+			if ((*args)["family"].as<std::string>("pstable") != "crosspolytope") {
+				requiredArgs.push_back("binWidth");
+			}
+		}
 		for (const auto &argName : requiredArgs) {
 			if (!(*args)[argName]) return false;
 		}
 
 		return true;
 	}
+	HashFamily CLI::getHashFamily(const argagg::parser_results& args) {
+		std::string family = args["family"].as<std::string>("pstable");
+		if (family == "pstable") {
+			return PSTABLE;
+		}
+		if (family == "crosspolytope") {
+			return CROSS_POLYTOPE;
+		}
+		throw std::runtime_error("Unknown hash family " + family + ", expected pstable or crosspolytope");
+	}
+
+	IndexOptions CLI::getIndexOptions(const argagg::parser_results& args) {
+		IndexOptions options;
+		options.compressPostings = args["compress"];
+		options.buildThreads = args["buildThreads"].as<int>(0);
+		options.reorderByBuckets = args["reorder"];
+		options.shareHashFunctions = args["shareFunctions"];
+		options.hashFamily = getHashFamily(args);
+		options.structuredProjections = args["structured"];
+		options.storagePrecision = PrecisionConverter::parse(args["precision"].as<std::string>("fp32"));
+		options.vectorFile = args["vectorFile"].as<std::string>("");
+		options.vectorCacheRows = args["vectorCache"].as<size_t>(0);
+		options.memoryBudget = args["memoryBudget"].as<size_t>(0) * 1024 * 1024;
+		return options;
+	}
+
 	Dataset * CLI::getDataset(std::string filePath)
 	{
-		auto f = new FvecsReader(filePath);
+		std::unique_ptr<VectorFileReader> f(VectorFileReader::open(filePath));
 		return f->readAllVectors();
 	}
 
 	Dataset * CLI::getDataset(std::string filePath, int howMany)
 	{
-		auto f = new FvecsReader(filePath);
+		std::unique_ptr<VectorFileReader> f(VectorFileReader::open(filePath));
 		return f->readVectors(howMany);
 	}
 
-	vector<vector<int>> CLI::loadGroundTruthIdxs(std::string filePath, int howMany) {
-		auto f = new IvecsReader(filePath);
-		return f->readGroundTruthIdxs(howMany);
+	/*
+	 * With the vectors on the SSD the dataset only carries their number and dimension, it has no rows. The store file
+	 * is written from the dataset file, a chunk at a time, the first time it is used.
+	 */
+	Dataset * CLI::getStoredDataset(std::string filePath, std::string storeFilePath)
+	{
+		if (!std::ifstream(storeFilePath).good()) {
+			std::unique_ptr<VectorFileReader> f(VectorFileReader::open(filePath));
+			VectorStore::create(storeFilePath, *f);
+		}
+		VectorStore store(storeFilePath, 0);
+		return new Dataset((float *) 0, store.getVectorsNumber(), store.getDimension(), store.getDimension());
+	}
+
+	/*
+	 * The attributes file holds one integer vector per dataset vector, each component a field.
+	 * --filterTags field:tag,tag,... and --filterRange field:low:high select on them; both
+	 * given, a vector has to match both.
+	 */
+	bool CLI::loadFilter(const argagg::parser_results& args, int N, Bitmap& filter) {
+		if (!(args["filterTags"] || args["filterRange"])) {
+			return false;
+		}
+		if (!args["attributes"]) {
+			throw std::runtime_error("Filtering needs the --attributes file");
+		}
+
+		std::unique_ptr<VectorFileReader> f(VectorFileReader::open(args["attributes"]));
+		int fieldsNumber = f->getDimension();
+		if (f->getVectorsNumber() < N) {
+			throw std::runtime_error("The attributes file does not cover the whole dataset");
+		}
+		std::vector<int> values = f->readIdxs(N);
+
+		AttributeStore attributes(N);
+		std::vector<int> column(N);
+		for (int field = 0; field < fieldsNumber; ++field) {
+			for (int i = 0; i < N; ++i) {
+				column[i] = values[(size_t) i * fieldsNumber + field];
+			}
+			attributes.addField(column.data());
+		}
+
+		bool hasFilter = false;
+		if (args["filterTags"]) {
+			std::string spec = args["filterTags"];
+			size_t colon = spec.find(':');
+			if (colon == std::string::npos) {
+				throw std::runtime_error("--filterTags expects field:tag,tag,...");
+			}
+			std::vector<int> tags;
+			for (size_t start = colon + 1; start < spec.size();) {
+				size_t comma = spec.find(',', start);
+				if (comma == std::string::npos) {
+					comma = spec.size();
+				}
+				tags.push_back(std::stoi(spec.substr(start, comma - start)));
+				start = comma + 1;
+			}
+			filter = attributes.matchTags(std::stoi(spec.substr(0, colon)), tags);
+			hasFilter = true;
+		}
+		if (args["filterRange"]) {
+			std::string spec = args["filterRange"];
+			size_t first = spec.find(':');
+			size_t second = first == std::string::npos ? first : spec.find(':', first + 1);
+			if (second == std::string::npos) {
+				throw std::runtime_error("--filterRange expects field:low:high");
+			}
+			Bitmap range = attributes.matchRange(
+				std::stoi(spec.substr(0, first)),
+				std::stoi(spec.substr(first + 1, second - first - 1)),
+				std::stoi(spec.substr(second + 1))
+			);
+			filter = hasFilter ? filter.intersect(range) : range;
+		}
+
+		std::cout << "Filter matches " << filter.getCardinality() << " of " << N << " vectors" << std::endl;
+		return true;
+	}
+
+	void CLI::loadGroundTruthIdxs(std::string filePath, int howMany) {
+		std::unique_ptr<VectorFileReader> f(VectorFileReader::open(filePath));
+		// streamed queries are not counted ahead, so all the ground truth is there for them
+		groundtruthIdxs = howMany > 0 ? f->readIdxs(howMany) : f->readAllIdxs();
+		groundtruthDimension = f->getDimension();
 	}
 }
 
@@ -1,10 +1,19 @@
 #ifndef __cuANN_CLI_H__
 #define __cuANN_CLI_H__
 
+#include <functional>
+#include <memory>
 #include <vector>
 #include "QueryResult.h"
+#include "ResultSink.h"
+#include "ResultWriter.h"
+#include "QueryStream.h"
 #include "argagg.hpp"
 #include "Dataset.h"
+#include "Index.h"
+#include "LSH.h"
+#include "Bitmap.h"
+#include "QueryServer.h"
 
 using namespace std;
 
@@ -18,18 +27,38 @@ namespace cuANN {
 		int startLSH();
 
 	private:
+		static constexpr unsigned DEFAULT_QUERY_BATCH = 1024;
+
 		argagg::parser argparser;
 		int argcount;
 		char** argvalue;
-		vector<vector<int>> groundtruthIdxs;
+		vector<int> groundtruthIdxs;
+		int groundtruthDimension;
 
 		argagg::parser getParser();
 		bool checkArgs(argagg::parser_results *args);
+		int startTuner(const argagg::parser_results& args);
+		int startGroundTruthWriter(const argagg::parser_results& args);
+		int startPrecisionComparison(const argagg::parser_results& args);
+		int startSelfJoin(const argagg::parser_results& args);
+		int startBenchmark(const argagg::parser_results& args);
+		IndexOptions getIndexOptions(const argagg::parser_results& args);
 		Dataset * getDataset(std::string filePath);
 		Dataset * getDataset(std::string filePath, int howMany);
-		vector<vector<int>> loadGroundTruthIdxs(std::string filePath, int howMany);
+		Dataset * getStoredDataset(std::string filePath, std::string storeFilePath);
+		void loadGroundTruthIdxs(std::string filePath, int howMany);
+		HashFamily getHashFamily(const argagg::parser_results& args);
+		bool loadFilter(const argagg::parser_results& args, int N, Bitmap& filter);
+
+		QueryResult queryConcurrently(const Index* index, Dataset* queries, int numberOfNeighbors, const argagg::parser_results& args);
+
+		void reloadIndex(QueryServer& server, const argagg::parser_results& args);
+
+		void queryInBatches(Dataset* queries, QueryStream* queryStream, ResultWriter& writer, const std::function<QueryResult(Dataset*)>& query);
+
+		void reportBuild(const LSH& lsh, const argagg::parser_results& args);
 
-		void printResults(const std::vector<QueryResult>& results);
+		std::unique_ptr<ResultSink> openResultSink(const argagg::parser_results& args);
 	};
 }
 
@@ -0,0 +1,171 @@
+#ifndef __cuANN_CrossPolytopeHasher__
+#define __cuANN_CrossPolytopeHasher__
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <thread>
+#include <thrust/copy.h>
+#include <thrust/transform.h>
+#include "CrossPolytopeHasher.h"
+#include "FastHadamard.h"
+#include "utils.h"
+
+namespace cuANN {
+	constexpr int CrossPolytopeHasher::MIN_QUERIES_PER_THREAD;
+
+	CrossPolytopeHasher::CrossPolytopeHasher(int k, int d) {
+		this->k = k;
+		this->d = d;
+		this->paddedD = FastHadamard::getPaddedSize(d);
+	}
+
+	void CrossPolytopeHasher::generate(curandGenerator_t* uniformGen) {
+		size_t size = (size_t) k * 3 * paddedD;
+		dSigns.resize(size);
+		curandGenerateUniform(*uniformGen, thrust::raw_pointer_cast(dSigns.data()), size);
+		thrust::transform(dSigns.begin(), dSigns.end(), dSigns.begin(), toRandomSign());
+
+		signs.resize(size);
+		thrust::copy(dSigns.begin(), dSigns.end(), signs.begin());
+	}
+
+	void CrossPolytopeHasher::freeMemory() {
+		signs.clear();
+		signs.shrink_to_fit();
+		dSigns.clear();
+		dSigns.shrink_to_fit();
+	}
+
+	/*
+	 * Same contract as HashTable::hashRows: one block per row, the rotations are done in shared memory.
+	 */
+	void CrossPolytopeHasher::hashRows(const void* dMatrix, Precision matrixPrecision, const int rowBegin, const int rowEnd, size_t* dHashes, ExecutionContext& context) const {
+		int rows = rowEnd - rowBegin;
+		if (rows <= 0) {
+			return;
+		}
+		const char * dRows = (const char *) dMatrix + (size_t) rowBegin * d * PrecisionConverter::getElementSize(matrixPrecision);
+
+		// a power of two, the reduction of the largest coordinate halves it
+		int threads = std::min(256, std::max(1, paddedD / 2));
+		size_t sharedBytes = paddedD * sizeof(float) + threads * (sizeof(float) + sizeof(int));
+		if (matrixPrecision == FLOAT32) {
+			hashCrossPolytope<<<rows, threads, sharedBytes, context.getStream()>>>(
+				(const float *) dRows, rows, d, paddedD, k,
+				thrust::raw_pointer_cast(dSigns.data()),
+				dHashes + rowBegin
+			);
+		} else {
+			hashCrossPolytope<<<rows, threads, sharedBytes, context.getStream()>>>(
+				(const unsigned short *) dRows, matrixPrecision, rows, d, paddedD, k,
+				thrust::raw_pointer_cast(dSigns.data()),
+				dHashes + rowBegin
+			);
+		}
+	}
+
+	/*
+	 * Hashes the queries, already on the host, into probes codes each for multi-probe lookups: the code
+	 * of their own bin first, then those with the vertex of one function moved to another of its
+	 * coordinates, cheapest first, the cost being how much smaller that coordinate is than the largest
+	 * one. probes must be at most getMaxProbes(). The rotations match the device ones bitwise, so the
+	 * first code is the one hashRows gives. The queries are split between threads.
+	 */
+	void CrossPolytopeHasher::hashQueries(const float* queries, const int Q, const int probes, size_t* dHashes, ExecutionContext& context) const {
+		ScratchBuffer<size_t> hashes(context.getHostArena(), (size_t) Q * probes);
+		int threadsNumber = std::max(1, std::min<int>(std::thread::hardware_concurrency(), Q / MIN_QUERIES_PER_THREAD));
+		int queriesPerThread = (Q + threadsNumber - 1) / threadsNumber;
+		std::vector<std::thread> threads;
+		for (int queryBegin = queriesPerThread; queryBegin < Q; queryBegin += queriesPerThread) {
+			threads.emplace_back(&CrossPolytopeHasher::hashQueryRange, this, queries, queryBegin, std::min(Q, queryBegin + queriesPerThread), probes, hashes.data());
+		}
+		hashQueryRange(queries, 0, std::min(Q, queriesPerThread), probes, hashes.data());
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		cudaMemcpyAsync(dHashes, hashes.data(), (size_t) Q * probes * sizeof(size_t), cudaMemcpyHostToDevice, context.getStream());
+		// the pinned buffer goes back to the arena on return
+		context.synchronize();
+	}
+
+	int CrossPolytopeHasher::getMaxProbes() const {
+		return 1 + k * (paddedD - 1);
+	}
+
+	void CrossPolytopeHasher::hashQueryRange(const float* queries, const int queryBegin, const int queryEnd, const int probes, size_t* hashes) const {
+		struct Perturbation {
+			float cost;
+			int function;
+			unsigned vertex;
+		};
+
+		std::vector<float> rotated(paddedD);
+		std::vector<int> coordinates(paddedD);
+		std::vector<unsigned> vertices(k);
+		std::vector<Perturbation> perturbations;
+		int alternatives = std::min(paddedD, probes);
+		for (int query = queryBegin; query < queryEnd; ++query) {
+			perturbations.clear();
+			for (int function = 0; function < k; ++function) {
+				rotate(queries + (size_t) query * d, function, rotated.data());
+
+				// by decreasing magnitude, the lower coordinate first on ties as on the device
+				std::iota(coordinates.begin(), coordinates.end(), 0);
+				std::partial_sort(coordinates.begin(), coordinates.begin() + alternatives, coordinates.end(), [&rotated](int a, int b) {
+					float magnitudeA = std::fabs(rotated[a]);
+					float magnitudeB = std::fabs(rotated[b]);
+					return magnitudeA > magnitudeB || (magnitudeA == magnitudeB && a < b);
+				});
+
+				int largest = coordinates[0];
+				vertices[function] = toCrossPolytopeVertex(largest, rotated[largest]);
+				for (int i = 1; i < alternatives; ++i) {
+					int coordinate = coordinates[i];
+					perturbations.push_back({
+						std::fabs(rotated[largest]) - std::fabs(rotated[coordinate]),
+						function,
+						toCrossPolytopeVertex(coordinate, rotated[coordinate])
+					});
+				}
+			}
+
+			// every probe past the first has its own perturbation, as probes is at most getMaxProbes()
+			std::partial_sort(perturbations.begin(), perturbations.begin() + (probes - 1), perturbations.end(),
+				[](const Perturbation& a, const Perturbation& b) {
+					return a.cost < b.cost;
+				}
+			);
+
+			size_t * queryHashes = hashes + (size_t) query * probes;
+			for (int probe = 0; probe < probes; ++probe) {
+				const Perturbation * perturbation = probe > 0 ? &perturbations[probe - 1] : 0;
+				size_t seed = 0;
+				for (int function = 0; function < k; ++function) {
+					unsigned vertex = perturbation && perturbation->function == function ? perturbation->vertex : vertices[function];
+					seed = mixCrossPolytopeVertex(seed, vertex);
+				}
+				queryHashes[probe] = seed;
+			}
+		}
+	}
+
+	void CrossPolytopeHasher::addMemoryUsage(MemoryUsage& usage) const {
+		usage.add(MemoryUsage::PROJECTIONS, signs.capacity() * sizeof(float), dSigns.capacity() * sizeof(float));
+	}
+
+	void CrossPolytopeHasher::rotate(const float* vector, int function, float* rotated) const {
+		std::copy(vector, vector + d, rotated);
+		std::fill(rotated + d, rotated + paddedD, 0.0f);
+		for (int round = 0; round < 3; ++round) {
+			const float * roundSigns = signs.data() + ((size_t) function * 3 + round) * paddedD;
+			for (int i = 0; i < paddedD; ++i) {
+				rotated[i] *= roundSigns[i];
+			}
+			FastHadamard::transform(rotated, paddedD);
+		}
+	}
+}
+
+#endif // !__cuANN_CrossPolytopeHasher__
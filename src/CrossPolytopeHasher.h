@@ -0,0 +1,53 @@
+#ifndef __cuANN_CROSSPOLYTOPEHASHER_H_
+#define __cuANN_CROSSPOLYTOPEHASHER_H_
+
+#include <vector>
+#include <curand.h>
+#include "commons.h"
+#include "PrecisionConverter.h"
+#include "ExecutionContext.h"
+#include "MemoryUsage.h"
+
+namespace cuANN {
+	/*
+	 * k cross-polytope hash functions, as in FALCONN: a vector is rotated by three rounds of random
+	 * sign flips and Walsh-Hadamard transforms, zero padded to a power of two, and hashed to the
+	 * closest vertex of the cross-polytope, its largest coordinate with the sign. The k vertices are
+	 * mixed into the code of the bin. Hashing costs O(d log d) per function instead of O(d).
+	 */
+	class CrossPolytopeHasher
+	{
+	public:
+		CrossPolytopeHasher(int k, int d);
+
+		void generate(curandGenerator_t* uniformGen);
+
+		void freeMemory();
+
+		void hashRows(const void* dMatrix, Precision matrixPrecision, const int rowBegin, const int rowEnd, size_t* dHashes, ExecutionContext& context) const;
+
+		void hashQueries(const float* queries, const int Q, const int probes, size_t* dHashes, ExecutionContext& context) const;
+
+		// bins a query can be given without repeating one: its own and one per other coordinate of each function
+		int getMaxProbes() const;
+
+		void addMemoryUsage(MemoryUsage& usage) const;
+
+	private:
+		// queries hashed by each thread of hashQueries at least
+		static constexpr int MIN_QUERIES_PER_THREAD = 64;
+
+		int k;
+		int d;
+		int paddedD;
+		// 3 rounds of paddedD signs per function, +1 or -1
+		std::vector<float> signs;
+		ThrustFloatV dSigns;
+
+		void rotate(const float* vector, int function, float* rotated) const;
+
+		void hashQueryRange(const float* queries, const int queryBegin, const int queryEnd, const int probes, size_t* hashes) const;
+	};
+}
+
+#endif /* __cuANN_CROSSPOLYTOPEHASHER_H_ */
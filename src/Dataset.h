@@ -1,16 +1,34 @@
 #ifndef __cuANN_Dataset__
 #define __cuANN_Dataset__
 
+#include <algorithm>
+#include <cstdint>
 #include <cstdlib>
+#include "HostAllocator.h"
 
 namespace cuANN {
+	// N rows of dimension d, ld components apart, in a block of HostAllocator the dataset owns.
+	// The components are floats, or the bytes of a uint8 file kept as they are: those are only widened
+	// a chunk at a time where they are used, see copyRows and uploadRows.
+	// Both blocks are null when the rows are only in a vector store: check hasRows before reading them.
 	struct Dataset
 	{
 		Dataset(float* dataset, int N, int d, int ld);
 
+		Dataset(uint8_t* bytes, int N, int d, int ld);
+
 		~Dataset();
 
+		bool hasRows() const;
+
+		// the host bytes of the rows, padding included
+		size_t getRowsBytes() const;
+
+		// the rows [start, start + count) as floats, d apart
+		void copyRows(long long start, long long count, float* rows) const;
+
 		float * dataset;
+		uint8_t * bytes;
 		int N;
 		int d;
 		int ld;
@@ -18,13 +36,41 @@ namespace cuANN {
 
 	inline Dataset::Dataset(float* dataset, int N, int d, int ld) {
 		this->dataset = dataset;
+		this->bytes = 0;
+		this->N = N;
+		this->d = d;
+		this->ld = ld;
+	}
+
+	inline Dataset::Dataset(uint8_t* bytes, int N, int d, int ld) {
+		this->dataset = 0;
+		this->bytes = bytes;
 		this->N = N;
 		this->d = d;
 		this->ld = ld;
 	}
 
 	inline Dataset::~Dataset() {
-		free(dataset);
+		HostAllocator::release(dataset);
+		HostAllocator::release(bytes);
+	}
+
+	inline bool Dataset::hasRows() const {
+		return dataset != 0 || bytes != 0;
+	}
+
+	inline size_t Dataset::getRowsBytes() const {
+		return (size_t) N * ld * (dataset ? sizeof(float) : bytes ? sizeof(uint8_t) : 0);
+	}
+
+	inline void Dataset::copyRows(long long start, long long count, float* rows) const {
+		for (long long row = 0; row < count; ++row) {
+			if (dataset) {
+				std::copy_n(dataset + (start + row) * ld, d, rows + row * d);
+			} else {
+				std::copy_n(bytes + (start + row) * ld, d, rows + row * d);
+			}
+		}
 	}
 }
 
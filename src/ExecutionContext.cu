@@ -0,0 +1,51 @@
+#ifndef __cuANN_ExecutionContext__
+#define __cuANN_ExecutionContext__
+
+#include <stdexcept>
+#include "ExecutionContext.h"
+
+namespace cuANN {
+	ExecutionContext::ExecutionContext() : deviceArena(ScratchArena::DEVICE), hostArena(ScratchArena::PINNED_HOST) {
+		// never ordered behind the default stream, so the contexts of the build workers overlap
+		// whether or not the code is compiled with --default-stream per-thread
+		if (cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking) != cudaSuccess) {
+			throw std::runtime_error("Cannot create CUDA stream.");
+		}
+		if (cublasCreate(&cublasHandle) != CUBLAS_STATUS_SUCCESS) {
+			cudaStreamDestroy(stream);
+			throw std::runtime_error("Cannot create cuBLAS handle.");
+		}
+		cublasSetStream(cublasHandle, stream);
+	}
+
+	ExecutionContext::~ExecutionContext() {
+		// the arenas are released after this body, nothing may still be running on their blocks
+		cudaStreamSynchronize(stream);
+		cublasDestroy(cublasHandle);
+		cudaStreamDestroy(stream);
+	}
+
+	cublasHandle_t ExecutionContext::getCublasHandle() const {
+		return cublasHandle;
+	}
+
+	cudaStream_t ExecutionContext::getStream() const {
+		return stream;
+	}
+
+	ScratchArena& ExecutionContext::getDeviceArena() {
+		return deviceArena;
+	}
+
+	ScratchArena& ExecutionContext::getHostArena() {
+		return hostArena;
+	}
+
+	void ExecutionContext::synchronize() const {
+		if (cudaStreamSynchronize(stream) != cudaSuccess) {
+			throw std::runtime_error("Error while waiting for the CUDA stream.");
+		}
+	}
+}
+
+#endif // !__cuANN_ExecutionContext__
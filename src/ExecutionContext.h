@@ -0,0 +1,63 @@
+#ifndef __cuANN_EXECUTIONCONTEXT_H_
+#define __cuANN_EXECUTIONCONTEXT_H_
+
+#include <vector>
+#include <cuda_runtime.h>
+#include <cublas_v2.h>
+#ifdef __CUDACC__
+#include <thrust/system/cuda/execution_policy.h>
+#endif
+#include "commons.h"
+#include "ScratchArena.h"
+#include "ThrustQueryResult.h"
+
+namespace cuANN {
+	/*
+	 * Long-lived state of a single caller of the index: a stream, a cuBLAS handle bound to it
+	 * and the arenas its scratch buffers come from, plus the candidate sets of the last query,
+	 * whose storage is reused by the next one. Everything is created once, so a caller keeping
+	 * its context across batches stops allocating once it has seen its largest batch.
+	 * A context must never be used by two threads at once. Its stream does not synchronize with
+	 * the default one: work queued there is only ordered by blocking calls such as the thrust
+	 * algorithms without a policy or cudaMemcpy.
+	 */
+	class ExecutionContext
+	{
+	public:
+		ExecutionContext();
+
+		ExecutionContext(const ExecutionContext &) = delete;
+
+		~ExecutionContext();
+
+		cublasHandle_t getCublasHandle() const;
+
+		cudaStream_t getStream() const;
+
+		ScratchArena& getDeviceArena();
+
+		ScratchArena& getHostArena();
+
+		void synchronize() const;
+
+		std::vector<ThrustQueryResult> tableResults;
+		ThrustQueryResult mergedResult;
+
+	private:
+		cudaStream_t stream;
+		cublasHandle_t cublasHandle;
+		ScratchArena deviceArena;
+		ScratchArena hostArena;
+	};
+
+#ifdef __CUDACC__
+	/*
+	 * Thrust policy running on the stream of the context and taking its temporaries from the device arena.
+	 */
+	inline auto onContext(ExecutionContext& context) -> decltype(thrust::cuda::par(context.getDeviceArena()).on(context.getStream())) {
+		return thrust::cuda::par(context.getDeviceArena()).on(context.getStream());
+	}
+#endif
+}
+
+#endif /* __cuANN_EXECUTIONCONTEXT_H_ */
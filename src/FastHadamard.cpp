@@ -0,0 +1,67 @@
+#ifndef __cuANN_FastHadamard__
+#define __cuANN_FastHadamard__
+
+#include "FastHadamard.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CUANN_X86_DISPATCH
+#endif
+
+namespace cuANN {
+	// the butterflies of the stages from half on
+	static void transformStages(float* values, size_t size, size_t half) {
+		for (; half < size; half *= 2) {
+			for (size_t block = 0; block < size; block += 2 * half) {
+				for (size_t i = block; i < block + half; ++i) {
+					float a = values[i];
+					float b = values[i + half];
+					values[i] = a + b;
+					values[i + half] = a - b;
+				}
+			}
+		}
+	}
+
+#ifdef CUANN_X86_DISPATCH
+	/*
+	 * Compiled for AVX whatever the target of the build, only called when the CPU has it and size is
+	 * at least 16. The first three stages stay inside register-sized blocks and are left to the scalar loop.
+	 */
+	__attribute__((target("avx")))
+	static void transformAVX(float* values, size_t size) {
+		for (size_t block = 0; block < size; block += 8) {
+			transformStages(values + block, 8, 1);
+		}
+		for (size_t half = 8; half < size; half *= 2) {
+			for (size_t block = 0; block < size; block += 2 * half) {
+				for (size_t i = block; i < block + half; i += 8) {
+					__m256 a = _mm256_loadu_ps(values + i);
+					__m256 b = _mm256_loadu_ps(values + i + half);
+					_mm256_storeu_ps(values + i, _mm256_add_ps(a, b));
+					_mm256_storeu_ps(values + i + half, _mm256_sub_ps(a, b));
+				}
+			}
+		}
+	}
+#endif
+
+	void FastHadamard::transform(float* values, size_t size) {
+#ifdef CUANN_X86_DISPATCH
+		if (size >= 16 && __builtin_cpu_supports("avx")) {
+			transformAVX(values, size);
+			return;
+		}
+#endif
+		transformStages(values, size, 1);
+	}
+
+	size_t FastHadamard::getPaddedSize(size_t size) {
+		size_t padded = 1;
+		while (padded < size) {
+			padded *= 2;
+		}
+		return padded;
+	}
+}
+
+#endif // !__cuANN_FastHadamard__
@@ -0,0 +1,25 @@
+#ifndef __cuANN_FASTHADAMARD_H_
+#define __cuANN_FASTHADAMARD_H_
+
+#include <cstddef>
+
+namespace cuANN {
+	/*
+	 * Unnormalized Walsh-Hadamard transform on the host. Every stage is computed as the butterflies
+	 * a + b and a - b of the previous one, the same sums the device kernels do, so both sides get
+	 * bitwise the same result. AVX is used when the CPU has it, whatever the build targets.
+	 */
+	class FastHadamard
+	{
+	public:
+		// in place, size must be a power of two
+		static void transform(float* values, size_t size);
+
+		static size_t getPaddedSize(size_t size);
+
+	private:
+		FastHadamard() {}
+	};
+}
+
+#endif /* __cuANN_FASTHADAMARD_H_ */
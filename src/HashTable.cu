@@ -1,25 +1,37 @@
 #ifndef __cuANN_HashTable__
 #define __cuANN_HashTable__
 
+#include <algorithm>
+#include <vector>
 #include <thrust/gather.h>
 #include <thrust/count.h>
 #include <thrust/adjacent_difference.h>
 #include <thrust/iterator/constant_iterator.h>
+#include <thrust/iterator/counting_iterator.h>
 #include <thrust/sequence.h>
 #include <thrust/copy.h>
 #include "HashTable.h"
+#include "HostAllocator.h"
 #include "QueryBinCalculator.h"
+#include "PostingListCodec.h"
+#include "FastHadamard.h"
 #include "utils.h"
 
 namespace cuANN {
-	HashTable::HashTable(int k, int d, float w) {
+	HashTable::HashTable(int k, int d, float w, const IndexOptions& options) : crossPolytope(k, d) {
 		this->k = k;
 		this->d = d;
 		this->w = w;
 		this->N = binsNumber = 0;
+		this->compressPostings = options.compressPostings;
+		this->precision = options.storagePrecision;
+		this->family = options.hashFamily;
+		this->structuredProjections = options.structuredProjections;
+		this->paddedD = FastHadamard::getPaddedSize(d);
 		binCodes = 0;
+		compressedWordsNumber = 0;
 		projectionsMatrix = offsetVector = 0;
-		binSizes = binStartingIndexes = sortedMappingIdxs = 0;
+		binSizes = binStartingIndexes = sortedMappingIdxs = compressedPostings = postingOffsets = 0;
 	}
 
 	HashTable::~HashTable() {
@@ -28,10 +40,17 @@ namespace cuANN {
 
 	void HashTable::allocateProjectionMemory() {
 		freeProjectionMemory();
+		if (family == CROSS_POLYTOPE) {
+			// the rotations are drawn straight into their device and host vectors
+			return;
+		}
 
-		projectionsMatrix = (float *)malloc(k * d * sizeof(float));
-		offsetVector = (float *)malloc(k * sizeof(float));
-		if (!(projectionsMatrix && offsetVector))
+		// structured projections keep no matrix, only the diagonals on the device
+		if (!structuredProjections) {
+			projectionsMatrix = (float *) HostAllocator::allocate(k * d * sizeof(float));
+		}
+		offsetVector = (float *) HostAllocator::allocate(k * sizeof(float));
+		if (!((projectionsMatrix || structuredProjections) && offsetVector))
 		{
 			throw std::runtime_error("Cannot allocate projections memory");
 		}
@@ -40,12 +59,17 @@ namespace cuANN {
 	void HashTable::allocateBinsMemory() {
 		freeBinsMemory();
 
-		binSizes = (unsigned *) malloc(binsNumber * sizeof(unsigned));
-		binStartingIndexes = (unsigned *) malloc(binsNumber * sizeof(unsigned));
-		sortedMappingIdxs = (unsigned *) malloc(N * sizeof(unsigned));
-		binCodes = (size_t *) malloc(binsNumber * sizeof(size_t));
+		binSizes = (unsigned *) HostAllocator::allocate(binsNumber * sizeof(unsigned));
+		binCodes = (size_t *) HostAllocator::allocate(binsNumber * sizeof(size_t));
+		// compressed bins are found by their word offsets, their starts are only a prefix sum of the sizes
+		if (compressPostings) {
+			postingOffsets = (unsigned *) HostAllocator::allocate(binsNumber * sizeof(unsigned));
+		} else {
+			binStartingIndexes = (unsigned *) HostAllocator::allocate(binsNumber * sizeof(unsigned));
+			sortedMappingIdxs = (unsigned *) HostAllocator::allocate(N * sizeof(unsigned));
+		}
 
-		if (!(binSizes && binStartingIndexes && sortedMappingIdxs && binCodes))
+		if (!(binSizes && binCodes && ((binStartingIndexes && sortedMappingIdxs) || postingOffsets)))
 		{
 			throw std::runtime_error("Cannot allocate bins memory");
 		}
@@ -59,43 +83,76 @@ namespace cuANN {
 	void HashTable::freeProjectionMemory() {
 		if (projectionsMatrix)
 		{
-			free(projectionsMatrix);
+			HostAllocator::release(projectionsMatrix);
 		}
 		if (offsetVector)
 		{
-			free(offsetVector);
+			HostAllocator::release(offsetVector);
 		}
 
 		projectionsMatrix = offsetVector = 0;
+		dProjectionsMatrix.clear();
+		dProjectionsMatrix.shrink_to_fit();
+		dOffsetVector.clear();
+		dOffsetVector.shrink_to_fit();
+		dProjectionsHalf.clear();
+		dProjectionsHalf.shrink_to_fit();
+		dSigns.clear();
+		dSigns.shrink_to_fit();
+		dPermutations.clear();
+		dPermutations.shrink_to_fit();
+		dGaussians.clear();
+		dGaussians.shrink_to_fit();
+		crossPolytope.freeMemory();
 	}
 
 	void HashTable::freeBinsMemory() {
 		if (binSizes)
 		{
-			free(binSizes);
+			HostAllocator::release(binSizes);
 		}
 		if (binStartingIndexes)
 		{
-			free(binStartingIndexes);
+			HostAllocator::release(binStartingIndexes);
 		}
 		if (binCodes)
 		{
-			free(binCodes);
+			HostAllocator::release(binCodes);
 		}
 		if (sortedMappingIdxs)
 		{
-			free(sortedMappingIdxs);
+			HostAllocator::release(sortedMappingIdxs);
+		}
+		if (compressedPostings)
+		{
+			HostAllocator::release(compressedPostings);
+		}
+		if (postingOffsets)
+		{
+			HostAllocator::release(postingOffsets);
 		}
 		binCodes = 0;
-		binSizes = binStartingIndexes = sortedMappingIdxs = 0;
+		compressedWordsNumber = 0;
+		binSizes = binStartingIndexes = sortedMappingIdxs = compressedPostings = postingOffsets = 0;
+		dBinCodes.clear();
+		dBinCodes.shrink_to_fit();
 	}
 
 	void HashTable::generateProjection(curandGenerator_t* normalGen, curandGenerator_t* uniformGen) {
-		ThrustFloatV dProjections(k * d);
-		ThrustFloatV dOffsetVector(k);
+		if (family == CROSS_POLYTOPE) {
+			crossPolytope.generate(uniformGen);
+			return;
+		}
+
+		if (structuredProjections) {
+			generateStructuredProjection(normalGen, uniformGen);
+			return;
+		}
 
+		dProjectionsMatrix.resize(k * d);
+		dOffsetVector.resize(k);
 
-		curandGenerateNormal(*normalGen, thrust::raw_pointer_cast(dProjections.data()), k * d, 0, 1);
+		curandGenerateNormal(*normalGen, thrust::raw_pointer_cast(dProjectionsMatrix.data()), k * d, 0, 1);
 		curandGenerateUniform(*uniformGen, thrust::raw_pointer_cast(dOffsetVector.data()), k);
 
 		thrust::transform(dOffsetVector.begin(), dOffsetVector.end(),
@@ -103,159 +160,470 @@ namespace cuANN {
 			thrust::multiplies<float>());
 
 		thrust::copy(dOffsetVector.begin(), dOffsetVector.end(), offsetVector);
-		thrust::copy(dProjections.begin(), dProjections.end(), projectionsMatrix);
+		thrust::copy(dProjectionsMatrix.begin(), dProjectionsMatrix.end(), projectionsMatrix);
+		if (precision != FLOAT32) {
+			roundProjections();
+		}
 	}
 
-	void HashTable::hashDataset(const float* dataset, const int N) {
-		this->N = N;
-		ThrustFloatV dProjectedMatrix(N * k);
-		projectMatrix(dataset, N, dProjectedMatrix);
-		calcBins(dProjectedMatrix);
-	}
-
-	ThrustQueryResult* HashTable::query(const float* queries, const int Q) {
-		ThrustFloatV dProjectedQueries(Q * k);
-		projectMatrix(queries, Q, dProjectedQueries);
+	/*
+	 * Draws, for each block of paddedD projections, the random signs, the permutation and the Gaussian
+	 * diagonal of projectStructured: 3 paddedD values per block instead of d per projection. The rows
+	 * are converted to fp32 before the transform, so nothing is rounded for the 16 bit storages.
+	 */
+	void HashTable::generateStructuredProjection(curandGenerator_t* normalGen, curandGenerator_t* uniformGen) {
+		int blocks = (k + paddedD - 1) / paddedD;
+		size_t size = (size_t) blocks * paddedD;
+
+		dSigns.resize(size);
+		curandGenerateUniform(*uniformGen, thrust::raw_pointer_cast(dSigns.data()), size);
+		thrust::transform(dSigns.begin(), dSigns.end(), dSigns.begin(), toRandomSign());
+
+		// curand draws normal values in pairs
+		dGaussians.resize(size + size % 2);
+		curandGenerateNormal(*normalGen, thrust::raw_pointer_cast(dGaussians.data()), dGaussians.size(), 0, 1);
+
+		ThrustFloatV dKeys(paddedD);
+		dPermutations.resize(size);
+		for (int block = 0; block < blocks; ++block) {
+			auto permutationBegin = dPermutations.begin() + (size_t) block * paddedD;
+			curandGenerateUniform(*uniformGen, thrust::raw_pointer_cast(dKeys.data()), paddedD);
+			thrust::sequence(permutationBegin, permutationBegin + paddedD);
+			thrust::sort_by_key(dKeys.begin(), dKeys.end(), permutationBegin);
+		}
+
+		dOffsetVector.resize(k);
+		curandGenerateUniform(*uniformGen, thrust::raw_pointer_cast(dOffsetVector.data()), k);
+		thrust::transform(dOffsetVector.begin(), dOffsetVector.end(),
+			thrust::make_constant_iterator(w), dOffsetVector.begin(),
+			thrust::multiplies<float>());
+		thrust::copy(dOffsetVector.begin(), dOffsetVector.end(), offsetVector);
+	}
+
+	/*
+	 * Rounds the projections to the storage precision, so the rows stored in 16 bits and the fp32
+	 * queries are projected on exactly the same vectors. The tables also keep them in 16 bits for the
+	 * mixed precision product with the stored rows.
+	 */
+	void HashTable::roundProjections() {
+		std::vector<uint16_t> rounded(k * d);
+		PrecisionConverter::fromFloat(projectionsMatrix, k * d, precision, rounded.data());
+		PrecisionConverter::toFloat(rounded.data(), k * d, precision, projectionsMatrix);
+
+		dProjectionsMatrix.assign(projectionsMatrix, projectionsMatrix + k * d);
+#if CUDART_VERSION < 11000
+		// bf16 rows are expanded instead, see projectMatrix
+		if (precision == BFLOAT16) {
+			return;
+		}
+#endif
+		dProjectionsHalf.assign(rounded.begin(), rounded.end());
+	}
+
+	void HashTable::hashDataset(const float* dDataset, const int N, ExecutionContext& context) {
+		ScratchBuffer<size_t> dHashes(context.getDeviceArena(), N);
+		hashRows(dDataset, FLOAT32, 0, N, dHashes.data(), context);
+		buildBins(dHashes.data(), N, context);
+	}
+
+	/*
+	 * Projects and hashes the rows [rowBegin, rowEnd) of a device matrix into hashes[rowBegin, rowEnd).
+	 * Disjoint ranges can be hashed concurrently, each with its own context.
+	 * The work is only queued on the stream of the context.
+	 */
+	void HashTable::hashRows(const void* dMatrix, Precision matrixPrecision, const int rowBegin, const int rowEnd, size_t* dHashes, ExecutionContext& context) const {
+		if (family == CROSS_POLYTOPE) {
+			crossPolytope.hashRows(dMatrix, matrixPrecision, rowBegin, rowEnd, dHashes, context);
+			return;
+		}
 
-		ThrustSizetV queryHashes(Q);
+		int rows = rowEnd - rowBegin;
+		const char * dRows = (const char *) dMatrix + (size_t) rowBegin * d * PrecisionConverter::getElementSize(matrixPrecision);
+		ScratchBuffer<float> dProjectedMatrix(context.getDeviceArena(), (size_t) rows * k);
+		projectMatrix(dRows, matrixPrecision, rows, dProjectedMatrix.data(), context);
 
 		dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
-		dim3 dimGrid((Q + dimBlock.x - 1)/dimBlock.x);
-		hashMatrixRows<<<dimGrid, dimBlock>>>(
-			thrust::raw_pointer_cast(dProjectedQueries.data()),
-			Q, k,
-			thrust::raw_pointer_cast(queryHashes.data())
+		dim3 dimGrid((rows + dimBlock.x - 1)/dimBlock.x);
+		hashMatrixRows<<<dimGrid, dimBlock, 0, context.getStream()>>>(
+			dProjectedMatrix.data(),
+			rows, k,
+			dHashes + rowBegin
 		);
+	}
+
+	/*
+	 * Sorts the hashes in place, they must be complete on the device by the time the stream of the context gets to them.
+	 */
+	void HashTable::buildBins(size_t* dHashes, const int N, ExecutionContext& context) {
+		this->N = N;
+		calcBins(dHashes, context);
+	}
+
+	/*
+	 * Cross-polytope tables look up to probes bins up per query, hashing the host copy of the queries,
+	 * the other ones only the bin of the query. Only reads the table, so it can run concurrently as long
+	 * as every thread brings its own context. The candidates are written in result, whose storage is
+	 * reused from the previous query.
+	 */
+	void HashTable::query(const float* dQueries, const float* queries, const int Q, const int probes, ExecutionContext& context, ThrustQueryResult& result) const {
+		if (readsHostQueries(probes)) {
+			// more probes would give the own bin of the query again
+			int distinctProbes = std::min(probes, crossPolytope.getMaxProbes());
+			ScratchBuffer<size_t> dQueryHashes(context.getDeviceArena(), (size_t) Q * distinctProbes);
+			crossPolytope.hashQueries(queries, Q, distinctProbes, dQueryHashes.data(), context);
+			queryHashes(dQueryHashes.data(), Q, distinctProbes, context, result);
+			return;
+		}
+
+		ScratchBuffer<size_t> dQueryHashes(context.getDeviceArena(), Q);
+		hashRows(dQueries, FLOAT32, 0, Q, dQueryHashes.data(), context);
+		queryHashes(dQueryHashes.data(), Q, 1, context, result);
+	}
+
+	bool HashTable::readsHostQueries(const int probes) const {
+		return family == CROSS_POLYTOPE && probes > 1;
+	}
 
-		auto dQueriesBinIdxs = QueryBinCalculator::getBinsForQueryHashes(
-			queryHashes,
-			Q, binsNumber,
-			binCodes
+	/*
+	 * Same as query for queries already hashed, by the tables whose hashes are not their own.
+	 * Each query has probes hashes in a row, the candidates of all its bins are returned together.
+	 * Only the bins are kept: copyQueryIdxs decodes their ids straight into the buffer of the merge.
+	 */
+	void HashTable::queryHashes(const size_t* dQueryHashes, const int Q, const int probes, ExecutionContext& context, ThrustQueryResult& result) const {
+		int hashesNumber = Q * probes;
+		ScratchBuffer<int> dQueriesBinIdxs(context.getDeviceArena(), hashesNumber);
+		QueryBinCalculator::getBinsForQueryHashes(
+			dQueryHashes,
+			hashesNumber, binsNumber,
+			thrust::raw_pointer_cast(dBinCodes.data()),
+			dQueriesBinIdxs.data(), context
 		);
 
-		ThrustHIntV queriesBinIdxs(dQueriesBinIdxs);
-		ThrustHUnsignedV resultIdxsForQueriesSizes(Q, 0);
-		ThrustHUnsignedV resultIdxsForQueriesStartingIdxs(Q, 0);
+		result.resultBins.resize(hashesNumber);
+		int* queriesBinIdxs = thrust::raw_pointer_cast(result.resultBins.data());
+		cudaMemcpyAsync(queriesBinIdxs, dQueriesBinIdxs.data(), hashesNumber * sizeof(int), cudaMemcpyDeviceToHost, context.getStream());
+		context.synchronize();
+
+		result.Q = Q;
+		result.table = this;
+		result.binsPerQuery = probes;
+		result.resultStartingIdxs.resize(Q);
+		result.resultSizes.resize(Q);
 		unsigned totalSize = 0;
 		for (int query = 0; query < Q; ++query) {
-			resultIdxsForQueriesStartingIdxs[query] = totalSize;
-			if (queriesBinIdxs[query] != -1) {
-				resultIdxsForQueriesSizes[query] = binSizes[queriesBinIdxs[query]];
-				totalSize += resultIdxsForQueriesSizes[query];
+			result.resultStartingIdxs[query] = totalSize;
+			result.resultSizes[query] = 0;
+			for (int probe = 0; probe < probes; ++probe) {
+				int binIdx = queriesBinIdxs[query * probes + probe];
+				if (binIdx != -1) {
+					result.resultSizes[query] += binSizes[binIdx];
+				}
 			}
+			totalSize += result.resultSizes[query];
 		}
 
-		ThrustHUnsignedV resultIdxsForQueries(totalSize);
-		for (int query = 0; query < Q; ++query) {
-			if (queriesBinIdxs[query] != -1) {
-				thrust::copy_n(
-					sortedMappingIdxs + binStartingIndexes[queriesBinIdxs[query]],
-					resultIdxsForQueriesSizes[query],
-					resultIdxsForQueries.begin() + resultIdxsForQueriesStartingIdxs[query]
-				);
+		result.resultSetSize = totalSize;
+		result.resultSet.clear();
+	}
+
+	/*
+	 * The resultSizes[query] ids of the bins queryHashes found for query, one bin after the other.
+	 */
+	void HashTable::copyQueryIdxs(const ThrustQueryResult& result, unsigned query, unsigned* destination) const {
+		for (int probe = 0; probe < result.binsPerQuery; ++probe) {
+			int binIdx = result.resultBins[query * result.binsPerQuery + probe];
+			if (binIdx != -1) {
+				copyBinIdxs(binIdx, destination);
+				destination += binSizes[binIdx];
 			}
 		}
+	}
 
-		return new ThrustQueryResult(
-			resultIdxsForQueriesStartingIdxs,
-			resultIdxsForQueriesSizes,
-			resultIdxsForQueries,
-			Q, totalSize
-		);
+	unsigned HashTable::getBinsNumber() const {
+		return binsNumber;
 	}
 
-	void HashTable::calcBins(const ThrustFloatV& dProjectedMatrix) {
-		thrust::device_vector<size_t> hashes(N);
+	/*
+	 * The ids of all the bins one after the other, in the order of their codes.
+	 */
+	void HashTable::copySortedIdxs(unsigned* destination) const {
+		for (unsigned bin = 0; bin < binsNumber; ++bin) {
+			copyBinIdxs(bin, destination);
+			destination += binSizes[bin];
+		}
+	}
 
-		dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
-		dim3 dimGrid((N + dimBlock.x - 1)/dimBlock.x);
-		hashMatrixRows<<<dimGrid, dimBlock>>>(
-			thrust::raw_pointer_cast(dProjectedMatrix.data()),
-			N, k,
-			thrust::raw_pointer_cast(hashes.data())
-		);
+	/*
+	 * Where the ids of every bin start in the sorted ids, and how many they are.
+	 */
+	void HashTable::copyBinBounds(unsigned* startingIndexes, unsigned* sizes) const {
+		unsigned start = 0;
+		for (unsigned bin = 0; bin < binsNumber; ++bin) {
+			startingIndexes[bin] = start;
+			start += binSizes[bin];
+		}
+		std::copy_n(binSizes, binsNumber, sizes);
+	}
 
-		ThrustUnsignedV dSortedPermutationIndx(N);
-		thrust::sequence(dSortedPermutationIndx.begin(), dSortedPermutationIndx.end());
-		thrust::stable_sort_by_key(hashes.begin(), hashes.end(), dSortedPermutationIndx.begin());
+	/*
+	 * The code of the bin of every row, by row id.
+	 */
+	void HashTable::copyRowCodes(size_t* destination) const {
+		std::vector<unsigned> binIdxs;
+		for (unsigned bin = 0; bin < binsNumber; ++bin) {
+			binIdxs.resize(binSizes[bin]);
+			copyBinIdxs(bin, binIdxs.data());
+			for (unsigned idx : binIdxs) {
+				destination[idx] = binCodes[bin];
+			}
+		}
+	}
 
-		ThrustBoolV diff(N);
-		thrust::adjacent_difference(hashes.begin(), hashes.end(), diff.begin());
-		thrust::transform(diff.begin(), diff.end(), diff.begin(), isDifferentFromZero());
-		thrust::fill_n(diff.begin(), 1, true);
+	/*
+	 * Replaces every stored id with newIdxs[id], keeping the ids of each bin in increasing order.
+	 */
+	void HashTable::remapIdxs(const unsigned* newIdxs) {
+		std::vector<unsigned> sortedIdxs(N);
+		copySortedIdxs(sortedIdxs.data());
+		auto binBegin = sortedIdxs.begin();
+		for (unsigned bin = 0; bin < binsNumber; ++bin) {
+			auto binEnd = binBegin + binSizes[bin];
+			for (auto it = binBegin; it != binEnd; ++it) {
+				*it = newIdxs[*it];
+			}
+			std::sort(binBegin, binEnd);
+			binBegin = binEnd;
+		}
 
-		binsNumber = thrust::count(diff.begin(), diff.end(), true);
+		if (compressPostings) {
+			HostAllocator::release(compressedPostings);
+			compressedPostings = 0;
+			compressBins(sortedIdxs.data());
+		} else {
+			std::copy(sortedIdxs.begin(), sortedIdxs.end(), sortedMappingIdxs);
+		}
+	}
 
-		auto dBinStartingIndexes = computeStartingIndices(diff);
-		auto dBinSizes = computeBinSizes(dBinStartingIndexes);
-		auto dBinCodes = extractBinsCode(hashes, dBinStartingIndexes);
+	/*
+	 * The plain ids and their starts are only freed once the compressed ones are in place, so the
+	 * switch itself briefly needs both.
+	 */
+	void HashTable::enablePostingCompression() {
+		if (compressPostings) {
+			return;
+		}
+		compressPostings = true;
+		if (!sortedMappingIdxs) {
+			return;
+		}
 
-		allocateBinsMemory();
+		postingOffsets = (unsigned *) HostAllocator::allocate(binsNumber * sizeof(unsigned));
+		if (!postingOffsets)
+		{
+			throw std::runtime_error("Cannot allocate bins memory");
+		}
+		compressBins(sortedMappingIdxs);
+		HostAllocator::release(sortedMappingIdxs);
+		HostAllocator::release(binStartingIndexes);
+		sortedMappingIdxs = binStartingIndexes = 0;
+	}
+
+	void HashTable::addMemoryUsage(MemoryUsage& usage) const {
+		size_t projectionsHostBytes = 0;
+		if (projectionsMatrix) {
+			projectionsHostBytes += (size_t) k * d * sizeof(float);
+		}
+		if (offsetVector) {
+			projectionsHostBytes += k * sizeof(float);
+		}
+		usage.add(MemoryUsage::PROJECTIONS, projectionsHostBytes,
+			(dProjectionsMatrix.capacity() + dOffsetVector.capacity() + dSigns.capacity() + dGaussians.capacity()) * sizeof(float)
+			+ dProjectionsHalf.capacity() * sizeof(uint16_t) + dPermutations.capacity() * sizeof(int));
+		crossPolytope.addMemoryUsage(usage);
 
-		thrust::copy(dSortedPermutationIndx.begin(), dSortedPermutationIndx.end(), sortedMappingIdxs);
-		thrust::copy(dBinStartingIndexes.begin(), dBinStartingIndexes.end(), binStartingIndexes);
-		thrust::copy(dBinSizes.begin(), dBinSizes.end(), binSizes);
-		thrust::copy(dBinCodes.begin(), dBinCodes.end(), binCodes);
+		if (!binSizes) {
+			return;
+		}
+		// a size and a code per bin, then either the start of its ids or the offset of its words
+		usage.add(MemoryUsage::BINS, (size_t) binsNumber * (sizeof(unsigned) + sizeof(size_t)), dBinCodes.capacity() * sizeof(size_t));
+		if (compressPostings) {
+			usage.add(MemoryUsage::POSTINGS, (compressedWordsNumber + binsNumber) * sizeof(unsigned), 0);
+		} else {
+			usage.add(MemoryUsage::POSTINGS, ((size_t) N + binsNumber) * sizeof(unsigned), 0);
+		}
 	}
 
-	thrust::device_vector<size_t> HashTable::extractBinsCode(
-		const thrust::device_vector<size_t>& hashes,
-		const ThrustUnsignedV& startingIndices
-	) {
-		thrust::device_vector<size_t> hashCodes(binsNumber);
+	void HashTable::calcBins(size_t* dHashes, ExecutionContext& context) {
+		auto policy = onContext(context);
+		ScratchArena& arena = context.getDeviceArena();
 
-		thrust::gather(startingIndices.begin(), startingIndices.end(), hashes.begin(), hashCodes.begin());
+		ScratchBuffer<unsigned> dSortedPermutationIndx(arena, N);
+		thrust::sequence(policy, dSortedPermutationIndx.begin(), dSortedPermutationIndx.end());
+		thrust::stable_sort_by_key(policy, dHashes, dHashes + N, dSortedPermutationIndx.begin());
 
-		return hashCodes;
-	}
+		ScratchBuffer<bool> dDiff(arena, N);
+		thrust::adjacent_difference(policy, dHashes, dHashes + N, dDiff.begin());
+		thrust::transform(policy, dDiff.begin(), dDiff.end(), dDiff.begin(), isDifferentFromZero());
+		thrust::fill_n(policy, dDiff.begin(), 1, true);
 
-	ThrustUnsignedV HashTable::computeBinSizes(const ThrustUnsignedV& startingIndices) {
-		ThrustUnsignedV sizes(binsNumber);
+		binsNumber = thrust::count(policy, dDiff.begin(), dDiff.end(), true);
 
-		thrust::adjacent_difference(
-			startingIndices.begin() + 1, startingIndices.end(),
-			sizes.begin()
-		);
+		ScratchBuffer<unsigned> dBinStartingIndexes(arena, binsNumber);
+		ScratchBuffer<unsigned> dBinSizes(arena, binsNumber);
+		computeStartingIndices(dDiff.data(), dBinStartingIndexes.data(), context);
+		computeBinSizes(dBinStartingIndexes.data(), dBinSizes.data(), context);
+		extractBinsCode(dHashes, dBinStartingIndexes.data(), context);
 
-		sizes[binsNumber - 1] = N - startingIndices.back();
+		allocateBinsMemory();
 
-		return sizes;
-	}
+		cudaStream_t stream = context.getStream();
+		std::vector<unsigned> sortedIdxs(compressPostings ? N : 0);
+		// compressed tables keep no starts, the last one is still needed for the size of the last bin
+		unsigned lastStart;
+		cudaMemcpyAsync(&lastStart, dBinStartingIndexes.data() + binsNumber - 1, sizeof(unsigned), cudaMemcpyDeviceToHost, stream);
+		if (!compressPostings) {
+			cudaMemcpyAsync(binStartingIndexes, dBinStartingIndexes.data(), binsNumber * sizeof(unsigned), cudaMemcpyDeviceToHost, stream);
+		}
+		cudaMemcpyAsync(binSizes, dBinSizes.data(), binsNumber * sizeof(unsigned), cudaMemcpyDeviceToHost, stream);
+		cudaMemcpyAsync(binCodes, thrust::raw_pointer_cast(dBinCodes.data()), binsNumber * sizeof(size_t), cudaMemcpyDeviceToHost, stream);
+		cudaMemcpyAsync(
+			compressPostings ? sortedIdxs.data() : sortedMappingIdxs,
+			dSortedPermutationIndx.data(), N * sizeof(unsigned),
+			cudaMemcpyDeviceToHost, stream
+		);
+		context.synchronize();
 
-	ThrustUnsignedV HashTable::computeStartingIndices(const ThrustBoolV& diff) {
-		ThrustUnsignedV startingIndices(binsNumber, 0);
+		// the last bin has no following start to take its size from
+		binSizes[binsNumber - 1] = N - lastStart;
+		if (compressPostings) {
+			compressBins(sortedIdxs.data());
+		}
+	}
 
-		ThrustUnsignedV mapping(N);
-		thrust::sequence(mapping.begin(), mapping.end());
+	/*
+	 * The stable sort leaves the ids of every bin in increasing order, so each bin
+	 * can be delta-encoded as it is. There are never more words than ids plus two per
+	 * block, so 32 bit offsets reach them all.
+	 */
+	void HashTable::compressBins(const unsigned* sortedIdxs) {
+		std::vector<unsigned> words;
+		words.reserve(N);
+
+		for (unsigned bin = 0; bin < binsNumber; ++bin) {
+			postingOffsets[bin] = words.size();
+			PostingListCodec::encode(sortedIdxs, binSizes[bin], words);
+			sortedIdxs += binSizes[bin];
+		}
 
-		thrust::copy_if(mapping.begin(), mapping.end(), diff.begin(), startingIndices.begin(), isTrue());
+		compressedPostings = (unsigned *) HostAllocator::allocate(words.size() * sizeof(unsigned));
+		if (!compressedPostings)
+		{
+			throw std::runtime_error("Cannot allocate bins memory");
+		}
+		std::copy(words.begin(), words.end(), compressedPostings);
+		compressedWordsNumber = words.size();
+	}
 
-		return startingIndices;
+	void HashTable::copyBinIdxs(unsigned binIdx, unsigned* destination) const {
+		if (compressPostings) {
+			PostingListCodec::decode(compressedPostings + postingOffsets[binIdx], binSizes[binIdx], destination);
+		} else {
+			std::copy_n(sortedMappingIdxs + binStartingIndexes[binIdx], binSizes[binIdx], destination);
+		}
 	}
 
-	void HashTable::projectMatrix(const float* dataset, const int N, ThrustFloatV& dProjectedMatrix) {
-		ThrustFloatV dDataset(dataset, dataset + N * d);
-		ThrustFloatV dProjectionsMatrix(projectionsMatrix, projectionsMatrix + d * k);
-		ThrustFloatV dOffsetVector(offsetVector, offsetVector + k);
+	void HashTable::extractBinsCode(const size_t* dHashes, const unsigned* dStartingIndices, ExecutionContext& context) {
+		dBinCodes.resize(binsNumber);
 
-		float * dProjectedMatrixPTR = thrust::raw_pointer_cast(dProjectedMatrix.data());
+		thrust::gather(onContext(context), dStartingIndices, dStartingIndices + binsNumber, dHashes, dBinCodes.begin());
+	}
+
+	/*
+	 * Every size but the last one, which calcBins completes on the host.
+	 */
+	void HashTable::computeBinSizes(const unsigned* dStartingIndices, unsigned* dSizes, ExecutionContext& context) {
+		thrust::adjacent_difference(
+			onContext(context),
+			dStartingIndices + 1, dStartingIndices + binsNumber,
+			dSizes
+		);
+	}
 
-		multiplyMatrix(
-			thrust::raw_pointer_cast(dDataset.data()),
-			thrust::raw_pointer_cast(dProjectionsMatrix.data()),
-			dProjectedMatrixPTR,
-			N, d, k
+	void HashTable::computeStartingIndices(const bool* dDiff, unsigned* dStartingIndices, ExecutionContext& context) {
+		thrust::copy_if(
+			onContext(context),
+			thrust::make_counting_iterator<unsigned>(0), thrust::make_counting_iterator<unsigned>(N),
+			dDiff, dStartingIndices, isTrue()
 		);
+	}
+
+	void HashTable::projectMatrix(const void* dMatrix, Precision matrixPrecision, const int N, float* dProjectedMatrix, ExecutionContext& context) const {
+		cudaStream_t stream = context.getStream();
+		if (structuredProjections) {
+			// a power of two, the butterflies are split between the threads
+			int threads = std::min(256, std::max(1, paddedD / 2));
+			size_t sharedBytes = 2 * paddedD * sizeof(float);
+			if (matrixPrecision == FLOAT32) {
+				projectStructured<<<N, threads, sharedBytes, stream>>>(
+					(const float *) dMatrix, N, d, paddedD, k,
+					thrust::raw_pointer_cast(dSigns.data()),
+					thrust::raw_pointer_cast(dPermutations.data()),
+					thrust::raw_pointer_cast(dGaussians.data()),
+					dProjectedMatrix
+				);
+			} else {
+				projectStructured<<<N, threads, sharedBytes, stream>>>(
+					(const unsigned short *) dMatrix, matrixPrecision, N, d, paddedD, k,
+					thrust::raw_pointer_cast(dSigns.data()),
+					thrust::raw_pointer_cast(dPermutations.data()),
+					thrust::raw_pointer_cast(dGaussians.data()),
+					dProjectedMatrix
+				);
+			}
+#if CUDART_VERSION < 11000
+		} else if (matrixPrecision == BFLOAT16) {
+			// cuBLAS has no bf16 product before CUDA 11, the rows are widened first
+			size_t size = (size_t) N * d;
+			ScratchBuffer<float> dExpanded(context.getDeviceArena(), size);
+			dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
+			dim3 dimGrid((size + dimBlock.x - 1)/dimBlock.x);
+			expandToFloat<<<dimGrid, dimBlock, 0, stream>>>((const unsigned short *) dMatrix, size, BFLOAT16, dExpanded.data());
+			multiplyMatrix(
+				context.getCublasHandle(),
+				dExpanded.data(),
+				thrust::raw_pointer_cast(dProjectionsMatrix.data()),
+				dProjectedMatrix,
+				N, d, k
+			);
+#endif
+		} else if (matrixPrecision != FLOAT32) {
+			multiplyMatrixHalf(
+				context.getCublasHandle(),
+				(const unsigned short *) dMatrix,
+				thrust::raw_pointer_cast(dProjectionsHalf.data()),
+				matrixPrecision,
+				dProjectedMatrix,
+				N, d, k
+			);
+		} else {
+			multiplyMatrix(
+				context.getCublasHandle(),
+				(const float *) dMatrix,
+				thrust::raw_pointer_cast(dProjectionsMatrix.data()),
+				dProjectedMatrix,
+				N, d, k
+			);
+		}
 
 		dim3 dimBlock(BLOCK_SIZE, BLOCK_SIZE);
 		dim3 dimGrid((k + dimBlock.x - 1)/dimBlock.x, (N + dimBlock.y - 1)/dimBlock.y);
-		addVectorFromMatrix <<< dimGrid, dimBlock >>> (
-			dProjectedMatrixPTR,
+		addVectorFromMatrix <<< dimGrid, dimBlock, 0, stream >>> (
+			dProjectedMatrix,
 			thrust::raw_pointer_cast(dOffsetVector.data()),
 			N, k
 		);
-		divideMatrixByScalar <<< dimGrid, dimBlock >>> (dProjectedMatrixPTR, w, N, k);
-		floorMatrix <<< dimGrid, dimBlock >>> (dProjectedMatrixPTR, N, k);
+		divideMatrixByScalar <<< dimGrid, dimBlock, 0, stream >>> (dProjectedMatrix, w, N, k);
+		floorMatrix <<< dimGrid, dimBlock, 0, stream >>> (dProjectedMatrix, N, k);
 	}
 }
 
@@ -4,12 +4,16 @@
 #include <curand.h>
 #include "commons.h"
 #include "ThrustQueryResult.h"
+#include "IndexOptions.h"
+#include "ExecutionContext.h"
+#include "CrossPolytopeHasher.h"
+#include "MemoryUsage.h"
 
 namespace cuANN {
 	class HashTable
 	{
 	public:
-		HashTable(int k, int d, float w);
+		HashTable(int k, int d, float w, const IndexOptions& options);
 
 		~HashTable();
 
@@ -19,18 +23,59 @@ namespace cuANN {
 
 		void generateProjection(curandGenerator_t* normalGen, curandGenerator_t* uniformGen);
 
-		void hashDataset(const float* dataset, const int N);
+		void hashDataset(const float* dDataset, const int N, ExecutionContext& context);
 
-		ThrustQueryResult* query(const float* queries, const int Q);
+		void hashRows(const void* dMatrix, Precision matrixPrecision, const int rowBegin, const int rowEnd, size_t* dHashes, ExecutionContext& context) const;
+
+		void buildBins(size_t* dHashes, const int N, ExecutionContext& context);
+
+		void query(const float* dQueries, const float* queries, const int Q, const int probes, ExecutionContext& context, ThrustQueryResult& result) const;
+
+		// whether query needs the queries on the host as well
+		bool readsHostQueries(const int probes) const;
+
+		void queryHashes(const size_t* dQueryHashes, const int Q, const int probes, ExecutionContext& context, ThrustQueryResult& result) const;
+
+		void copyQueryIdxs(const ThrustQueryResult& result, unsigned query, unsigned* destination) const;
+
+		unsigned getBinsNumber() const;
+
+		void copySortedIdxs(unsigned* destination) const;
+
+		void copyBinBounds(unsigned* startingIndexes, unsigned* sizes) const;
+
+		void copyRowCodes(size_t* destination) const;
+
+		void remapIdxs(const unsigned* newIdxs);
+
+		// re-encodes the postings already built, and the ones built from now on, with PostingListCodec
+		void enablePostingCompression();
+
+		void addMemoryUsage(MemoryUsage& usage) const;
 
 	private:
 		int k;
 		int d;
 		float w;
 		int N;
+		Precision precision;
+		HashFamily family;
+		bool structuredProjections;
+		int paddedD;
 
 		float *projectionsMatrix;
 		float *offsetVector;
+		// device copies of what every projection and lookup reads, kept for the life of the table
+		ThrustFloatV dProjectionsMatrix;
+		ThrustFloatV dOffsetVector;
+		ThrustUshortV dProjectionsHalf;
+		ThrustSizetV dBinCodes;
+		// the diagonals and permutations of the structured projections, in blocks of paddedD
+		ThrustFloatV dSigns;
+		ThrustIntV dPermutations;
+		ThrustFloatV dGaussians;
+		// the functions of the table when it is a cross-polytope one, the projections above are then unused
+		CrossPolytopeHasher crossPolytope;
 
 		unsigned binsNumber;
 		unsigned *sortedMappingIdxs;
@@ -38,24 +83,35 @@ namespace cuANN {
 		unsigned *binStartingIndexes;
 		size_t *binCodes;
 
+		// compressed tables replace the ids and their starts with the words and their offsets
+		bool compressPostings;
+		unsigned *compressedPostings;
+		size_t compressedWordsNumber;
+		unsigned *postingOffsets;
+
 		void freeProjectionMemory();
 
 		void freeBinsMemory();
 
 		void allocateBinsMemory();
 
-		void calcBins(const ThrustFloatV& dProjectedMatrix);
+		void compressBins(const unsigned* sortedIdxs);
+
+		void copyBinIdxs(unsigned binIdx, unsigned* destination) const;
+
+		void calcBins(size_t* dHashes, ExecutionContext& context);
+
+		void computeStartingIndices(const bool* dDiff, unsigned* dStartingIndices, ExecutionContext& context);
+
+		void computeBinSizes(const unsigned* dStartingIndices, unsigned* dSizes, ExecutionContext& context);
 
-		ThrustUnsignedV computeStartingIndices(const ThrustBoolV& diff);
+		void extractBinsCode(const size_t* dHashes, const unsigned* dStartingIndices, ExecutionContext& context);
 
-		ThrustUnsignedV computeBinSizes(const ThrustUnsignedV& startingIndices);
+		void roundProjections();
 
-		thrust::device_vector<size_t> extractBinsCode(
-			const thrust::device_vector<size_t>& hashes,
-			const ThrustUnsignedV& startingIndices
-		);
+		void generateStructuredProjection(curandGenerator_t* normalGen, curandGenerator_t* uniformGen);
 
-		void projectMatrix(const float* dataset, const int N, ThrustFloatV& dProjectedMatrix);
+		void projectMatrix(const void* dMatrix, Precision matrixPrecision, const int N, float* dProjectedMatrix, ExecutionContext& context) const;
 	};
 }
 
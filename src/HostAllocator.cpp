@@ -0,0 +1,104 @@
+#ifndef __cuANN_HostAllocator__
+#define __cuANN_HostAllocator__
+
+#include <cstdlib>
+#include <stdexcept>
+#include <sys/mman.h>
+#include "HostAllocator.h"
+
+namespace cuANN {
+	constexpr size_t HostAllocator::ALIGNMENT;
+	constexpr size_t HostAllocator::HUGE_PAGE_SIZE;
+
+	HostAllocator::HugePages HostAllocator::hugePages = HostAllocator::TRANSPARENT;
+
+	// kept in the cache line before every block, to release it the way it was allocated
+	struct BlockHeader {
+		size_t size;
+		bool isMapped;
+	};
+
+	static_assert(sizeof(BlockHeader) <= HostAllocator::ALIGNMENT, "The block header must fit in the alignment");
+
+	static size_t roundUp(size_t value, size_t alignment) {
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	/*
+	 * The header takes a cache line in front of the block, so a huge page block starts on its page
+	 * and its data one line after.
+	 */
+	void* HostAllocator::allocate(size_t bytes) {
+		size_t size = bytes + ALIGNMENT;
+		void * base = 0;
+		bool isMapped = false;
+		bool isHuge = hugePages != NONE && size >= HUGE_PAGE_SIZE;
+		if (isHuge) {
+			size = roundUp(size, HUGE_PAGE_SIZE);
+		}
+
+#ifdef MAP_HUGETLB
+		// fails when no huge pages are reserved, see /proc/sys/vm/nr_hugepages
+		if (isHuge && hugePages == EXPLICIT) {
+			base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (base == MAP_FAILED) {
+				base = 0;
+			} else {
+				isMapped = true;
+			}
+		}
+#endif
+		if (!base) {
+			if (posix_memalign(&base, isHuge ? HUGE_PAGE_SIZE : ALIGNMENT, size) != 0) {
+				return 0;
+			}
+#ifdef MADV_HUGEPAGE
+			// only a hint: without transparent huge pages the block keeps normal ones
+			if (isHuge) {
+				madvise(base, size, MADV_HUGEPAGE);
+			}
+#endif
+		}
+
+		BlockHeader * header = (BlockHeader *) base;
+		header->size = size;
+		header->isMapped = isMapped;
+		return (char *) base + ALIGNMENT;
+	}
+
+	void HostAllocator::release(void* memory) {
+		if (!memory) {
+			return;
+		}
+
+		BlockHeader * header = (BlockHeader *) ((char *) memory - ALIGNMENT);
+		if (header->isMapped) {
+			munmap(header, header->size);
+		} else {
+			free(header);
+		}
+	}
+
+	int HostAllocator::getPaddedDimension(int d) {
+		return roundUp(d, ALIGNMENT / sizeof(float));
+	}
+
+	void HostAllocator::setHugePages(HugePages hugePages) {
+		HostAllocator::hugePages = hugePages;
+	}
+
+	HostAllocator::HugePages HostAllocator::parseHugePages(const std::string& name) {
+		if (name == "none") {
+			return NONE;
+		}
+		if (name == "transparent") {
+			return TRANSPARENT;
+		}
+		if (name == "explicit") {
+			return EXPLICIT;
+		}
+		throw std::runtime_error("Unknown huge pages " + name + ", expected none, transparent or explicit");
+	}
+}
+
+#endif // !__cuANN_HostAllocator__
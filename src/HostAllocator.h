@@ -0,0 +1,43 @@
+#ifndef __cuANN_HOSTALLOCATOR_H_
+#define __cuANN_HOSTALLOCATOR_H_
+
+#include <cstddef>
+#include <string>
+
+namespace cuANN {
+	/*
+	 * Host memory for the large arrays: the datasets and the bins of the hash tables.
+	 * Every block starts on a cache line, and the blocks of at least a huge page are backed by
+	 * huge pages when the system allows it, so random accesses to multi-GB arrays miss the TLB
+	 * far less. Explicit huge pages fall back to transparent ones, those to normal pages.
+	 */
+	class HostAllocator
+	{
+	public:
+		enum HugePages { NONE, TRANSPARENT, EXPLICIT };
+
+		static constexpr size_t ALIGNMENT = 64;
+		static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+		// ALIGNMENT aligned, null when the memory is exhausted like malloc
+		static void* allocate(size_t bytes);
+
+		// takes back what allocate returned, null is ignored
+		static void release(void* memory);
+
+		// the leading dimension of float rows of dimension d, padded to whole cache lines
+		static int getPaddedDimension(int d);
+
+		// for the blocks allocated from now on, TRANSPARENT by default
+		static void setHugePages(HugePages hugePages);
+
+		static HugePages parseHugePages(const std::string& name);
+
+	private:
+		HostAllocator() {}
+
+		static HugePages hugePages;
+	};
+}
+
+#endif /* __cuANN_HOSTALLOCATOR_H_ */
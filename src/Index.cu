@@ -2,31 +2,56 @@
 #define __cuANN_Index__
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <thrust/copy.h>
+#include <thrust/fill.h>
 #include <thrust/sort.h>
-#include <thrust/unique.h>
 #include <time.h>
 #include "commons.h"
 #include "utils.h"
 #include "Index.h"
+#include "BruteForce.h"
+#include "TaskScheduler.h"
 
 namespace cuANN {
-	Index::Index(int k, int L, Dataset * data, float w) {
+	constexpr int Index::MIN_ROWS_PER_RANGE;
+	constexpr int Index::RANGES_PER_WORKER;
+	constexpr size_t Index::CONVERSION_CHUNK;
+	constexpr size_t Index::JOIN_BATCH_TILES;
+	constexpr size_t Index::BIN_BUILD_BYTES_PER_ROW;
+	constexpr size_t Index::FILTER_BLOCK_CANDIDATES;
+
+	Index::Index(int k, int L, Dataset * data, float w, const IndexOptions& options) {
+		this->options = options;
 		this->k = 0;
 		this->L = 0;
 		this->dataset = 0;
 		this->w = 0.0;
 		this->d = 0;
 		this->N = 0;
+		this->isBuilt = false;
+		this->translatedFilterVersion = 0;
+		this->seed = options.seed ? options.seed : (unsigned long long) time(0);
 
 		refresh(k, L, data, w);
 	};
 
 	Index::~Index() {
-		freeProjectionMemory();
-		tables.clear();
+		releaseTables();
 	}
 
 	bool Index::refresh(int k, int L, Dataset * data, float w) {
+		releaseTables();
+		this->isBuilt = false;
+
 		this->k = k;
 		this->L = L;
 		this->dataset = data;
@@ -36,167 +61,1507 @@ namespace cuANN {
 		this->N = data->N;
 		try
 		{
-			allocateProjectionMemory();
+			allocateProjectionMemory(0);
 		}
 		catch (const std::exception& e)
 		{
 			std::cerr << e.what();
 			return false;
 		}
-		generateRandomProjections();
+		generateRandomProjections(0);
 
 		return true;
 	}
 
 	bool Index::buildIndex() {
-		for (int i = 0; i < L; i++)
-		{	
-			tables[i]->hashDataset(dataset->dataset, dataset->N);
+		uploadDataset();
+		internalToExternal.clear();
+		externalToInternal.clear();
+		translatedFilter.reset();
+
+		buildTables(0);
+		if (options.reorderByBuckets) {
+			reorderByBuckets();
 		}
+		isBuilt = true;
 		return true;
 	}
 
-	std::vector<QueryResult> Index::query(Dataset* queries, unsigned numberOfNeighbors) {
-		unsigned Q = queries->N;
-		thrust::host_vector<ThrustQueryResult*> results;
+	/*
+	 * Kept on the device for the whole life of the index: every query reranks against it.
+	 * 16 bit rows are converted on the host a chunk at a time, so only the converted copy
+	 * is ever whole.
+	 * With a vector file the rows stay on the SSD: the dataset passed in is only used for its shape.
+	 */
+	void Index::uploadDataset() {
+		size_t size = (size_t) N * d;
+		if (!options.vectorFile.empty()) {
+			if (options.storagePrecision != FLOAT32 || options.reorderByBuckets) {
+				throw std::runtime_error("The rows of a vector file are read as they are stored: fp32 and in their order");
+			}
+			vectorStore.reset(new VectorStore(options.vectorFile, options.vectorCacheRows));
+			if (vectorStore->getVectorsNumber() != N || vectorStore->getDimension() != d) {
+				throw std::runtime_error("The vector file " + options.vectorFile + " does not hold the rows of the dataset");
+			}
+			dDataset.clear();
+			dDataset.shrink_to_fit();
+			return;
+		}
 
-		for (const auto& table : tables) {
-			results.push_back(table->query(queries->dataset, Q));
+		if (!dataset->hasRows()) {
+			throw std::runtime_error("The rows of the dataset are only in a vector file, which the index options do not name");
 		}
 
-		auto mergedResult = mergeQueryResults(results, Q);
+		// the device rows are packed, the padding of the host ones is left behind
+		int chunkRows = std::max<size_t>(1, std::min<size_t>(N, CONVERSION_CHUNK / d));
+		if (options.storagePrecision == FLOAT32) {
+			dDataset.resize(size);
+			std::lock_guard<std::mutex> lock(defaultContextMutex);
+			for (int start = 0; start < N; start += chunkRows) {
+				int rows = std::min(chunkRows, N - start);
+				uploadRows(*dataset, start, rows, thrust::raw_pointer_cast(dDataset.data()) + (size_t) start * d, defaultContext);
+			}
+			defaultContext.synchronize();
+			return;
+		}
 
-		ThrustUnsignedV dCandidatesIdxs(mergedResult->resultSet);
-		auto dDistances = calculateDistances(queries->dataset, Q, dCandidatesIdxs, mergedResult);
-		sortDistancesAndTheirIdxs(dDistances, dCandidatesIdxs, mergedResult);
+		dDataset.clear();
+		dDataset.shrink_to_fit();
+		dDatasetStored.resize(size);
+		std::vector<float> rows((size_t) chunkRows * d);
+		std::vector<uint16_t> chunk((size_t) chunkRows * d);
+		for (int start = 0; start < N; start += chunkRows) {
+			int chunkSize = std::min(chunkRows, N - start);
+			dataset->copyRows(start, chunkSize, rows.data());
+			for (int row = 0; row < chunkSize; ++row) {
+				PrecisionConverter::fromFloat(rows.data() + (size_t) row * d, d, options.storagePrecision, chunk.data() + (size_t) row * d);
+			}
+			thrust::copy_n(chunk.begin(), (size_t) chunkSize * d, dDatasetStored.begin() + (size_t) start * d);
+		}
+	}
 
-		std::vector<QueryResult> finalResult;
-		unsigned size;
-		for (unsigned query = 0; query < Q; ++query) {
-			size = std::min(numberOfNeighbors, mergedResult->resultSizes[query]);
-			std::vector<unsigned> resultIdxsForQuery(size);
-			thrust::copy_n(
-				dCandidatesIdxs.begin() + mergedResult->resultStartingIdxs[query],
-				size,
-				resultIdxsForQuery.begin()
+	const void* Index::getDeviceRows() const {
+		if (options.storagePrecision == FLOAT32) {
+			return thrust::raw_pointer_cast(dDataset.data());
+		}
+		return thrust::raw_pointer_cast(dDatasetStored.data());
+	}
+
+	/*
+	 * Appends count new tables with the current k and w, leaving the existing ones untouched.
+	 * If the index was already built only the new tables are hashed, as many of them as the memory
+	 * budget allows.
+	 */
+	bool Index::addTables(int count) {
+		int firstNewTable = L;
+		L += count;
+		try
+		{
+			allocateProjectionMemory(firstNewTable);
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << e.what();
+			return false;
+		}
+		generateRandomProjections(firstNewTable);
+
+		if (isBuilt) {
+			buildTables(firstNewTable);
+		}
+		return true;
+	}
+
+	int Index::getWorkersNumber() const {
+		return options.buildThreads > 0 ? options.buildThreads : std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	/*
+	 * Hashes the tables from firstTable on, giving up in this order whatever does not fit in the
+	 * memory budget: building all of them at once, halving the tables hashed together until their
+	 * hashes fit; plain postings, compressing the ones already built; the remaining tables, which
+	 * are dropped. A first table whose bound does not fit is built compressed and kept if it does.
+	 * Every step is left in getBudgetSteps. The peak of a batch is what the index holds, the host rows
+	 * included, the bins and postings of its tables, a hash per row per hasher and the sort of the
+	 * tables being binned concurrently.
+	 */
+	void Index::buildTables(int firstTable) {
+		budgetSteps.clear();
+		if (!options.memoryBudget) {
+			hashTables(firstTable, L);
+			return;
+		}
+
+		size_t concurrentBuilds = getWorkersNumber();
+		int batchTables = L - firstTable;
+		int table = firstTable;
+		while (table < L) {
+			size_t usedBytes = getMemoryUsage().getTotalBytes();
+			size_t tableBytes = estimateTableBytes(table);
+			auto getPeakBytes = [&](int batch) {
+				size_t hashers = options.shareHashFunctions ? 2 * batch : batch;
+				return usedBytes + batch * tableBytes + hashers * N * sizeof(size_t)
+					+ std::min<size_t>(batch, concurrentBuilds) * N * BIN_BUILD_BYTES_PER_ROW;
+			};
+
+			batchTables = std::min(batchTables, L - table);
+			if (batchTables > 1 && getPeakBytes(batchTables) > options.memoryBudget) {
+				while (batchTables > 1 && getPeakBytes(batchTables) > options.memoryBudget) {
+					batchTables /= 2;
+				}
+				budgetSteps.push_back("hashing the tables " + std::to_string(batchTables) + " at a time");
+			}
+			if (getPeakBytes(batchTables) > options.memoryBudget && !options.compressPostings) {
+				budgetSteps.push_back("compressing the postings");
+				options.compressPostings = true;
+				for (auto hashTable : tables) {
+					hashTable->enablePostingCompression();
+				}
+				continue;
+			}
+			// only the tables already built tell how much smaller their postings get: the bound before the
+			// first one, a bin per row, is no smaller compressed, so the first table is built and measured
+			if (getPeakBytes(batchTables) > options.memoryBudget && table == 0) {
+				if (getPeakBytes(1) - tableBytes > options.memoryBudget) {
+					throw std::runtime_error("Not even one table fits in the memory budget");
+				}
+				hashTables(0, 1);
+				if (getMemoryUsage().getTotalBytes() > options.memoryBudget) {
+					dropTables(0);
+					throw std::runtime_error("Not even one table fits in the memory budget, with its postings compressed");
+				}
+				table = 1;
+				continue;
+			}
+			if (getPeakBytes(batchTables) > options.memoryBudget) {
+				budgetSteps.push_back("keeping " + std::to_string(table) + " of the " + std::to_string(L) + " tables");
+				dropTables(table);
+				break;
+			}
+
+			hashTables(table, table + batchTables);
+			table += batchTables;
+		}
+	}
+
+	/*
+	 * The bins and postings a table not built yet will hold: the average of the tables built so far,
+	 * or the bound of a bin per row before the first one, whose id is stored raw either way.
+	 */
+	size_t Index::estimateTableBytes(int builtTables) const {
+		if (builtTables == 0) {
+			return (size_t) N * (3 * sizeof(unsigned) + 2 * sizeof(size_t));
+		}
+
+		MemoryUsage usage;
+		for (int t = 0; t < builtTables; ++t) {
+			tables[t]->addMemoryUsage(usage);
+		}
+		size_t bytes = 0;
+		for (auto category : { MemoryUsage::BINS, MemoryUsage::POSTINGS }) {
+			bytes += usage.getHostBytes(category) + usage.getDeviceBytes(category);
+		}
+		return (bytes + builtTables - 1) / builtTables;
+	}
+
+	/*
+	 * Deletes the tables from firstTable on, along with the groups of functions only they used.
+	 */
+	void Index::dropTables(int firstTable) {
+		for (int t = firstTable; t < L; ++t) {
+			delete tables[t];
+		}
+		tables.resize(firstTable);
+		L = firstTable;
+
+		if (options.shareHashFunctions) {
+			for (size_t group = getGroupsNumber(L); group < functionGroups.size(); ++group) {
+				delete functionGroups[group];
+			}
+			functionGroups.resize(getGroupsNumber(L));
+		}
+	}
+
+	/*
+	 * Hashes the dataset into the tables [firstTable, lastTable), all of them at once.
+	 * Every table is split in row ranges that are projected and hashed as independent tasks;
+	 * the last range of a table to finish queues the sort into bins of that table.
+	 * Tables sharing their functions hash with their groups instead, and once all the groups are
+	 * done each table combines the codes of its two groups before its sort.
+	 */
+	void Index::hashTables(int firstTable, int lastTable) {
+		int workersNumber = getWorkersNumber();
+		TaskScheduler scheduler(workersNumber);
+		std::vector<std::unique_ptr<ExecutionContext>> contexts(workersNumber);
+		auto getContext = [&contexts]() -> ExecutionContext& {
+			auto& context = contexts[TaskScheduler::getWorkerIdx()];
+			if (!context) {
+				context.reset(new ExecutionContext());
+			}
+			return *context;
+		};
+
+		bool isShared = options.shareHashFunctions;
+		std::vector<HashTable*> hashers;
+		std::vector<int> groupHashers(functionGroups.size(), -1);
+		if (isShared) {
+			for (int t = firstTable; t < lastTable; ++t) {
+				int groups[2];
+				getTableGroups(t, groups[0], groups[1]);
+				for (int group : groups) {
+					if (groupHashers[group] < 0) {
+						groupHashers[group] = hashers.size();
+						hashers.push_back(functionGroups[group]);
+					}
+				}
+			}
+		} else {
+			hashers.assign(tables.begin() + firstTable, tables.begin() + lastTable);
+		}
+
+		int hashersNumber = hashers.size();
+		long long rangesWanted = (long long) workersNumber * RANGES_PER_WORKER;
+		int rowsPerRange = std::max<long long>(MIN_ROWS_PER_RANGE, ((long long) N * hashersNumber + rangesWanted - 1) / rangesWanted);
+		// rows on the SSD are uploaded and hashed a chunk at a time, the ones in memory in a single chunk
+		int chunkRows = vectorStore ? std::max<int>(rowsPerRange, CONVERSION_CHUNK / d) : N;
+		int rangesPerHasher = 0;
+		for (int chunkBegin = 0; chunkBegin < N; chunkBegin += chunkRows) {
+			rangesPerHasher += (std::min(chunkRows, N - chunkBegin) + rowsPerRange - 1) / rowsPerRange;
+		}
+
+		std::vector<ThrustSizetV> hashes(hashersNumber);
+		std::unique_ptr<std::atomic<int>[]> remainingRanges(new std::atomic<int>[hashersNumber]);
+		for (int h = 0; h < hashersNumber; ++h) {
+			hashes[h].resize(N);
+			remainingRanges[h] = rangesPerHasher;
+		}
+
+		// the chunks alternate between two device buffers: the next one is read from the SSD and
+		// uploaded while the workers hash the current one, only a buffer still being hashed is waited for
+		std::vector<float> chunk;
+		ThrustFloatV dChunks[2];
+		std::atomic<int> pendingRanges[2];
+		pendingRanges[0] = pendingRanges[1] = 0;
+		std::mutex chunkMutex;
+		std::condition_variable chunkHashed;
+		try
+		{
+			for (int chunkBegin = 0, slot = 0; chunkBegin < N; chunkBegin += chunkRows, slot ^= 1) {
+				int chunkEnd = std::min(N, chunkBegin + chunkRows);
+				const void * dRows = getDeviceRows();
+				if (vectorStore) {
+					chunk.resize((size_t) (chunkEnd - chunkBegin) * d);
+					vectorStore->readRange(chunkBegin, chunkEnd - chunkBegin, chunk.data());
+					{
+						std::unique_lock<std::mutex> lock(chunkMutex);
+						chunkHashed.wait(lock, [&pendingRanges, slot] { return pendingRanges[slot] == 0; });
+					}
+					dChunks[slot].assign(chunk.begin(), chunk.end());
+					dRows = thrust::raw_pointer_cast(dChunks[slot].data());
+				}
+
+				pendingRanges[slot] = hashersNumber * ((chunkEnd - chunkBegin + rowsPerRange - 1) / rowsPerRange);
+				for (int h = 0; h < hashersNumber; ++h) {
+					for (int rowBegin = chunkBegin; rowBegin < chunkEnd; rowBegin += rowsPerRange) {
+						int rowEnd = std::min(chunkEnd, rowBegin + rowsPerRange);
+						scheduler.submit([&, h, dRows, slot, chunkBegin, rowBegin, rowEnd] {
+							// the buffer is released even if the range fails, the error comes out of wait
+							struct RangeDone {
+								std::atomic<int>& pending;
+								std::mutex& mutex;
+								std::condition_variable& hashed;
+								~RangeDone() {
+									if (--pending == 0) {
+										std::lock_guard<std::mutex> lock(mutex);
+										hashed.notify_all();
+									}
+								}
+							} rangeDone { pendingRanges[slot], chunkMutex, chunkHashed };
+
+							ExecutionContext& context = getContext();
+							size_t * dChunkHashes = thrust::raw_pointer_cast(hashes[h].data()) + chunkBegin;
+							hashers[h]->hashRows(dRows, options.storagePrecision, rowBegin - chunkBegin, rowEnd - chunkBegin, dChunkHashes, context);
+							// the bins may be built on another worker, hence on another stream
+							context.synchronize();
+
+							if (--remainingRanges[h] == 0 && !isShared) {
+								scheduler.submit([&, h] {
+									tables[firstTable + h]->buildBins(thrust::raw_pointer_cast(hashes[h].data()), N, getContext());
+									hashes[h].clear();
+									hashes[h].shrink_to_fit();
+								});
+							}
+						});
+					}
+				}
+			}
+		}
+		catch (const std::exception&)
+		{
+			// the ranges already submitted still read the buffers, they have to finish first
+			try
+			{
+				scheduler.wait();
+			}
+			catch (const std::exception&)
+			{
+			}
+			throw;
+		}
+		scheduler.wait();
+
+		if (isShared) {
+			for (int t = firstTable; t < lastTable; ++t) {
+				scheduler.submit([&, t] {
+					int firstGroup, secondGroup;
+					getTableGroups(t, firstGroup, secondGroup);
+					ExecutionContext& context = getContext();
+					ScratchBuffer<size_t> dHashes(context.getDeviceArena(), N);
+
+					dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
+					dim3 dimGrid((N + dimBlock.x - 1)/dimBlock.x);
+					combineHashes<<<dimGrid, dimBlock, 0, context.getStream()>>>(
+						thrust::raw_pointer_cast(hashes[groupHashers[firstGroup]].data()),
+						thrust::raw_pointer_cast(hashes[groupHashers[secondGroup]].data()),
+						N, dHashes.data()
+					);
+					tables[t]->buildBins(dHashes.data(), N, context);
+				});
+			}
+			scheduler.wait();
+		}
+	}
+
+	/*
+	 * Looks the queries up in the tables [firstTable, lastTable), the results of table t going to
+	 * results[t - firstTable]. With shared functions every group involved hashes the queries once.
+	 */
+	void Index::queryTables(int firstTable, int lastTable, const float* dQueries, unsigned Q, int probes, ExecutionContext& context, ThrustQueryResult* results) const {
+		if (!options.shareHashFunctions) {
+			// multi-probe cross-polytope tables hash on the host, the queries are downloaded once for all of them
+			bool readsHostQueries = firstTable < lastTable && tables[firstTable]->readsHostQueries(probes);
+			ScratchBuffer<float> queries(context.getHostArena(), readsHostQueries ? (size_t) Q * d : 0);
+			if (readsHostQueries) {
+				cudaMemcpyAsync(queries.data(), dQueries, (size_t) Q * d * sizeof(float), cudaMemcpyDeviceToHost, context.getStream());
+				context.synchronize();
+			}
+			for (int t = firstTable; t < lastTable; ++t) {
+				tables[t]->query(dQueries, queries.data(), Q, std::max(1, probes), context, results[t - firstTable]);
+			}
+			return;
+		}
+
+		ScratchBuffer<size_t> dGroupHashes(context.getDeviceArena(), functionGroups.size() * Q);
+		ScratchBuffer<size_t> dQueryHashes(context.getDeviceArena(), Q);
+		std::vector<bool> isHashed(functionGroups.size(), false);
+		dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
+		dim3 dimGrid((Q + dimBlock.x - 1)/dimBlock.x);
+		for (int t = firstTable; t < lastTable; ++t) {
+			int groups[2];
+			getTableGroups(t, groups[0], groups[1]);
+			for (int group : groups) {
+				if (!isHashed[group]) {
+					functionGroups[group]->hashRows(dQueries, FLOAT32, 0, Q, dGroupHashes.data() + (size_t) group * Q, context);
+					isHashed[group] = true;
+				}
+			}
+
+			combineHashes<<<dimGrid, dimBlock, 0, context.getStream()>>>(
+				dGroupHashes.data() + (size_t) groups[0] * Q,
+				dGroupHashes.data() + (size_t) groups[1] * Q,
+				Q, dQueryHashes.data()
 			);
-			finalResult.emplace_back(query, std::move(resultIdxsForQuery), size);
+			tables[t]->queryHashes(dQueryHashes.data(), Q, 1, context, results[t - firstTable]);
 		}
+	}
 
-		return finalResult;
+	/*
+	 * The tables go through the pairs of groups as (0, 1), (0, 2), (1, 2), (0, 3), ...: the groups of
+	 * the first tables do not depend on how many there are, so tables can be added later.
+	 */
+	void Index::getTableGroups(int table, int& firstGroup, int& secondGroup) {
+		int second = (int) ((1 + std::sqrt(1.0 + 8.0 * table)) / 2);
+		while ((long long) second * (second - 1) / 2 > table) {
+			--second;
+		}
+		while ((long long) (second + 1) * second / 2 <= table) {
+			++second;
+		}
+		firstGroup = table - second * (second - 1) / 2;
+		secondGroup = second;
 	}
 
-	void Index::sortDistancesAndTheirIdxs(ThrustFloatV& dDistances, ThrustUnsignedV& dCandidatesIdxs, const ThrustQueryResult* mergedResult) {
-		ThrustUnsignedV dCandidatesStartingIdxs(mergedResult->resultStartingIdxs);
-		ThrustUnsignedV dCandidatesSizes(mergedResult->resultSizes);
+	int Index::getGroupsNumber(int tablesNumber) {
+		if (tablesNumber == 0) {
+			return 0;
+		}
+		int firstGroup, secondGroup;
+		getTableGroups(tablesNumber - 1, firstGroup, secondGroup);
+		return secondGroup + 1;
+	}
 
-		unsigned Q = mergedResult->Q;
-		for (int query = 0; query < Q; ++query) {
-			thrust::sort_by_key(
-				dDistances.begin() + dCandidatesStartingIdxs[query],
-				dDistances.begin() + dCandidatesStartingIdxs[query] + dCandidatesSizes[query],
-				dCandidatesIdxs.begin() + dCandidatesStartingIdxs[query],
-				thrust::less<float>()
+	/*
+	 * Moves the rows of dDataset into the bin order of the first table and renames the ids of every
+	 * table after their new position. Tables added later hash the reordered rows, so they get the new
+	 * ids directly; only the query results are translated back. The bin codes are hashes, with no
+	 * notion of closeness between them, so the bins themselves are kept in the order of their codes.
+	 */
+	void Index::reorderByBuckets() {
+		internalToExternal.resize(N);
+		tables[0]->copySortedIdxs(internalToExternal.data());
+
+		externalToInternal.resize(N);
+		for (int i = 0; i < N; ++i) {
+			externalToInternal[internalToExternal[i]] = i;
+		}
+		translatedFilter.reset();
+		for (const auto& table : tables) {
+			table->remapIdxs(externalToInternal.data());
+		}
+
+		std::lock_guard<std::mutex> lock(defaultContextMutex);
+		ExecutionContext& context = defaultContext;
+		ScratchBuffer<unsigned> dRowIdxs(context.getDeviceArena(), N);
+		cudaMemcpyAsync(dRowIdxs.data(), internalToExternal.data(), N * sizeof(unsigned), cudaMemcpyHostToDevice, context.getStream());
+
+		dim3 dimBlock(BLOCK_SIZE, BLOCK_SIZE);
+		dim3 dimGrid((d + dimBlock.x - 1)/dimBlock.x, (N + dimBlock.y - 1)/dimBlock.y);
+		if (options.storagePrecision == FLOAT32) {
+			ThrustFloatV dReordered((size_t) N * d);
+			gatherRows<<<dimGrid, dimBlock, 0, context.getStream()>>>(
+				thrust::raw_pointer_cast(dDataset.data()),
+				dRowIdxs.data(),
+				N, d,
+				thrust::raw_pointer_cast(dReordered.data())
 			);
+			context.synchronize();
+			dDataset.swap(dReordered);
+		} else {
+			ThrustUshortV dReordered((size_t) N * d);
+			gatherRows<<<dimGrid, dimBlock, 0, context.getStream()>>>(
+				thrust::raw_pointer_cast(dDatasetStored.data()),
+				dRowIdxs.data(),
+				N, d,
+				thrust::raw_pointer_cast(dReordered.data())
+			);
+			context.synchronize();
+			dDatasetStored.swap(dReordered);
 		}
 	}
 
-	ThrustFloatV Index::calculateDistances(const float* queries, unsigned Q, const ThrustUnsignedV& dCandidatesIdxs, const ThrustQueryResult* result) {
-		unsigned distancesNumber = result->resultSetSize;
-		ThrustFloatV dDistances(distancesNumber);
+	/*
+	 * The code of the bucket every dataset row falls in, by original row id.
+	 */
+	void Index::copyRowCodes(int table, size_t* destination) const {
+		if (internalToExternal.empty()) {
+			tables[table]->copyRowCodes(destination);
+			return;
+		}
 
-		ThrustUnsignedV dQueriesIdxsToCandidates(distancesNumber);
-		for (int query = 0; query < Q; ++query) {
-			thrust::fill_n(
-				dQueriesIdxsToCandidates.begin() + result->resultStartingIdxs[query],
-				result->resultSizes[query],
-				query
+		std::vector<size_t> internalCodes(N);
+		tables[table]->copyRowCodes(internalCodes.data());
+		for (int i = 0; i < N; ++i) {
+			destination[internalToExternal[i]] = internalCodes[i];
+		}
+	}
+
+	int Index::getNumberOfTables() const {
+		return L;
+	}
+
+	MemoryUsage Index::getMemoryUsage() const {
+		MemoryUsage usage;
+		usage.add(MemoryUsage::DATASET, dataset->getRowsBytes(), dDataset.capacity() * sizeof(float) + dDatasetStored.capacity() * sizeof(uint16_t));
+		usage.add(MemoryUsage::ID_MAPS, (internalToExternal.capacity() + externalToInternal.capacity()) * sizeof(unsigned), 0);
+		for (auto table : tables) {
+			table->addMemoryUsage(usage);
+		}
+		for (auto functionGroup : functionGroups) {
+			functionGroup->addMemoryUsage(usage);
+		}
+		if (vectorStore) {
+			usage.add(MemoryUsage::VECTOR_CACHE, vectorStore->getCacheBytes(), 0);
+		}
+
+		std::lock_guard<std::mutex> lock(defaultContextMutex);
+		usage.add(MemoryUsage::SCRATCH, defaultContext.getHostArena().getCachedBytes(), defaultContext.getDeviceArena().getCachedBytes());
+		return usage;
+	}
+
+	const std::vector<std::string>& Index::getBudgetSteps() const {
+		return budgetSteps;
+	}
+
+	unsigned long long Index::getTotalBinsNumber() const {
+		unsigned long long total = 0;
+		for (const auto& table : tables) {
+			total += table->getBinsNumber();
+		}
+		return total;
+	}
+
+	QueryResult Index::query(Dataset* queries, unsigned numberOfNeighbors, const QueryOptions& queryOptions) const {
+		std::lock_guard<std::mutex> lock(defaultContextMutex);
+		return query(queries, numberOfNeighbors, defaultContext, queryOptions);
+	}
+
+	/*
+	 * The index is only read here: concurrent calls are safe as long as each thread passes its own context.
+	 * All the scratch memory comes from the arenas of the context, so repeated batches of the same size
+	 * allocate nothing but the returned results.
+	 */
+	QueryResult Index::query(Dataset* queries, unsigned numberOfNeighbors, ExecutionContext& context, const QueryOptions& queryOptions) const {
+		unsigned Q = queries->N;
+		ScratchArena& deviceArena = context.getDeviceArena();
+		cudaStream_t stream = context.getStream();
+
+		// uploaded once and shared by the projections of every table and by the distances
+		ScratchBuffer<float> dQueries(deviceArena, (size_t) Q * d);
+		uploadRows(*queries, 0, Q, dQueries.data(), context);
+
+		if (isFilterSelective(queryOptions)) {
+			return searchFilteredRows(dQueries.data(), Q, numberOfNeighbors, queryOptions, context);
+		}
+		if (queryOptions.candidateBudget > 0 || queryOptions.stopDistance > 0) {
+			return queryInRounds(dQueries.data(), Q, numberOfNeighbors, queryOptions, context);
+		}
+
+		ThrustQueryResult& mergedResult = collectCandidates(dQueries.data(), Q, queryOptions, context);
+
+		unsigned candidatesNumber = mergedResult.resultSetSize;
+		ScratchBuffer<unsigned> candidatesIdxs(context.getHostArena(), candidatesNumber);
+		ScratchBuffer<float> distances(context.getHostArena(), candidatesNumber);
+		std::vector<unsigned> stagedIdxs;
+		if (candidatesNumber > 0) {
+			if (vectorStore) {
+				stageCandidates(mergedResult, stagedIdxs);
+			}
+			ScratchBuffer<float> dStagedRows(deviceArena, stagedIdxs.size() * d);
+			fetchStagedRows(stagedIdxs, dStagedRows.data(), context);
+
+			ScratchBuffer<unsigned> dCandidatesIdxs(deviceArena, candidatesNumber);
+			ScratchBuffer<unsigned> dQueriesIdxs(deviceArena, candidatesNumber);
+			uploadCandidates(mergedResult, dCandidatesIdxs.data(), dQueriesIdxs.data(), context);
+
+			ScratchBuffer<float> dDistances(deviceArena, candidatesNumber);
+			calculateDistances(dQueries.data(), dCandidatesIdxs.data(), dQueriesIdxs.data(), candidatesNumber, dDistances.data(), context, dStagedRows.data());
+			sortDistancesAndTheirIdxs(dDistances.data(), dCandidatesIdxs.data(), dQueriesIdxs.data(), candidatesNumber, context);
+
+			cudaMemcpyAsync(candidatesIdxs.data(), dCandidatesIdxs.data(), candidatesNumber * sizeof(unsigned), cudaMemcpyDeviceToHost, stream);
+			cudaMemcpyAsync(distances.data(), dDistances.data(), candidatesNumber * sizeof(float), cudaMemcpyDeviceToHost, stream);
+		}
+
+		// the rows are sized while the copies run, then filled with the nearest candidates of each query
+		QueryResult result;
+		result.offsets.resize(Q + 1);
+		result.offsets[0] = 0;
+		for (unsigned query = 0; query < Q; ++query) {
+			result.offsets[query + 1] = result.offsets[query] + std::min(numberOfNeighbors, mergedResult.resultSizes[query]);
+		}
+		result.idxs.resize(result.offsets[Q]);
+		result.distances.resize(result.offsets[Q]);
+		context.synchronize();
+
+		for (unsigned query = 0; query < Q; ++query) {
+			unsigned begin = mergedResult.resultStartingIdxs[query];
+			std::copy_n(candidatesIdxs.data() + begin, result.getMatchesNumber(query), result.idxs.begin() + result.offsets[query]);
+			std::copy_n(distances.data() + begin, result.getMatchesNumber(query), result.distances.begin() + result.offsets[query]);
+		}
+		for (auto& distance : result.distances) {
+			distance = std::sqrt(distance);
+		}
+		if (vectorStore) {
+			for (auto& idx : result.idxs) {
+				idx = stagedIdxs[idx];
+			}
+		}
+		if (!internalToExternal.empty()) {
+			for (auto& idx : result.idxs) {
+				idx = internalToExternal[idx];
+			}
+		}
+		return result;
+	}
+
+	/*
+	 * Probes the tables a few at a time and reranks the new candidates of each round into a running
+	 * top K. A query stops taking candidates once it has candidateBudget of them or its kth neighbor
+	 * is within stopDistance; the probing stops when every query of the batch has stopped, so the
+	 * work per query is bounded whatever the size of the buckets. The candidates of a round are taken
+	 * in the order of the tables and of their probes, so a budget running out keeps those of the first
+	 * ones. The collision options do not apply, selective filters are searched exhaustively before.
+	 */
+	QueryResult Index::queryInRounds(const float* dQueries, unsigned Q, unsigned numberOfNeighbors, const QueryOptions& queryOptions, ExecutionContext& context) const {
+		std::shared_ptr<const Bitmap> internalFilter;
+		const Bitmap * filter = getInternalFilter(queryOptions, internalFilter);
+		unsigned budget = queryOptions.candidateBudget ? queryOptions.candidateBudget : std::numeric_limits<unsigned>::max();
+		if (queryOptions.candidateBudget == QueryOptions::AUTO_CANDIDATE_BUDGET) {
+			budget = std::min<unsigned long long>(3ULL * L * numberOfNeighbors, std::numeric_limits<unsigned>::max());
+		}
+		float squaredStopDistance = queryOptions.stopDistance * queryOptions.stopDistance;
+		int tablesPerRound = std::max(1, queryOptions.tablesPerRound);
+
+		// the candidates seen so far by each query, sorted, and its nearest ones as (squared distance, id)
+		std::vector<std::vector<unsigned>> seenIdxs(Q);
+		std::vector<std::vector<std::pair<float, unsigned>>> nearest(Q);
+		std::vector<bool> isDone(Q, false);
+		unsigned activeQueries = Q;
+
+		ThrustQueryResult& roundCandidates = context.mergedResult;
+		context.tableResults.resize(tablesPerRound);
+		// the new candidates of a query in a round as (id, arrival)
+		std::vector<std::pair<unsigned, unsigned>> freshIdxs;
+		std::vector<unsigned> tableIdxs;
+		std::vector<unsigned> keptIdxs;
+		std::vector<unsigned> stagedIdxs;
+		for (int firstTable = 0; firstTable < L && activeQueries > 0; firstTable += tablesPerRound) {
+			int roundTables = std::min(L - firstTable, tablesPerRound);
+			queryTables(firstTable, firstTable + roundTables, dQueries, Q, queryOptions.probes, context, context.tableResults.data());
+			unsigned maxCandidatesNumber = 0;
+			for (int i = 0; i < roundTables; ++i) {
+				maxCandidatesNumber += context.tableResults[i].resultSetSize;
+			}
+
+			roundCandidates.resultStartingIdxs.resize(Q);
+			roundCandidates.resultSizes.resize(Q);
+			roundCandidates.resultSet.resize(maxCandidatesNumber);
+			unsigned queryOffset = 0;
+			for (unsigned query = 0; query < Q; ++query) {
+				roundCandidates.resultStartingIdxs[query] = queryOffset;
+				roundCandidates.resultSizes[query] = 0;
+				if (isDone[query]) {
+					continue;
+				}
+
+				freshIdxs.clear();
+				for (int i = 0; i < roundTables; ++i) {
+					const ThrustQueryResult& tableResult = context.tableResults[i];
+					tableIdxs.resize(tableResult.resultSizes[query]);
+					copyTableIdxs(tableResult, query, tableIdxs.data());
+					for (unsigned idx : tableIdxs) {
+						freshIdxs.emplace_back(idx, freshIdxs.size());
+					}
+				}
+				// by id to drop the repeated, filtered and seen ones, keeping the first arrival of each
+				std::sort(freshIdxs.begin(), freshIdxs.end());
+				std::vector<unsigned>& seen = seenIdxs[query];
+				auto freshEnd = std::unique(freshIdxs.begin(), freshIdxs.end(), [](const std::pair<unsigned, unsigned>& a, const std::pair<unsigned, unsigned>& b) {
+					return a.first == b.first;
+				});
+				freshEnd = std::remove_if(freshIdxs.begin(), freshEnd, [filter, &seen](const std::pair<unsigned, unsigned>& fresh) {
+					return (filter && !filter->contains(fresh.first)) || std::binary_search(seen.begin(), seen.end(), fresh.first);
+				});
+				// then back in arrival order, where the budget cuts them
+				std::sort(freshIdxs.begin(), freshEnd, [](const std::pair<unsigned, unsigned>& a, const std::pair<unsigned, unsigned>& b) {
+					return a.second < b.second;
+				});
+				unsigned freshNumber = std::min<size_t>(freshEnd - freshIdxs.begin(), budget - seen.size());
+
+				keptIdxs.clear();
+				for (unsigned i = 0; i < freshNumber; ++i) {
+					keptIdxs.push_back(freshIdxs[i].first);
+				}
+				std::copy(keptIdxs.begin(), keptIdxs.end(), roundCandidates.resultSet.begin() + queryOffset);
+				std::sort(keptIdxs.begin(), keptIdxs.end());
+				size_t seenNumber = seen.size();
+				seen.insert(seen.end(), keptIdxs.begin(), keptIdxs.end());
+				std::inplace_merge(seen.begin(), seen.begin() + seenNumber, seen.end());
+
+				roundCandidates.resultSizes[query] = freshNumber;
+				queryOffset += freshNumber;
+			}
+			roundCandidates.resultSet.resize(queryOffset);
+			roundCandidates.Q = Q;
+			roundCandidates.resultSetSize = queryOffset;
+
+			unsigned candidatesNumber = queryOffset;
+			ScratchBuffer<unsigned> candidatesIdxs(context.getHostArena(), candidatesNumber);
+			ScratchBuffer<float> distances(context.getHostArena(), candidatesNumber);
+			if (candidatesNumber > 0) {
+				if (vectorStore) {
+					stageCandidates(roundCandidates, stagedIdxs);
+				}
+				ScratchBuffer<float> dStagedRows(context.getDeviceArena(), stagedIdxs.size() * d);
+				fetchStagedRows(stagedIdxs, dStagedRows.data(), context);
+
+				ScratchBuffer<unsigned> dCandidatesIdxs(context.getDeviceArena(), candidatesNumber);
+				ScratchBuffer<unsigned> dQueriesIdxs(context.getDeviceArena(), candidatesNumber);
+				uploadCandidates(roundCandidates, dCandidatesIdxs.data(), dQueriesIdxs.data(), context);
+
+				ScratchBuffer<float> dDistances(context.getDeviceArena(), candidatesNumber);
+				calculateDistances(dQueries, dCandidatesIdxs.data(), dQueriesIdxs.data(), candidatesNumber, dDistances.data(), context, dStagedRows.data());
+				cudaMemcpyAsync(candidatesIdxs.data(), dCandidatesIdxs.data(), candidatesNumber * sizeof(unsigned), cudaMemcpyDeviceToHost, context.getStream());
+				cudaMemcpyAsync(distances.data(), dDistances.data(), candidatesNumber * sizeof(float), cudaMemcpyDeviceToHost, context.getStream());
+				context.synchronize();
+			}
+
+			for (unsigned query = 0; query < Q; ++query) {
+				if (isDone[query]) {
+					continue;
+				}
+
+				std::vector<std::pair<float, unsigned>>& queryNearest = nearest[query];
+				unsigned begin = roundCandidates.resultStartingIdxs[query];
+				for (unsigned i = begin; i < begin + roundCandidates.resultSizes[query]; ++i) {
+					unsigned idx = candidatesIdxs.data()[i];
+					queryNearest.emplace_back(distances.data()[i], vectorStore ? stagedIdxs[idx] : idx);
+				}
+				size_t kept = std::min<size_t>(numberOfNeighbors, queryNearest.size());
+				std::partial_sort(queryNearest.begin(), queryNearest.begin() + kept, queryNearest.end());
+				queryNearest.resize(kept);
+
+				bool isNearEnough = squaredStopDistance > 0 && kept > 0 && kept == numberOfNeighbors && queryNearest.back().first <= squaredStopDistance;
+				if (seenIdxs[query].size() >= budget || isNearEnough) {
+					isDone[query] = true;
+					--activeQueries;
+				}
+			}
+		}
+
+		QueryResult result;
+		result.offsets.resize(Q + 1);
+		result.offsets[0] = 0;
+		for (unsigned query = 0; query < Q; ++query) {
+			result.offsets[query + 1] = result.offsets[query] + nearest[query].size();
+		}
+		result.idxs.resize(result.offsets[Q]);
+		result.distances.resize(result.offsets[Q]);
+		for (unsigned query = 0; query < Q; ++query) {
+			unsigned match = result.offsets[query];
+			for (const auto& neighbor : nearest[query]) {
+				result.idxs[match] = internalToExternal.empty() ? neighbor.second : internalToExternal[neighbor.second];
+				result.distances[match++] = std::sqrt(neighbor.first);
+			}
+		}
+		return result;
+	}
+
+	QueryResult Index::rangeQuery(Dataset* queries, float radius, const QueryOptions& queryOptions) const {
+		std::lock_guard<std::mutex> lock(defaultContextMutex);
+		return rangeQuery(queries, radius, defaultContext, queryOptions);
+	}
+
+	/*
+	 * All the candidates within the radius, found with the buckets of the top-K queries. The radius is
+	 * checked inside the distance kernel and the matches are compacted in candidate order, which keeps
+	 * them grouped by query: no sort is needed.
+	 */
+	QueryResult Index::rangeQuery(Dataset* queries, float radius, ExecutionContext& context, const QueryOptions& queryOptions) const {
+		unsigned Q = queries->N;
+		ScratchBuffer<float> dQueries(context.getDeviceArena(), (size_t) Q * d);
+		uploadRows(*queries, 0, Q, dQueries.data(), context);
+
+		size_t blockQueries = Q;
+		if (isFilterSelective(queryOptions)) {
+			blockQueries = std::max<size_t>(1, FILTER_BLOCK_CANDIDATES / std::max<size_t>(1, queryOptions.filter->getCardinality()));
+		}
+		if (blockQueries >= Q) {
+			return searchWithinRadius(dQueries.data(), Q, radius, queryOptions, context);
+		}
+
+		QueryResult result;
+		result.offsets.assign(1, 0);
+		for (unsigned blockStart = 0; blockStart < Q; blockStart += blockQueries) {
+			unsigned blockEnd = std::min<size_t>(Q, blockStart + blockQueries);
+			QueryResult blockResult = searchWithinRadius(dQueries.data() + (size_t) blockStart * d, blockEnd - blockStart, radius, queryOptions, context);
+			unsigned matchesBefore = result.idxs.size();
+			for (unsigned query = 0; query < blockEnd - blockStart; ++query) {
+				result.offsets.push_back(matchesBefore + blockResult.offsets[query + 1]);
+			}
+			result.idxs.insert(result.idxs.end(), blockResult.idxs.begin(), blockResult.idxs.end());
+			result.distances.insert(result.distances.end(), blockResult.distances.begin(), blockResult.distances.end());
+		}
+		return result;
+	}
+
+	/*
+	 * rangeQuery on queries already on the device.
+	 */
+	QueryResult Index::searchWithinRadius(const float* dQueries, unsigned Q, float radius, const QueryOptions& queryOptions, ExecutionContext& context) const {
+		ScratchArena& deviceArena = context.getDeviceArena();
+		cudaStream_t stream = context.getStream();
+		ThrustQueryResult& mergedResult = collectCandidates(dQueries, Q, queryOptions, context);
+
+		unsigned candidatesNumber = mergedResult.resultSetSize;
+		unsigned maxMatches = queryOptions.maxMatches ? queryOptions.maxMatches : std::numeric_limits<unsigned>::max();
+		QueryResult result;
+		std::vector<unsigned> stagedIdxs;
+		if (candidatesNumber > 0) {
+			if (vectorStore) {
+				stageCandidates(mergedResult, stagedIdxs);
+			}
+			ScratchBuffer<float> dStagedRows(deviceArena, stagedIdxs.size() * d);
+			fetchStagedRows(stagedIdxs, dStagedRows.data(), context);
+
+			ScratchBuffer<unsigned> dCandidatesIdxs(deviceArena, candidatesNumber);
+			ScratchBuffer<unsigned> dQueriesIdxs(deviceArena, candidatesNumber);
+			uploadCandidates(mergedResult, dCandidatesIdxs.data(), dQueriesIdxs.data(), context);
+
+			ScratchBuffer<unsigned> dMatchesCounts(deviceArena, Q);
+			ScratchBuffer<float> dDistances(deviceArena, candidatesNumber);
+			ScratchBuffer<bool> dMatched(deviceArena, candidatesNumber);
+			cudaMemsetAsync(dMatchesCounts.data(), 0, Q * sizeof(unsigned), stream);
+
+			dim3 dimBlock(BLOCK_SIZE_STRIDE_X, BLOCK_SIZE_STRIDE_Y);
+			dim3 dimGrid((candidatesNumber + dimBlock.x - 1)/ dimBlock.x);
+			float squaredRadius = radius * radius;
+			if (vectorStore || options.storagePrecision == FLOAT32) {
+				selectRowsWithinRadius<<<dimGrid, dimBlock, 0, stream>>>(
+					vectorStore ? dStagedRows.data() : thrust::raw_pointer_cast(dDataset.data()), dQueries, d,
+					dCandidatesIdxs.data(), dQueriesIdxs.data(), candidatesNumber,
+					squaredRadius, maxMatches, dMatchesCounts.data(), dDistances.data(), dMatched.data()
+				);
+			} else {
+				selectRowsWithinRadius<<<dimGrid, dimBlock, 0, stream>>>(
+					thrust::raw_pointer_cast(dDatasetStored.data()), options.storagePrecision, dQueries, d,
+					dCandidatesIdxs.data(), dQueriesIdxs.data(), candidatesNumber,
+					squaredRadius, maxMatches, dMatchesCounts.data(), dDistances.data(), dMatched.data()
+				);
+			}
+
+			// the counts go on past the limit, the matches kept do not
+			ScratchBuffer<unsigned> matchesCounts(context.getHostArena(), Q);
+			cudaMemcpyAsync(matchesCounts.data(), dMatchesCounts.data(), Q * sizeof(unsigned), cudaMemcpyDeviceToHost, stream);
+
+			ScratchBuffer<unsigned> dMatchesIdxs(deviceArena, candidatesNumber);
+			ScratchBuffer<float> dMatchesDistances(deviceArena, candidatesNumber);
+			thrust::copy_if(onContext(context), dCandidatesIdxs.begin(), dCandidatesIdxs.end(), dMatched.begin(), dMatchesIdxs.begin(), isTrue());
+			thrust::copy_if(onContext(context), dDistances.begin(), dDistances.end(), dMatched.begin(), dMatchesDistances.begin(), isTrue());
+			context.synchronize();
+
+			result.offsets.resize(Q + 1);
+			result.offsets[0] = 0;
+			for (unsigned query = 0; query < Q; ++query) {
+				result.offsets[query + 1] = result.offsets[query] + std::min(matchesCounts.data()[query], maxMatches);
+			}
+			unsigned matchesNumber = result.offsets[Q];
+			result.idxs.resize(matchesNumber);
+			result.distances.resize(matchesNumber);
+			cudaMemcpyAsync(result.idxs.data(), dMatchesIdxs.data(), matchesNumber * sizeof(unsigned), cudaMemcpyDeviceToHost, stream);
+			cudaMemcpyAsync(result.distances.data(), dMatchesDistances.data(), matchesNumber * sizeof(float), cudaMemcpyDeviceToHost, stream);
+		} else {
+			result.offsets.assign(Q + 1, 0);
+		}
+		context.synchronize();
+
+		for (auto& distance : result.distances) {
+			distance = std::sqrt(distance);
+		}
+		if (vectorStore) {
+			for (auto& idx : result.idxs) {
+				idx = stagedIdxs[idx];
+			}
+		}
+		if (!internalToExternal.empty()) {
+			for (auto& idx : result.idxs) {
+				idx = internalToExternal[idx];
+			}
+		}
+		return result;
+	}
+
+	QueryResult Index::selfJoin(const JoinOptions& joinOptions) const {
+		std::lock_guard<std::mutex> lock(defaultContextMutex);
+		return selfJoin(joinOptions, defaultContext);
+	}
+
+	/*
+	 * The pairs of rows sharing a bin in any table, found by walking the bins of the tables instead of
+	 * querying them with the dataset: the rows are hashed already. The bins are cut in tiles of rows that
+	 * are joined on the device in batches, and a set of the pairs seen so far drops those already found in
+	 * the previous tables. With a radius the pairs within it are listed under the smaller of their ids,
+	 * from the bins of at most RADIUS_BIN_SIZE rows; without, every row gets its numberOfNeighbors nearest
+	 * rows, the closest first, from the bins of at most GRAPH_BIN_SIZE_FACTOR times that many rows.
+	 * maxBinSize replaces either bound.
+	 */
+	QueryResult Index::selfJoin(const JoinOptions& joinOptions, ExecutionContext& context) const {
+		if (vectorStore) {
+			throw std::runtime_error("The self-join reads the rows on the device, not from a vector file");
+		}
+		bool isGraph = joinOptions.radius <= 0;
+		float squaredRadius = isGraph ? std::numeric_limits<float>::max() : joinOptions.radius * joinOptions.radius;
+		unsigned K = joinOptions.numberOfNeighbors;
+		if (isGraph && K == 0) {
+			throw std::runtime_error("The neighbor graph needs at least one neighbor per row");
+		}
+		// every pair of a bin goes through the pair set, the default bounds keep a skewed bin from filling it
+		unsigned maxBinSize = joinOptions.maxBinSize;
+		if (maxBinSize == 0 && isGraph) {
+			maxBinSize = JoinOptions::GRAPH_BIN_SIZE_FACTOR * K;
+		} else if (maxBinSize == 0) {
+			maxBinSize = JoinOptions::RADIUS_BIN_SIZE;
+		}
+		ScratchArena& deviceArena = context.getDeviceArena();
+		ScratchArena& hostArena = context.getHostArena();
+		cudaStream_t stream = context.getStream();
+
+		size_t maxBatchPairs = JOIN_BATCH_TILES * BLOCK_SIZE * BLOCK_SIZE;
+		ScratchBuffer<unsigned> dSortedIdxs(deviceArena, N);
+		ScratchBuffer<JoinTile> dTiles(deviceArena, JOIN_BATCH_TILES);
+		ScratchBuffer<unsigned> dPairsNumber(deviceArena, 1);
+		ScratchBuffer<unsigned> dFirstIdxs(deviceArena, maxBatchPairs);
+		ScratchBuffer<unsigned> dSecondIdxs(deviceArena, maxBatchPairs);
+		ScratchBuffer<float> dDistances(deviceArena, maxBatchPairs);
+		ScratchBuffer<unsigned> pairsNumber(hostArena, 1);
+		ScratchBuffer<unsigned> firstIdxs(hostArena, maxBatchPairs);
+		ScratchBuffer<unsigned> secondIdxs(hostArena, maxBatchPairs);
+		ScratchBuffer<float> distances(hostArena, maxBatchPairs);
+		ScratchBuffer<unsigned long long> dPairKeys(deviceArena, 0);
+		size_t pairKeysNumber = 0;
+
+		// by original row id: its pairs, or its nearest rows as a max-heap on the distance
+		std::vector<std::vector<std::pair<float, unsigned>>> neighbors(N);
+		auto addNeighbor = [&neighbors, K](unsigned row, unsigned neighbor, float distance) {
+			auto& heap = neighbors[row];
+			if (heap.size() < K) {
+				heap.emplace_back(distance, neighbor);
+				std::push_heap(heap.begin(), heap.end());
+			} else if (K > 0 && distance < heap.front().first) {
+				std::pop_heap(heap.begin(), heap.end());
+				heap.back() = std::make_pair(distance, neighbor);
+				std::push_heap(heap.begin(), heap.end());
+			}
+		};
+
+		std::vector<unsigned> sortedIdxs(N);
+		std::vector<unsigned> binStartingIndexes;
+		std::vector<unsigned> binSizes;
+		std::vector<JoinTile> tiles;
+		for (const auto& table : tables) {
+			unsigned binsNumber = table->getBinsNumber();
+			binStartingIndexes.resize(binsNumber);
+			binSizes.resize(binsNumber);
+			table->copySortedIdxs(sortedIdxs.data());
+			table->copyBinBounds(binStartingIndexes.data(), binSizes.data());
+			cudaMemcpyAsync(dSortedIdxs.data(), sortedIdxs.data(), N * sizeof(unsigned), cudaMemcpyHostToDevice, stream);
+
+			tiles.clear();
+			for (unsigned bin = 0; bin < binsNumber; ++bin) {
+				unsigned binSize = binSizes[bin];
+				if (binSize < 2 || binSize > maxBinSize) {
+					continue;
+				}
+				for (unsigned firstRow = 0; firstRow < binSize; firstRow += BLOCK_SIZE) {
+					for (unsigned secondRow = firstRow; secondRow < binSize; secondRow += BLOCK_SIZE) {
+						tiles.push_back({ binStartingIndexes[bin], binSize, firstRow, secondRow });
+					}
+				}
+			}
+
+			for (size_t batchStart = 0; batchStart < tiles.size(); batchStart += JOIN_BATCH_TILES) {
+				size_t batchTiles = std::min(JOIN_BATCH_TILES, tiles.size() - batchStart);
+				// at most half full whatever the batch adds
+				reservePairSet(dPairKeys, 2 * (pairKeysNumber + batchTiles * BLOCK_SIZE * BLOCK_SIZE), context);
+				cudaMemcpyAsync(dTiles.data(), tiles.data() + batchStart, batchTiles * sizeof(JoinTile), cudaMemcpyHostToDevice, stream);
+				cudaMemsetAsync(dPairsNumber.data(), 0, sizeof(unsigned), stream);
+
+				dim3 dimBlock(BLOCK_SIZE, BLOCK_SIZE);
+				dim3 dimGrid(batchTiles);
+				unsigned long long keysMask = dPairKeys.size() - 1;
+				if (options.storagePrecision == FLOAT32) {
+					joinBinTiles<<<dimGrid, dimBlock, 0, stream>>>(
+						thrust::raw_pointer_cast(dDataset.data()), d,
+						dSortedIdxs.data(), dTiles.data(), squaredRadius,
+						dPairKeys.data(), keysMask,
+						dPairsNumber.data(), dFirstIdxs.data(), dSecondIdxs.data(), dDistances.data()
+					);
+				} else {
+					joinBinTiles<<<dimGrid, dimBlock, 0, stream>>>(
+						thrust::raw_pointer_cast(dDatasetStored.data()), options.storagePrecision, d,
+						dSortedIdxs.data(), dTiles.data(), squaredRadius,
+						dPairKeys.data(), keysMask,
+						dPairsNumber.data(), dFirstIdxs.data(), dSecondIdxs.data(), dDistances.data()
+					);
+				}
+				cudaMemcpyAsync(pairsNumber.data(), dPairsNumber.data(), sizeof(unsigned), cudaMemcpyDeviceToHost, stream);
+				context.synchronize();
+
+				unsigned batchPairs = pairsNumber.data()[0];
+				cudaMemcpyAsync(firstIdxs.data(), dFirstIdxs.data(), batchPairs * sizeof(unsigned), cudaMemcpyDeviceToHost, stream);
+				cudaMemcpyAsync(secondIdxs.data(), dSecondIdxs.data(), batchPairs * sizeof(unsigned), cudaMemcpyDeviceToHost, stream);
+				cudaMemcpyAsync(distances.data(), dDistances.data(), batchPairs * sizeof(float), cudaMemcpyDeviceToHost, stream);
+				context.synchronize();
+				pairKeysNumber += batchPairs;
+
+				for (unsigned pair = 0; pair < batchPairs; ++pair) {
+					unsigned first = firstIdxs.data()[pair];
+					unsigned second = secondIdxs.data()[pair];
+					if (!internalToExternal.empty()) {
+						first = internalToExternal[first];
+						second = internalToExternal[second];
+					}
+					float distance = distances.data()[pair];
+					if (isGraph) {
+						addNeighbor(first, second, distance);
+						addNeighbor(second, first, distance);
+					} else {
+						neighbors[std::min(first, second)].emplace_back(distance, std::max(first, second));
+					}
+				}
+			}
+		}
+
+		QueryResult result;
+		result.offsets.resize(N + 1);
+		result.offsets[0] = 0;
+		for (int row = 0; row < N; ++row) {
+			auto& rowNeighbors = neighbors[row];
+			if (isGraph) {
+				std::sort_heap(rowNeighbors.begin(), rowNeighbors.end());
+			} else {
+				std::sort(rowNeighbors.begin(), rowNeighbors.end());
+			}
+			result.offsets[row + 1] = result.offsets[row] + rowNeighbors.size();
+			for (const auto& neighbor : rowNeighbors) {
+				result.idxs.push_back(neighbor.second);
+				result.distances.push_back(std::sqrt(neighbor.first));
+			}
+			std::vector<std::pair<float, unsigned>>().swap(rowNeighbors);
+		}
+		return result;
+	}
+
+	/*
+	 * Grows the pair set of the self-join to a power of two of at least capacity slots, keeping its keys.
+	 * The old set goes back to the arena of the context.
+	 */
+	void Index::reservePairSet(ScratchBuffer<unsigned long long>& dPairKeys, size_t capacity, ExecutionContext& context) {
+		if (dPairKeys.size() >= capacity) {
+			return;
+		}
+		size_t newCapacity = std::max<size_t>(dPairKeys.size(), BLOCK_SIZE * BLOCK_SIZE);
+		while (newCapacity < capacity) {
+			newCapacity *= 2;
+		}
+
+		ScratchBuffer<unsigned long long> dNewPairKeys(context.getDeviceArena(), newCapacity);
+		thrust::fill(onContext(context), dNewPairKeys.begin(), dNewPairKeys.end(), EMPTY_PAIR_KEY);
+		if (dPairKeys.size()) {
+			dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
+			dim3 dimGrid((dPairKeys.size() + dimBlock.x - 1)/dimBlock.x);
+			rehashPairKeys<<<dimGrid, dimBlock, 0, context.getStream()>>>(
+				dPairKeys.data(), dPairKeys.size(),
+				dNewPairKeys.data(), newCapacity - 1
 			);
 		}
+		context.synchronize();
+		dPairKeys.swap(dNewPairKeys);
+	}
+
+	/*
+	 * The candidates of every query, from the buckets of the tables or the filter alone when it is
+	 * selective enough. They are left in the merged result of the context.
+	 */
+	ThrustQueryResult& Index::collectCandidates(const float* dQueries, unsigned Q, const QueryOptions& queryOptions, ExecutionContext& context) const {
+		std::shared_ptr<const Bitmap> internalFilter;
+		const Bitmap * filter = getInternalFilter(queryOptions, internalFilter);
+
+		ThrustQueryResult& mergedResult = context.mergedResult;
+		if (isFilterSelective(queryOptions)) {
+			// every vector passing the filter is a candidate of every query
+			fillWithFilter(*filter, Q, mergedResult);
+		} else {
+			context.tableResults.resize(L);
+			queryTables(0, L, dQueries, Q, queryOptions.probes, context, context.tableResults.data());
+			mergeQueryResults(context.tableResults, Q, filter, queryOptions, mergedResult);
+		}
+		return mergedResult;
+	}
+
+	/*
+	 * The filter of the options in the ids of the rows on the device. When the rows were reordered it
+	 * is translated once per version of the filter, and internalFilter keeps the translation alive
+	 * for the caller even if another filter replaces it meanwhile.
+	 */
+	const Bitmap* Index::getInternalFilter(const QueryOptions& queryOptions, std::shared_ptr<const Bitmap>& internalFilter) const {
+		const Bitmap * filter = queryOptions.filter;
+		if (!filter || externalToInternal.empty()) {
+			return filter;
+		}
 
-		ThrustFloatV dQueries(queries, queries + Q * d);
-		ThrustFloatV dDataset(dataset->dataset, dataset->dataset + N * d);
+		std::lock_guard<std::mutex> lock(translatedFilterMutex);
+		if (!translatedFilter || translatedFilterVersion != filter->getVersion()) {
+			translatedFilter = std::make_shared<const Bitmap>(toInternalIdxs(*filter));
+			translatedFilterVersion = filter->getVersion();
+		}
+		internalFilter = translatedFilter;
+		return internalFilter.get();
+	}
 
-		dim3 dimBlock(BLOCK_SIZE_STRIDE_X, BLOCK_SIZE_STRIDE_Y);
-		dim3 dimGrid((distancesNumber + dimBlock.x - 1)/ dimBlock.x);
+	bool Index::isFilterSelective(const QueryOptions& queryOptions) const {
+		return queryOptions.filter && queryOptions.filter->getCardinality() <= queryOptions.bruteForceSelectivity * N;
+	}
 
-		calcSquaredDistances<<<dimGrid, dimBlock>>>(
-			thrust::raw_pointer_cast(dDataset.data()),
-			thrust::raw_pointer_cast(dQueries.data()),
-			d,
-			thrust::raw_pointer_cast(dCandidatesIdxs.data()),
-			thrust::raw_pointer_cast(dQueriesIdxsToCandidates.data()),
-			distancesNumber,
-			thrust::raw_pointer_cast(dDistances.data())
-		);
+	/*
+	 * Exact k-NN over the rows passing a selective filter: the tiled search of BruteForce over tiles
+	 * gathered from those rows, numbered by their position in the filter. Only a tile and the top
+	 * lists are on the device at once, whatever the size of the filter.
+	 */
+	QueryResult Index::searchFilteredRows(const float* dQueries, unsigned Q, unsigned numberOfNeighbors, const QueryOptions& queryOptions, ExecutionContext& context) const {
+		std::shared_ptr<const Bitmap> internalFilter;
+		const Bitmap * filter = getInternalFilter(queryOptions, internalFilter);
+		std::vector<unsigned> filterIdxs;
+		filter->copyIds(filterIdxs);
+		if (!filterIdxs.empty() && filterIdxs.back() >= (unsigned) N) {
+			throw std::runtime_error("The filter holds ids outside of the dataset");
+		}
+
+		unsigned filterSize = filterIdxs.size();
+		unsigned K = std::min(numberOfNeighbors, filterSize);
+		QueryResult result;
+		result.offsets.resize(Q + 1);
+		for (unsigned query = 0; query <= Q; ++query) {
+			result.offsets[query] = query * K;
+		}
+		if (K == 0) {
+			return result;
+		}
+
+		ScratchArena& deviceArena = context.getDeviceArena();
+		cudaStream_t stream = context.getStream();
+		ScratchBuffer<float> dQueriesNorms(deviceArena, Q);
+		dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
+		dim3 dimGrid((Q + dimBlock.x - 1)/dimBlock.x);
+		calcSquaredNorms<<<dimGrid, dimBlock, 0, stream>>>(dQueries, Q, d, dQueriesNorms.data());
+
+		ScratchBuffer<float> dTopDistances(deviceArena, (size_t) Q * K);
+		ScratchBuffer<int> dTopIdxs(deviceArena, (size_t) Q * K);
+		thrust::fill(onContext(context), dTopDistances.begin(), dTopDistances.end(), std::numeric_limits<float>::max());
+		thrust::fill(onContext(context), dTopIdxs.begin(), dTopIdxs.end(), -1);
 
-		return dDistances;
+		int maxTileRows = std::min<unsigned>(filterSize, BruteForce::TILE_ROWS);
+		bool isStored = !vectorStore && options.storagePrecision != FLOAT32;
+		ScratchBuffer<unsigned> dTileIdxs(deviceArena, vectorStore ? 0 : maxTileRows);
+		ScratchBuffer<float> dTile(deviceArena, (size_t) maxTileRows * d);
+		ScratchBuffer<unsigned short> dStoredTile(deviceArena, isStored ? (size_t) maxTileRows * d : 0);
+		ScratchBuffer<float> tile(context.getHostArena(), vectorStore ? (size_t) maxTileRows * d : 0);
+		for (unsigned tileStart = 0; tileStart < filterSize; tileStart += maxTileRows) {
+			int tileRows = std::min<unsigned>(maxTileRows, filterSize - tileStart);
+			if (vectorStore) {
+				// the previous tile may still be read from the pinned rows
+				context.synchronize();
+				vectorStore->fetch(filterIdxs.data() + tileStart, tileRows, tile.data());
+				cudaMemcpyAsync(dTile.data(), tile.data(), (size_t) tileRows * d * sizeof(float), cudaMemcpyHostToDevice, stream);
+			} else {
+				cudaMemcpyAsync(dTileIdxs.data(), filterIdxs.data() + tileStart, tileRows * sizeof(unsigned), cudaMemcpyHostToDevice, stream);
+				dim3 dimGatherBlock(BLOCK_SIZE, BLOCK_SIZE);
+				dim3 dimGatherGrid((d + dimGatherBlock.x - 1)/dimGatherBlock.x, (tileRows + dimGatherBlock.y - 1)/dimGatherBlock.y);
+				if (isStored) {
+					size_t size = (size_t) tileRows * d;
+					gatherRows<<<dimGatherGrid, dimGatherBlock, 0, stream>>>(
+						thrust::raw_pointer_cast(dDatasetStored.data()), dTileIdxs.data(), tileRows, d, dStoredTile.data()
+					);
+					expandToFloat<<<(size + dimBlock.x - 1)/dimBlock.x, dimBlock, 0, stream>>>(dStoredTile.data(), size, options.storagePrecision, dTile.data());
+				} else {
+					gatherRows<<<dimGatherGrid, dimGatherBlock, 0, stream>>>(
+						thrust::raw_pointer_cast(dDataset.data()), dTileIdxs.data(), tileRows, d, dTile.data()
+					);
+				}
+			}
+			BruteForce::mergeTile(dQueries, dQueriesNorms.data(), Q, d, dTile.data(), tileStart, tileRows, K, dTopDistances.data(), dTopIdxs.data(), context);
+		}
+
+		result.idxs.resize((size_t) Q * K);
+		result.distances.resize((size_t) Q * K);
+		cudaMemcpyAsync(result.idxs.data(), dTopIdxs.data(), (size_t) Q * K * sizeof(int), cudaMemcpyDeviceToHost, stream);
+		cudaMemcpyAsync(result.distances.data(), dTopDistances.data(), (size_t) Q * K * sizeof(float), cudaMemcpyDeviceToHost, stream);
+		context.synchronize();
+
+		for (auto& idx : result.idxs) {
+			idx = filterIdxs[idx];
+			if (!internalToExternal.empty()) {
+				idx = internalToExternal[idx];
+			}
+		}
+		// the expansion through the norms can go slightly below zero
+		for (auto& distance : result.distances) {
+			distance = std::sqrt(std::max(distance, 0.0f));
+		}
+		return result;
+	}
+
+	/*
+	 * Renames the candidates of a batch after their position among its distinct candidates, listed in
+	 * increasing order in stagedIdxs: each row is fetched once per batch, in the order of the file.
+	 */
+	void Index::stageCandidates(ThrustQueryResult& candidates, std::vector<unsigned>& stagedIdxs) const {
+		auto candidatesBegin = candidates.resultSet.begin();
+		auto candidatesEnd = candidatesBegin + candidates.resultSetSize;
+		stagedIdxs.assign(candidatesBegin, candidatesEnd);
+		std::sort(stagedIdxs.begin(), stagedIdxs.end());
+		stagedIdxs.erase(std::unique(stagedIdxs.begin(), stagedIdxs.end()), stagedIdxs.end());
+		for (auto candidate = candidatesBegin; candidate != candidatesEnd; ++candidate) {
+			*candidate = std::lower_bound(stagedIdxs.begin(), stagedIdxs.end(), (unsigned) *candidate) - stagedIdxs.begin();
+		}
 	}
 
-	ThrustQueryResult* Index::mergeQueryResults(thrust::host_vector<ThrustQueryResult*>& results, unsigned Q) {
+	/*
+	 * Reads the staged rows from the vector store into pinned memory and copies them to the device.
+	 */
+	void Index::fetchStagedRows(const std::vector<unsigned>& stagedIdxs, float* dStagedRows, ExecutionContext& context) const {
+		if (stagedIdxs.empty()) {
+			return;
+		}
+		size_t size = stagedIdxs.size() * d;
+		ScratchBuffer<float> stagedRows(context.getHostArena(), size);
+		vectorStore->fetch(stagedIdxs.data(), stagedIdxs.size(), stagedRows.data());
+		cudaMemcpyAsync(dStagedRows, stagedRows.data(), size * sizeof(float), cudaMemcpyHostToDevice, context.getStream());
+		// the pinned rows go back to the arena on return
+		context.synchronize();
+	}
+
+	/*
+	 * Copies the candidates to the device along with the query each of them belongs to.
+	 */
+	void Index::uploadCandidates(const ThrustQueryResult& candidates, unsigned* dCandidatesIdxs, unsigned* dQueriesIdxs, ExecutionContext& context) const {
+		unsigned Q = candidates.Q;
+		unsigned candidatesNumber = candidates.resultSetSize;
+		cudaStream_t stream = context.getStream();
+
+		ScratchBuffer<unsigned> dCandidatesStartingIdxs(context.getDeviceArena(), Q);
+		cudaMemcpyAsync(dCandidatesIdxs, thrust::raw_pointer_cast(candidates.resultSet.data()), candidatesNumber * sizeof(unsigned), cudaMemcpyHostToDevice, stream);
+		cudaMemcpyAsync(dCandidatesStartingIdxs.data(), thrust::raw_pointer_cast(candidates.resultStartingIdxs.data()), Q * sizeof(unsigned), cudaMemcpyHostToDevice, stream);
+
+		dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
+		dim3 dimGrid((candidatesNumber + dimBlock.x - 1)/dimBlock.x);
+		mapCandidatesToQueries<<<dimGrid, dimBlock, 0, stream>>>(dCandidatesStartingIdxs.data(), Q, candidatesNumber, dQueriesIdxs);
+	}
+
+	/*
+	 * Sorts the candidates by query and then by distance, the distances along with their ids, in a
+	 * single sort for the whole batch: the keys put the candidates of a query together.
+	 */
+	void Index::sortDistancesAndTheirIdxs(float* dDistances, unsigned* dCandidatesIdxs, const unsigned* dQueriesIdxs, unsigned candidatesNumber, ExecutionContext& context) const {
+		ScratchBuffer<unsigned long long> dKeys(context.getDeviceArena(), candidatesNumber);
+
+		dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
+		dim3 dimGrid((candidatesNumber + dimBlock.x - 1)/dimBlock.x);
+		makeQueryDistanceKeys<<<dimGrid, dimBlock, 0, context.getStream()>>>(dQueriesIdxs, dDistances, candidatesNumber, dKeys.data());
+
+		thrust::sort_by_key(onContext(context), dKeys.begin(), dKeys.end(), dCandidatesIdxs);
+		splitQueryDistanceKeys<<<dimGrid, dimBlock, 0, context.getStream()>>>(dKeys.data(), candidatesNumber, dDistances);
+	}
+
+	void Index::calculateDistances(const float* dQueries, const unsigned* dCandidatesIdxs, const unsigned* dQueriesIdxs, unsigned candidatesNumber, float* dDistances, ExecutionContext& context, const float* dStagedRows) const {
+		dim3 dimBlock(BLOCK_SIZE_STRIDE_X, BLOCK_SIZE_STRIDE_Y);
+		dim3 dimGrid((candidatesNumber + dimBlock.x - 1)/ dimBlock.x);
+
+		// staged rows are indexed by their position among the staged ones
+		if (dStagedRows || options.storagePrecision == FLOAT32) {
+			calcSquaredDistances<<<dimGrid, dimBlock, 0, context.getStream()>>>(
+				dStagedRows ? dStagedRows : thrust::raw_pointer_cast(dDataset.data()),
+				dQueries,
+				d,
+				dCandidatesIdxs,
+				dQueriesIdxs,
+				candidatesNumber,
+				dDistances
+			);
+		} else {
+			calcSquaredDistances<<<dimGrid, dimBlock, 0, context.getStream()>>>(
+				thrust::raw_pointer_cast(dDatasetStored.data()),
+				options.storagePrecision,
+				dQueries,
+				d,
+				dCandidatesIdxs,
+				dQueriesIdxs,
+				candidatesNumber,
+				dDistances
+			);
+		}
+	}
+
+	/*
+	 * The filter and the collision counts are applied here, before any distance is computed for the
+	 * candidates they reject.
+	 */
+	void Index::mergeQueryResults(const std::vector<ThrustQueryResult>& results, unsigned Q, const Bitmap* filter, const QueryOptions& queryOptions, ThrustQueryResult& mergedResult) const {
 		unsigned maxCandidatesNumber = getMaxCandidatesNumber(results);
 
-		ThrustHUnsignedV candidatesStartingIdxs(Q, 0);
-		ThrustHUnsignedV candidatesSizes(Q, 0);
-		ThrustHUnsignedV candidateIdxs(maxCandidatesNumber);
+		ThrustHUnsignedV& candidatesStartingIdxs = mergedResult.resultStartingIdxs;
+		ThrustHUnsignedV& candidatesSizes = mergedResult.resultSizes;
+		ThrustHUnsignedV& candidateIdxs = mergedResult.resultSet;
+		candidatesStartingIdxs.resize(Q);
+		candidatesSizes.resize(Q);
+		candidateIdxs.resize(maxCandidatesNumber);
+		std::vector<std::pair<unsigned, unsigned>> collisions;
 
 		unsigned queryOffset = 0;
 		for (int query = 0; query < Q; ++query) {
 			candidatesStartingIdxs[query] = queryOffset;
+			candidatesSizes[query] = 0;
+			// the tables decode their bins right where the candidates of the query go
 			for(const auto& tableResult: results) {
-				thrust::copy_n(
-					tableResult->resultSet.begin() + tableResult->resultStartingIdxs[query],
-					tableResult->resultSizes[query],
-					candidateIdxs.begin() + candidatesStartingIdxs[query] + candidatesSizes[query]
-				);
-				candidatesSizes[query] += tableResult->resultSizes[query];
+				copyTableIdxs(tableResult, query, thrust::raw_pointer_cast(candidateIdxs.data()) + candidatesStartingIdxs[query] + candidatesSizes[query]);
+				candidatesSizes[query] += tableResult.resultSizes[query];
 			}
 
 			auto candidatesForQueryBegin = candidateIdxs.begin() + candidatesStartingIdxs[query];
 			auto candidatesForQueryEnd = candidatesForQueryBegin + candidatesSizes[query];
 			thrust::sort(candidatesForQueryBegin, candidatesForQueryEnd);
 
-			candidatesForQueryEnd = thrust::unique(candidatesForQueryBegin, candidatesForQueryEnd);
-			candidatesSizes[query] = thrust::distance(candidatesForQueryBegin, candidatesForQueryEnd);
+			// the copies of a candidate stay next to each other, one per table it collided in
+			if (filter) {
+				candidatesSizes[query] = filter->filterSorted(&*candidatesForQueryBegin, candidatesSizes[query]);
+			}
+			candidatesSizes[query] = selectByCollisions(
+				&*candidatesForQueryBegin, candidatesSizes[query],
+				queryOptions.minCollisions, queryOptions.maxRerankCandidates, collisions
+			);
 			queryOffset += candidatesSizes[query];
 		}
 
+		// shrinking keeps the capacity for the next query
 		auto totalCandidatesNumber = queryOffset;
 		candidateIdxs.resize(totalCandidatesNumber);
 
-		return new ThrustQueryResult(candidatesStartingIdxs, candidatesSizes, candidateIdxs, Q, totalCandidatesNumber);
+		mergedResult.Q = Q;
+		mergedResult.resultSetSize = totalCandidatesNumber;
 	}
 
-	unsigned Index::getMaxCandidatesNumber(thrust::host_vector<ThrustQueryResult*>& results) {
-		thrust::host_vector<unsigned> resultsSizes(L);
-		thrust::transform(results.begin(), results.end(), resultsSizes.begin(), [](ThrustQueryResult* q) {
-			return q->resultSetSize;
-		});
-		return thrust::reduce(resultsSizes.begin(), resultsSizes.end());
+	/*
+	 * The candidates of query in the results of a table, decoded from its bins, or copied from
+	 * resultSet when the results were not filled by a table.
+	 */
+	void Index::copyTableIdxs(const ThrustQueryResult& tableResult, unsigned query, unsigned* destination) {
+		if (tableResult.table) {
+			tableResult.table->copyQueryIdxs(tableResult, query, destination);
+		} else {
+			std::copy_n(tableResult.resultSet.begin() + tableResult.resultStartingIdxs[query], tableResult.resultSizes[query], destination);
+		}
 	}
 
-	void Index::allocateProjectionMemory() {
-		for (int i = 0; i < L; i++)
+	/*
+	 * Removes the repeated ids of a sorted list, keeping those repeated at least minCollisions times and,
+	 * of these, the maxCandidates repeated the most. The ids left are still sorted.
+	 */
+	unsigned Index::selectByCollisions(unsigned* idxs, unsigned size, unsigned minCollisions, unsigned maxCandidates, std::vector<std::pair<unsigned, unsigned>>& collisions) {
+		if (minCollisions <= 1 && maxCandidates == 0) {
+			return std::unique(idxs, idxs + size) - idxs;
+		}
+
+		collisions.clear();
+		for (unsigned i = 0; i < size;) {
+			unsigned runEnd = i + 1;
+			while (runEnd < size && idxs[runEnd] == idxs[i]) {
+				++runEnd;
+			}
+			if (runEnd - i >= minCollisions) {
+				collisions.emplace_back(runEnd - i, idxs[i]);
+			}
+			i = runEnd;
+		}
+
+		if (maxCandidates > 0 && collisions.size() > maxCandidates) {
+			// the most collisions first, the lower id on ties to keep the choice deterministic
+			std::nth_element(collisions.begin(), collisions.begin() + maxCandidates, collisions.end(),
+				[](const std::pair<unsigned, unsigned>& a, const std::pair<unsigned, unsigned>& b) {
+					return a.first > b.first || (a.first == b.first && a.second < b.second);
+				}
+			);
+			collisions.resize(maxCandidates);
+			std::sort(collisions.begin(), collisions.end(),
+				[](const std::pair<unsigned, unsigned>& a, const std::pair<unsigned, unsigned>& b) {
+					return a.second < b.second;
+				}
+			);
+		}
+
+		for (unsigned i = 0; i < collisions.size(); ++i) {
+			idxs[i] = collisions[i].second;
+		}
+		return collisions.size();
+	}
+
+	void Index::fillWithFilter(const Bitmap& filter, unsigned Q, ThrustQueryResult& mergedResult) const {
+		ThrustHUnsignedV& candidateIdxs = mergedResult.resultSet;
+		std::vector<unsigned> filterIdxs;
+		filter.copyIds(filterIdxs);
+		if (!filterIdxs.empty() && filterIdxs.back() >= (unsigned) N) {
+			throw std::runtime_error("The filter holds ids outside of the dataset");
+		}
+
+		// the candidates are counted in 32 bits, rangeQuery splits the queries to stay well below
+		unsigned filterSize = filterIdxs.size();
+		size_t candidatesNumber = (size_t) Q * filterSize;
+		if (candidatesNumber > std::numeric_limits<unsigned>::max()) {
+			throw std::runtime_error("Too many queries for the rows of the filter, split them in smaller batches");
+		}
+		mergedResult.resultStartingIdxs.resize(Q);
+		mergedResult.resultSizes.resize(Q);
+		candidateIdxs.resize(candidatesNumber);
+		for (unsigned query = 0; query < Q; ++query) {
+			mergedResult.resultStartingIdxs[query] = (size_t) query * filterSize;
+			mergedResult.resultSizes[query] = filterSize;
+			std::copy(filterIdxs.begin(), filterIdxs.end(), candidateIdxs.begin() + (size_t) query * filterSize);
+		}
+
+		mergedResult.Q = Q;
+		mergedResult.resultSetSize = candidatesNumber;
+	}
+
+	Bitmap Index::toInternalIdxs(const Bitmap& filter) const {
+		std::vector<unsigned> idxs;
+		filter.copyIds(idxs);
+		for (auto& idx : idxs) {
+			if (idx >= (unsigned) N) {
+				throw std::runtime_error("The filter holds ids outside of the dataset");
+			}
+			idx = externalToInternal[idx];
+		}
+		std::sort(idxs.begin(), idxs.end());
+		return Bitmap::fromSorted(idxs.data(), idxs.size());
+	}
+
+	unsigned Index::getMaxCandidatesNumber(const std::vector<ThrustQueryResult>& results) const {
+		unsigned total = 0;
+		for (const auto& result : results) {
+			total += result.resultSetSize;
+		}
+		return total;
+	}
+
+	void Index::allocateProjectionMemory(int firstTable) {
+		if (options.shareHashFunctions && k % 2 != 0) {
+			throw std::runtime_error("Tables sharing their hash functions need an even k");
+		}
+
+		for (int i = firstTable; i < L; i++)
 		{
-			auto table = new HashTable(k, d, w);
-			table->allocateProjectionMemory();
+			auto table = new HashTable(k, d, w, options);
+			if (!options.shareHashFunctions) {
+				table->allocateProjectionMemory();
+			}
 			tables.push_back(std::move(table));
 		}
+
+		if (options.shareHashFunctions) {
+			for (int group = functionGroups.size(); group < getGroupsNumber(L); ++group) {
+				auto functionGroup = new HashTable(k / 2, d, w, options);
+				functionGroup->allocateProjectionMemory();
+				functionGroups.push_back(functionGroup);
+			}
+		}
 	}
 
-	void Index::generateRandomProjections() {
+	void Index::generateRandomProjections(int firstTable) {
 		curandGenerator_t uniform;
 		curandGenerator_t normal;
 
 		curandCreateGenerator(&uniform, CURAND_RNG_PSEUDO_DEFAULT);
 		curandCreateGenerator(&normal, CURAND_RNG_PSEUDO_DEFAULT);
 
-		curandSetPseudoRandomGeneratorSeed(uniform, (unsigned long long) time(0));
-		curandSetPseudoRandomGeneratorSeed(normal, (unsigned long long) time(0));
+		// shared functions are drawn by the groups, which only grow along with the tables
+		const std::vector<HashTable*>& projected = options.shareHashFunctions ? functionGroups : tables;
+		int first = options.shareHashFunctions ? getGroupsNumber(firstTable) : firstTable;
 
-		for (int i = 0; i < L; i++)
+		// tables added later must not replay the random streams of the earlier ones
+		curandSetPseudoRandomGeneratorSeed(uniform, seed + 2 * first);
+		curandSetPseudoRandomGeneratorSeed(normal, seed + 2 * first + 1);
+
+		for (int i = first; i < (int) projected.size(); i++)
 		{
-			tables[i]->generateProjection(&normal, &uniform);
+			projected[i]->generateProjection(&normal, &uniform);
 		}
 
 		curandDestroyGenerator(normal);
@@ -208,6 +1573,20 @@ namespace cuANN {
 		{
 			tables[i]->freeMemory();
 		}
+		for (auto functionGroup : functionGroups) {
+			functionGroup->freeMemory();
+		}
+	}
+
+	void Index::releaseTables() {
+		for (auto table : tables) {
+			delete table;
+		}
+		tables.clear();
+		for (auto functionGroup : functionGroups) {
+			delete functionGroup;
+		}
+		functionGroups.clear();
 	}
 }
 
@@ -3,15 +3,23 @@
 
 #include "HashTable.h"
 #include "Dataset.h"
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 #include "ThrustQueryResult.h"
 #include "QueryResult.h"
+#include "IndexOptions.h"
+#include "QueryOptions.h"
+#include "JoinOptions.h"
+#include "VectorStore.h"
+#include "MemoryUsage.h"
 
 namespace cuANN {
 	class Index
 	{
 	public:
-		Index(int k, int L, Dataset * data, float w);
+		Index(int k, int L, Dataset * data, float w, const IndexOptions& options = IndexOptions());
 
 		~Index();
 
@@ -19,31 +27,142 @@ namespace cuANN {
 
 		bool buildIndex();
 
-		std::vector<QueryResult> query(Dataset* queries, unsigned numberOfNeighbors);
+		bool addTables(int count);
+
+		int getNumberOfTables() const;
+
+		unsigned long long getTotalBinsNumber() const;
+
+		void copyRowCodes(int table, size_t* destination) const;
+
+		// the host rows of the dataset included
+		MemoryUsage getMemoryUsage() const;
+
+		// what the last build gave up to fit in the memory budget, in order
+		const std::vector<std::string>& getBudgetSteps() const;
+
+		QueryResult query(Dataset* queries, unsigned numberOfNeighbors, const QueryOptions& queryOptions = QueryOptions()) const;
+
+		QueryResult query(Dataset* queries, unsigned numberOfNeighbors, ExecutionContext& context, const QueryOptions& queryOptions = QueryOptions()) const;
+
+		QueryResult rangeQuery(Dataset* queries, float radius, const QueryOptions& queryOptions = QueryOptions()) const;
+
+		QueryResult rangeQuery(Dataset* queries, float radius, ExecutionContext& context, const QueryOptions& queryOptions = QueryOptions()) const;
+
+		QueryResult selfJoin(const JoinOptions& joinOptions = JoinOptions()) const;
+
+		QueryResult selfJoin(const JoinOptions& joinOptions, ExecutionContext& context) const;
 
 	private:
+		// times the private stages in isolation
+		friend class Benchmark;
+
 		Dataset * dataset;
 		int k;
 		int L;
 		float w;
 		int d;
 		int N;
+		std::vector<std::string> budgetSteps;
+		static constexpr int MIN_ROWS_PER_RANGE = 16384;
+		static constexpr int RANGES_PER_WORKER = 4;
+		static constexpr size_t CONVERSION_CHUNK = 1 << 22;
+		static constexpr size_t JOIN_BATCH_TILES = 1 << 14;
+		// device and host scratch of sorting a table into its bins, per row
+		static constexpr size_t BIN_BUILD_BYTES_PER_ROW = 32;
+		// range queries on a selective filter take every row passing it as a candidate, in blocks of
+		// queries with at most this many candidates
+		static constexpr size_t FILTER_BLOCK_CANDIDATES = 1 << 24;
+		IndexOptions options;
+		bool isBuilt;
+		unsigned long long seed;
 
 		std::vector<HashTable*> tables;
+		// with shared hash functions: the groups of k/2 functions the tables are made of, only used to hash
+		std::vector<HashTable*> functionGroups;
+		// the rows in fp32, or in dDatasetStored when a 16 bit storage was asked for
+		ThrustFloatV dDataset;
+		ThrustUshortV dDatasetStored;
+		// the rows on the SSD instead, when a vector file was given
+		std::unique_ptr<VectorStore> vectorStore;
+		// original id of each row of dDataset and the other way round, empty if the rows were not reordered
+		std::vector<unsigned> internalToExternal;
+		std::vector<unsigned> externalToInternal;
+
+		// used by the queries that do not bring their own context, one at a time
+		mutable ExecutionContext defaultContext;
+		mutable std::mutex defaultContextMutex;
+
+		// the last filter translated to the ids of the reordered rows, and the version it was translated from
+		mutable std::shared_ptr<const Bitmap> translatedFilter;
+		mutable unsigned long long translatedFilterVersion;
+		mutable std::mutex translatedFilterMutex;
+
+		void allocateProjectionMemory(int firstTable);
+
+		void generateRandomProjections(int firstTable);
 
-		void allocateProjectionMemory();
+		void freeProjectionMemory();
 
-		void generateRandomProjections();
+		void releaseTables();
 
-		void freeProjectionMemory();
+		void uploadDataset();
+
+		const void* getDeviceRows() const;
+
+		int getWorkersNumber() const;
+
+		void buildTables(int firstTable);
+
+		size_t estimateTableBytes(int builtTables) const;
+
+		void dropTables(int firstTable);
+
+		void hashTables(int firstTable, int lastTable);
+
+		void queryTables(int firstTable, int lastTable, const float* dQueries, unsigned Q, int probes, ExecutionContext& context, ThrustQueryResult* results) const;
+
+		static void getTableGroups(int table, int& firstGroup, int& secondGroup);
+
+		static int getGroupsNumber(int tablesNumber);
+
+		void reorderByBuckets();
+
+		QueryResult queryInRounds(const float* dQueries, unsigned Q, unsigned numberOfNeighbors, const QueryOptions& queryOptions, ExecutionContext& context) const;
+
+		const Bitmap* getInternalFilter(const QueryOptions& queryOptions, std::shared_ptr<const Bitmap>& internalFilter) const;
+
+		bool isFilterSelective(const QueryOptions& queryOptions) const;
+
+		QueryResult searchFilteredRows(const float* dQueries, unsigned Q, unsigned numberOfNeighbors, const QueryOptions& queryOptions, ExecutionContext& context) const;
+
+		QueryResult searchWithinRadius(const float* dQueries, unsigned Q, float radius, const QueryOptions& queryOptions, ExecutionContext& context) const;
+
+		ThrustQueryResult& collectCandidates(const float* dQueries, unsigned Q, const QueryOptions& queryOptions, ExecutionContext& context) const;
+
+		void stageCandidates(ThrustQueryResult& candidates, std::vector<unsigned>& stagedIdxs) const;
+
+		void fetchStagedRows(const std::vector<unsigned>& stagedIdxs, float* dStagedRows, ExecutionContext& context) const;
+
+		void uploadCandidates(const ThrustQueryResult& candidates, unsigned* dCandidatesIdxs, unsigned* dQueriesIdxs, ExecutionContext& context) const;
+
+		static void reservePairSet(ScratchBuffer<unsigned long long>& dPairKeys, size_t capacity, ExecutionContext& context);
+
+		void sortDistancesAndTheirIdxs(float* dDistances, unsigned* dCandidatesIdxs, const unsigned* dQueriesIdxs, unsigned candidatesNumber, ExecutionContext& context) const;
+
+		void calculateDistances(const float* dQueries, const unsigned* dCandidatesIdxs, const unsigned* dQueriesIdxs, unsigned candidatesNumber, float* dDistances, ExecutionContext& context, const float* dStagedRows = 0) const;
+
+		void mergeQueryResults(const std::vector<ThrustQueryResult>& results, unsigned Q, const Bitmap* filter, const QueryOptions& queryOptions, ThrustQueryResult& mergedResult) const;
+
+		static void copyTableIdxs(const ThrustQueryResult& tableResult, unsigned query, unsigned* destination);
 
-		void sortDistancesAndTheirIdxs(ThrustFloatV& dDistances, ThrustUnsignedV& dCandidatesIdxs, const ThrustQueryResult* mergedResult);
+		static unsigned selectByCollisions(unsigned* idxs, unsigned size, unsigned minCollisions, unsigned maxCandidates, std::vector<std::pair<unsigned, unsigned>>& collisions);
 
-		ThrustFloatV calculateDistances(const float* queries, unsigned Q, const ThrustUnsignedV& dCandidatesIdxs, const ThrustQueryResult* result);
+		void fillWithFilter(const Bitmap& filter, unsigned Q, ThrustQueryResult& mergedResult) const;
 
-		ThrustQueryResult* mergeQueryResults(thrust::host_vector<ThrustQueryResult*>& results, unsigned Q);
+		Bitmap toInternalIdxs(const Bitmap& filter) const;
 
-		unsigned getMaxCandidatesNumber(thrust::host_vector<ThrustQueryResult*>& results);
+		unsigned getMaxCandidatesNumber(const std::vector<ThrustQueryResult>& results) const;
 	};
 }
 
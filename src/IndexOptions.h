@@ -0,0 +1,60 @@
+#ifndef __cuANN_INDEXOPTIONS_H_
+#define __cuANN_INDEXOPTIONS_H_
+
+#include <cstddef>
+#include <string>
+#include "PrecisionConverter.h"
+
+namespace cuANN {
+	// p-stable: floor((a.x + b) / w) on Gaussian projections; cross-polytope: the closest vertex after
+	// a pseudo-random rotation, for angular data
+	enum HashFamily { PSTABLE, CROSS_POLYTOPE };
+
+	/*
+	 * Build time choices shared by the Index and its tables.
+	 */
+	struct IndexOptions {
+		// keep the ids of every bin delta-encoded and bit-packed instead of as raw 32 bit ints
+		bool compressPostings;
+
+		// threads hashing the tables during the build, 0 for one per core
+		int buildThreads;
+
+		// store the rows on the device in the bin order of the first table, so the candidates
+		// of a bin are reranked from contiguous memory
+		bool reorderByBuckets;
+
+		// format of the rows and projections on the device, the projections are rounded to it too
+		Precision storagePrecision;
+
+		// the functions of the tables, w is only used by the p-stable ones
+		HashFamily hashFamily;
+
+		// p-stable projections computed as fast Hadamard transforms with random diagonals, in O(d log d)
+		// per block of up to d projections and with O(d) values kept instead of a k x d matrix
+		bool structuredProjections;
+
+		// build the tables from pairs of shared groups of k/2 hash functions instead of k functions each,
+		// m groups give m(m-1)/2 tables for the projection cost of m/2 of them
+		bool shareHashFunctions;
+
+		// store file of the fp32 rows (see VectorStore), read from the SSD at build and rerank time instead
+		// of keeping them on the device; empty to keep them in memory
+		std::string vectorFile;
+
+		// rows of the vector file kept in host memory, the ones reranked most often
+		size_t vectorCacheRows;
+
+		// bytes the index may hold on the host and the device together, 0 for no limit; a build that would
+		// go over it builds fewer tables at a time, then compresses the postings, then drops tables
+		size_t memoryBudget;
+
+		// seed of the random projections, 0 to take it from the clock
+		unsigned long long seed;
+
+		IndexOptions() : compressPostings(false), buildThreads(0), reorderByBuckets(false), storagePrecision(FLOAT32),
+			hashFamily(PSTABLE), structuredProjections(false), shareHashFunctions(false), vectorCacheRows(0), memoryBudget(0), seed(0) {}
+	};
+}
+
+#endif /* __cuANN_INDEXOPTIONS_H_ */
@@ -0,0 +1,61 @@
+#ifndef __IvecsWriter__
+#define __IvecsWriter__
+
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include "QueryResult.h"
+
+using namespace std;
+
+/*
+ * Writes one .ivecs vector per query of a result: the number of ids as a 4 byte int followed by the ids,
+ * the same layout VectorFileReader reads the ground truth from.
+ */
+class IvecsWriter
+{
+public:
+	IvecsWriter(string fileName);
+	
+	~IvecsWriter();
+
+	void writeResults(const cuANN::QueryResult& results);
+
+private:
+	ofstream ivecsFile;
+	static constexpr int STEP_SIZE = 4;
+
+	void writeNextVector(const int* idxs, int dimension);
+};
+
+IvecsWriter::IvecsWriter(string fileName) {
+	ivecsFile = ofstream(fileName, ios::out | ios::binary | ios::trunc);
+	if (ivecsFile.fail())
+	{
+		throw runtime_error("The file " + fileName + " cannot be opened");
+	}
+}
+
+IvecsWriter::~IvecsWriter() {
+	ivecsFile.close();
+}
+
+void IvecsWriter::writeResults(const cuANN::QueryResult& results) {
+	// the ids fit in an int, they are written straight from the rows
+	for (unsigned query = 0; query < results.getQueriesNumber(); ++query) {
+		writeNextVector(reinterpret_cast<const int*>(results.getIdxs(query)), results.getMatchesNumber(query));
+	}
+	ivecsFile.flush();
+	if (!ivecsFile)
+	{
+		throw runtime_error("Couldn't write the ground truth");
+	}
+}
+
+void IvecsWriter::writeNextVector(const int* idxs, int dimension) {
+	ivecsFile.write(reinterpret_cast<const char*>(&dimension), STEP_SIZE);
+	ivecsFile.write(reinterpret_cast<const char*>(idxs), dimension*STEP_SIZE);
+}
+
+#endif
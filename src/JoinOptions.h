@@ -0,0 +1,29 @@
+#ifndef __cuANN_JOINOPTIONS_H_
+#define __cuANN_JOINOPTIONS_H_
+
+namespace cuANN {
+	/*
+	 * Choices of a self-join of the dataset, see Index::selfJoin.
+	 */
+	struct JoinOptions {
+		// the default largest bin of the graph, per neighbor wanted
+		static constexpr unsigned GRAPH_BIN_SIZE_FACTOR = 64;
+
+		// the default largest bin of a join within a radius, some millions of pairs
+		static constexpr unsigned RADIUS_BIN_SIZE = 4096;
+
+		// the pairs closer than this are returned, 0 to build the neighbor graph instead
+		float radius;
+
+		// neighbors kept per row in the graph
+		unsigned numberOfNeighbors;
+
+		// bins with more rows than this are skipped, their pairs grow with the square of their size; 0 for
+		// RADIUS_BIN_SIZE on the pairs within a radius and GRAPH_BIN_SIZE_FACTOR * numberOfNeighbors on the graph
+		unsigned maxBinSize;
+
+		JoinOptions() : radius(0.0f), numberOfNeighbors(10), maxBinSize(0) {}
+	};
+}
+
+#endif /* __cuANN_JOINOPTIONS_H_ */
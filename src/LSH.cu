@@ -5,12 +5,13 @@
 #include "utils.h"
 
 namespace cuANN {
-	LSH::LSH(int k, int L, float w, Dataset* data) {
+	LSH::LSH(int k, int L, float w, Dataset* data, const IndexOptions& options) {
 		this->dataset = data;
-		index = new Index(k, L, this->dataset, w);
+		index = new Index(k, L, this->dataset, w, options);
 	}
 
 	LSH::~LSH(){
+		delete index;
 		delete dataset;
 	}
 
@@ -18,8 +19,24 @@ namespace cuANN {
 		this->index->buildIndex();
 	}
 
-	std::vector<QueryResult> LSH::queryIndex(Dataset* queries, int numberOfNeighbors) {
-		return index->query(queries, numberOfNeighbors);
+	QueryResult LSH::queryIndex(Dataset* queries, int numberOfNeighbors, const QueryOptions& queryOptions) {
+		return index->query(queries, numberOfNeighbors, queryOptions);
+	}
+
+	QueryResult LSH::rangeQueryIndex(Dataset* queries, float radius, const QueryOptions& queryOptions) {
+		return index->rangeQuery(queries, radius, queryOptions);
+	}
+
+	QueryResult LSH::selfJoin(const JoinOptions& joinOptions) {
+		return index->selfJoin(joinOptions);
+	}
+
+	const Index* LSH::getIndex() const {
+		return index;
+	}
+
+	MemoryUsage LSH::getMemoryUsage() const {
+		return index->getMemoryUsage();
 	}
 }
 
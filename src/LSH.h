@@ -10,13 +10,21 @@ namespace cuANN {
 	class LSH
 	{
 	public:
-		LSH(int k, int L, float w, Dataset* data);
+		LSH(int k, int L, float w, Dataset* data, const IndexOptions& options = IndexOptions());
 		LSH(const cuANN::LSH &) = delete;
 		~LSH();
 
 		void buildIndex();
 
-		std::vector<QueryResult> queryIndex(Dataset* queries, int numberOfNeighbors);
+		QueryResult queryIndex(Dataset* queries, int numberOfNeighbors, const QueryOptions& queryOptions = QueryOptions());
+
+		QueryResult rangeQueryIndex(Dataset* queries, float radius, const QueryOptions& queryOptions = QueryOptions());
+
+		QueryResult selfJoin(const JoinOptions& joinOptions = JoinOptions());
+
+		const Index* getIndex() const;
+
+		MemoryUsage getMemoryUsage() const;
 
 	private:
 		Dataset * dataset;
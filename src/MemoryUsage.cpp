@@ -0,0 +1,99 @@
+#ifndef __cuANN_MemoryUsage__
+#define __cuANN_MemoryUsage__
+
+#include <iomanip>
+#include "MemoryUsage.h"
+
+namespace cuANN {
+	MemoryUsage::MemoryUsage() {
+		for (int category = 0; category < CATEGORIES; ++category) {
+			hostBytes[category] = deviceBytes[category] = 0;
+		}
+	}
+
+	void MemoryUsage::add(Category category, size_t hostBytes, size_t deviceBytes) {
+		this->hostBytes[category] += hostBytes;
+		this->deviceBytes[category] += deviceBytes;
+	}
+
+	void MemoryUsage::add(const MemoryUsage& other) {
+		for (int category = 0; category < CATEGORIES; ++category) {
+			hostBytes[category] += other.hostBytes[category];
+			deviceBytes[category] += other.deviceBytes[category];
+		}
+	}
+
+	void MemoryUsage::scaleRows(double factor) {
+		for (auto category : { DATASET, BINS, POSTINGS, ID_MAPS }) {
+			hostBytes[category] = (size_t) (hostBytes[category] * factor);
+			deviceBytes[category] = (size_t) (deviceBytes[category] * factor);
+		}
+	}
+
+	size_t MemoryUsage::getHostBytes(Category category) const {
+		return hostBytes[category];
+	}
+
+	size_t MemoryUsage::getDeviceBytes(Category category) const {
+		return deviceBytes[category];
+	}
+
+	size_t MemoryUsage::getHostBytes() const {
+		size_t total = 0;
+		for (int category = 0; category < CATEGORIES; ++category) {
+			total += hostBytes[category];
+		}
+		return total;
+	}
+
+	size_t MemoryUsage::getDeviceBytes() const {
+		size_t total = 0;
+		for (int category = 0; category < CATEGORIES; ++category) {
+			total += deviceBytes[category];
+		}
+		return total;
+	}
+
+	size_t MemoryUsage::getTotalBytes() const {
+		return getHostBytes() + getDeviceBytes();
+	}
+
+	void MemoryUsage::report(std::ostream& out) const {
+		const double megabyte = 1024.0 * 1024.0;
+		std::ios::fmtflags flags = out.flags();
+		out << std::fixed << std::setprecision(2);
+		out << std::left << std::setw(14) << "memory" << std::right << std::setw(12) << "host MB" << std::setw(12) << "device MB" << std::endl;
+		for (int category = 0; category < CATEGORIES; ++category) {
+			out << std::left << std::setw(14) << getName((Category) category) << std::right
+				<< std::setw(12) << hostBytes[category] / megabyte
+				<< std::setw(12) << deviceBytes[category] / megabyte << std::endl;
+		}
+		out << std::left << std::setw(14) << "total" << std::right
+			<< std::setw(12) << getHostBytes() / megabyte
+			<< std::setw(12) << getDeviceBytes() / megabyte << std::endl;
+		out.flags(flags);
+	}
+
+	const char* MemoryUsage::getName(Category category) {
+		switch (category) {
+		case DATASET:
+			return "dataset";
+		case PROJECTIONS:
+			return "projections";
+		case BINS:
+			return "bins";
+		case POSTINGS:
+			return "postings";
+		case ID_MAPS:
+			return "id maps";
+		case VECTOR_CACHE:
+			return "vector cache";
+		case SCRATCH:
+			return "scratch";
+		default:
+			return "unknown";
+		}
+	}
+}
+
+#endif // !__cuANN_MemoryUsage__
@@ -0,0 +1,49 @@
+#ifndef __cuANN_MEMORYUSAGE_H_
+#define __cuANN_MEMORYUSAGE_H_
+
+#include <cstddef>
+#include <ostream>
+
+namespace cuANN {
+	/*
+	 * The bytes an index holds on the host and on the device, by what they are for.
+	 * Each owner adds what it allocated, the report is only as exact as their bookkeeping:
+	 * containers count their capacity, the scratch arenas what they keep cached.
+	 */
+	class MemoryUsage
+	{
+	public:
+		enum Category { DATASET, PROJECTIONS, BINS, POSTINGS, ID_MAPS, VECTOR_CACHE, SCRATCH, CATEGORIES };
+
+		MemoryUsage();
+
+		void add(Category category, size_t hostBytes, size_t deviceBytes);
+
+		void add(const MemoryUsage& other);
+
+		// scales what grows with the rows, the dataset, bins, postings and id maps, to estimate the same
+		// index over factor times as many rows
+		void scaleRows(double factor);
+
+		size_t getHostBytes(Category category) const;
+
+		size_t getDeviceBytes(Category category) const;
+
+		size_t getHostBytes() const;
+
+		size_t getDeviceBytes() const;
+
+		size_t getTotalBytes() const;
+
+		// one line per category in MB, then the totals
+		void report(std::ostream& out) const;
+
+		static const char* getName(Category category);
+
+	private:
+		size_t hostBytes[CATEGORIES];
+		size_t deviceBytes[CATEGORIES];
+	};
+}
+
+#endif /* __cuANN_MEMORYUSAGE_H_ */
@@ -0,0 +1,310 @@
+#ifndef __cuANN_ParameterTuner__
+#define __cuANN_ParameterTuner__
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <unordered_set>
+#include "ParameterTuner.h"
+#include "BruteForce.h"
+
+namespace cuANN {
+	constexpr int ParameterTuner::MIN_DIMENSION_RANKS;
+	constexpr int ParameterTuner::PRUNE_FACTOR;
+
+	static const int HASH_FUNCS_CANDIDATES[] = { 4, 8, 12, 16, 20 };
+	// bin widths are tried as multiples of the mean distance to the k-th exact neighbor
+	static const float BIN_WIDTH_FACTORS[] = { 0.5f, 1.0f, 2.0f, 4.0f, 8.0f };
+
+	ParameterTuner::ParameterTuner(Dataset * data, Dataset * queries, unsigned numberOfNeighbors) {
+		if (!data->hasRows()) {
+			throw std::runtime_error("The tuner samples the vectors in memory, not in a vector file");
+		}
+		this->dataset = data;
+		this->queries = queries;
+		this->sample = 0;
+		this->numberOfNeighbors = numberOfNeighbors;
+		this->sampleSize = 10000;
+		this->maxL = 64;
+		this->hasGroundTruth = false;
+		this->exactDimension = 0;
+	}
+
+	ParameterTuner::~ParameterTuner() {
+		releaseSample();
+	}
+
+	void ParameterTuner::setGroundTruth(const std::vector<int>& groundtruthIdxs, int dimension) {
+		if (groundtruthIdxs.size() < (size_t) queries->N * dimension) {
+			throw std::runtime_error("The ground truth does not cover all the tuning queries");
+		}
+		exactIdxs = groundtruthIdxs;
+		exactDimension = dimension;
+		hasGroundTruth = true;
+	}
+
+	void ParameterTuner::setSampleSize(int sampleSize) {
+		this->sampleSize = sampleSize;
+	}
+
+	void ParameterTuner::setMaxTables(int maxL) {
+		this->maxL = maxL;
+	}
+
+	TuningResult ParameterTuner::tune(float targetRecall, size_t memoryBudget) {
+		prepareSample();
+		float neighborDistance = estimateNeighborDistance();
+		// the k-th neighbor in the whole dataset is closer than in the sample, by (n / N)^(1 / D)
+		// for data of intrinsic dimension D
+		float datasetScale = sample == dataset ? 1.0f : std::pow((float) sample->N / dataset->N, 1.0f / estimateIntrinsicDimension());
+
+		// the model only ranks the pairs, so it rules out the hopeless ones but keeps the best of them
+		int fewestTables = std::numeric_limits<int>::max();
+		for (int k : HASH_FUNCS_CANDIDATES) {
+			for (float factor : BIN_WIDTH_FACTORS) {
+				fewestTables = std::min(fewestTables, predictTables(k, factor * neighborDistance, neighborDistance, targetRecall));
+			}
+		}
+		// the rows on the host and the device and one table of ids over the whole dataset, whatever the bins
+		size_t minIndexBytes = dataset->getRowsBytes() + (size_t) dataset->N * (dataset->d * sizeof(float) + sizeof(unsigned));
+
+		TuningResult best = { 0, 0, 0.0f, -1.0f, 0.0, 0, false, false };
+		for (int k : HASH_FUNCS_CANDIDATES) {
+			for (float factor : BIN_WIDTH_FACTORS) {
+				float w = factor * neighborDistance;
+				int predictedL = predictTables(k, w, neighborDistance, targetRecall);
+				if (predictedL > std::max(fewestTables, PRUNE_FACTOR * maxL)) {
+					continue;
+				}
+				if (memoryBudget && minIndexBytes + (size_t) k * dataset->d * sizeof(float) > memoryBudget) {
+					continue;
+				}
+
+				// L only grows the candidate sets, so each (k, w) pair starts below the predicted
+				// number of tables and adds new ones until the target is met or the budget is exceeded
+				int L = std::max(1, std::min(maxL, predictedL / 2));
+				Index index(k, L, sample, w);
+				index.buildIndex();
+				while (true) {
+					// what the index holds on the sample, extrapolated to the whole dataset, whose host rows
+					// may be uint8 where the sample widened them
+					MemoryUsage usage = index.getMemoryUsage();
+					usage.scaleRows((double) dataset->N / sample->N);
+					size_t indexBytes = usage.getTotalBytes() - usage.getHostBytes(MemoryUsage::DATASET) + dataset->getRowsBytes();
+					if (memoryBudget && indexBytes > memoryBudget) {
+						break;
+					}
+
+					auto startTime = std::chrono::high_resolution_clock::now();
+					auto results = index.query(queries, numberOfNeighbors);
+					auto endTime = std::chrono::high_resolution_clock::now();
+					double queryMillis = std::chrono::duration<double, std::milli>(endTime - startTime).count() / queries->N;
+
+					float recall = measureRecall(results, exactIdxs, exactDimension, numberOfNeighbors);
+					bool targetReached = recall >= targetRecall;
+					bool isBetter = targetReached
+						? (!best.targetReached || queryMillis < best.queryMillis)
+						: (!best.targetReached && recall > best.recall);
+					if (isBetter) {
+						best = { k, L, w, recall, queryMillis, indexBytes, targetReached, false };
+					}
+
+					if (targetReached || L >= maxL) {
+						break;
+					}
+					int nextL = std::min(2 * L, maxL);
+					if (!index.addTables(nextL - L)) {
+						break;
+					}
+					L = nextL;
+				}
+			}
+		}
+
+		if (best.L == 0) {
+			throw std::runtime_error("No configuration fits in the given memory budget");
+		}
+		if (sample != dataset) {
+			best.w *= datasetScale;
+			validate(best);
+		}
+		return best;
+	}
+
+	void ParameterTuner::prepareSample() {
+		releaseSample();
+
+		// the ground truth refers to ids of the whole dataset, so it cannot be subsampled
+		if (hasGroundTruth || dataset->N <= sampleSize) {
+			sample = dataset;
+			if (!hasGroundTruth) {
+				computeExactNeighbors();
+			}
+			return;
+		}
+
+		std::vector<int> rowIdxs(dataset->N);
+		for (int i = 0; i < dataset->N; ++i) {
+			rowIdxs[i] = i;
+		}
+		std::mt19937 generator(42);
+		for (int i = 0; i < sampleSize; ++i) {
+			std::uniform_int_distribution<int> pick(i, dataset->N - 1);
+			std::swap(rowIdxs[i], rowIdxs[pick(generator)]);
+		}
+
+		int d = dataset->d;
+		float * sampleData = (float *)HostAllocator::allocate((size_t) sampleSize * d * sizeof(float));
+		if (!sampleData)
+		{
+			throw std::runtime_error("Cannot allocate the tuning sample");
+		}
+		// uint8 rows are widened here, the sample is small
+		for (int i = 0; i < sampleSize; ++i) {
+			dataset->copyRows(rowIdxs[i], 1, sampleData + (size_t) i * d);
+		}
+		sample = new Dataset(sampleData, sampleSize, d, d);
+
+		computeExactNeighbors();
+	}
+
+	void ParameterTuner::computeExactNeighbors() {
+		BruteForce bruteForce(sample);
+		auto results = bruteForce.query(queries, std::max<unsigned>(numberOfNeighbors, MIN_DIMENSION_RANKS));
+
+		exactDimension = std::min<int>(std::max<unsigned>(numberOfNeighbors, MIN_DIMENSION_RANKS), sample->N);
+		exactIdxs.assign((size_t) queries->N * exactDimension, -1);
+		exactDistances.assign((size_t) queries->N * exactDimension, 0.0f);
+		for (unsigned query = 0; query < results.getQueriesNumber(); ++query) {
+			std::copy_n(results.getIdxs(query), results.getMatchesNumber(query), exactIdxs.begin() + (size_t) query * exactDimension);
+			std::copy_n(results.getDistances(query), results.getMatchesNumber(query), exactDistances.begin() + (size_t) query * exactDimension);
+		}
+	}
+
+	float ParameterTuner::estimateNeighborDistance() {
+		double total = 0.0;
+		int counted = 0;
+		int K = std::min<int>(numberOfNeighbors, exactDimension);
+		std::vector<float> q(sample->d), x(sample->d);
+		for (int query = 0; query < queries->N && K > 0; ++query) {
+			int farthest = exactIdxs[(size_t) query * exactDimension + K - 1];
+			if (farthest < 0) {
+				continue;
+			}
+			queries->copyRows(query, 1, q.data());
+			sample->copyRows(farthest, 1, x.data());
+			double distance = 0.0;
+			for (int j = 0; j < sample->d; ++j) {
+				double diff = x[j] - q[j];
+				distance += diff * diff;
+			}
+			total += std::sqrt(distance);
+			++counted;
+		}
+
+		if (counted == 0 || total == 0.0) {
+			return 1.0f;
+		}
+		return (float) (total / counted);
+	}
+
+	/*
+	 * Maximum likelihood estimate of Levina and Bickel from the distances r_1 <= ... <= r_M to the
+	 * exact neighbors of every query: 1 / D is the mean of log(r_M / r_j), and the estimates of
+	 * the queries are averaged by their inverse.
+	 */
+	float ParameterTuner::estimateIntrinsicDimension() {
+		double totalInverse = 0.0;
+		int counted = 0;
+		for (int query = 0; query < queries->N && exactDimension >= 2; ++query) {
+			const float * distances = exactDistances.data() + (size_t) query * exactDimension;
+			int M = exactDimension;
+			while (M >= 2 && exactIdxs[(size_t) query * exactDimension + M - 1] < 0) {
+				--M;
+			}
+			if (M < 2 || distances[0] <= 0.0f) {
+				continue;
+			}
+			double inverse = 0.0;
+			for (int j = 0; j < M - 1; ++j) {
+				inverse += std::log(distances[M - 1] / distances[j]);
+			}
+			totalInverse += inverse / (M - 1);
+			++counted;
+		}
+
+		if (counted == 0 || totalInverse <= 0.0) {
+			return sample->d;
+		}
+		return std::max(1.0f, std::min((float) (counted / totalInverse), (float) sample->d));
+	}
+
+	/*
+	 * The tables needed for a neighbor at the mean k-th distance r to collide with its query in at
+	 * least one of them with probability targetRecall. A p-stable hash of width w puts them in the
+	 * same bin with p = 1 - 2 Phi(-w / r) - 2 r / (sqrt(2 pi) w) (1 - exp(-w^2 / 2 r^2)), all k
+	 * hashes with p^k and one of L tables with 1 - (1 - p^k)^L.
+	 */
+	int ParameterTuner::predictTables(int k, float w, float neighborDistance, float targetRecall) const {
+		double u = w / neighborDistance;
+		double p = 1.0 - std::erfc(u / std::sqrt(2.0)) - 2.0 / (std::sqrt(2.0 * M_PI) * u) * (1.0 - std::exp(-u * u / 2.0));
+		double tableProbability = std::pow(std::max(p, 0.0), k);
+		double missed = 1.0 - std::min<double>(targetRecall, 0.999);
+		if (tableProbability <= 0.0) {
+			return std::numeric_limits<int>::max();
+		}
+		if (tableProbability >= 1.0) {
+			return 1;
+		}
+		double tables = std::ceil(std::log(missed) / std::log1p(-tableProbability));
+		return (int) std::min<double>(tables, std::numeric_limits<int>::max());
+	}
+
+	/*
+	 * The latency and the memory measured on the sample do not carry over to the whole dataset, so
+	 * the chosen configuration is built once over it to measure them. The recall needs the exact
+	 * neighbors in the whole dataset and stays the one of the sample.
+	 */
+	void ParameterTuner::validate(TuningResult& best) {
+		Index index(best.k, best.L, dataset, best.w);
+		index.buildIndex();
+
+		auto startTime = std::chrono::high_resolution_clock::now();
+		index.query(queries, numberOfNeighbors);
+		auto endTime = std::chrono::high_resolution_clock::now();
+		best.queryMillis = std::chrono::duration<double, std::milli>(endTime - startTime).count() / queries->N;
+		best.indexBytes = index.getMemoryUsage().getTotalBytes();
+		best.isValidated = true;
+	}
+
+	float ParameterTuner::measureRecall(const QueryResult& results, const std::vector<int>& exactIdxs, int exactDimension, unsigned numberOfNeighbors) {
+		unsigned K = std::min<unsigned>(numberOfNeighbors, exactDimension);
+		if (K == 0 || results.getQueriesNumber() == 0) {
+			return 0.0f;
+		}
+
+		double total = 0.0;
+		for (unsigned query = 0; query < results.getQueriesNumber(); ++query) {
+			auto exactBegin = exactIdxs.begin() + (size_t) query * exactDimension;
+			std::unordered_set<int> expected(exactBegin, exactBegin + K);
+			unsigned found = 0;
+			for (unsigned match = 0; match < results.getMatchesNumber(query); ++match) {
+				found += expected.count((int) results.getIdxs(query)[match]);
+			}
+			total += (double) found / K;
+		}
+		return (float) (total / results.getQueriesNumber());
+	}
+
+	void ParameterTuner::releaseSample() {
+		if (sample && sample != dataset) {
+			delete sample;
+		}
+		sample = 0;
+	}
+}
+
+#endif // !__cuANN_ParameterTuner__
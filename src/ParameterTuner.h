@@ -0,0 +1,83 @@
+#ifndef __cuANN_PARAMETERTUNER_H_
+#define __cuANN_PARAMETERTUNER_H_
+
+#include <vector>
+#include <cstddef>
+#include "Dataset.h"
+#include "Index.h"
+
+namespace cuANN {
+	struct TuningResult {
+		int k;
+		int L;
+		float w;
+		float recall;
+		double queryMillis;
+		size_t indexBytes;
+		bool targetReached;
+		// whether the latency and the memory were measured on the whole dataset rather than the sample
+		bool isValidated;
+	};
+
+	/*
+	 * Searches (k, L, w) for the configuration with the lowest query latency
+	 * that reaches a target recall@numberOfNeighbors within a memory budget.
+	 * Without a ground truth the dataset is subsampled and the exact neighbors
+	 * are computed on the sample; the chosen w is then scaled to the denser whole
+	 * dataset, and the configuration built once over it to measure its latency.
+	 * A collision probability model rules out the (k, w) pairs that cannot reach
+	 * the target before any index is built for them.
+	 */
+	class ParameterTuner
+	{
+	public:
+		ParameterTuner(Dataset * data, Dataset * queries, unsigned numberOfNeighbors);
+
+		~ParameterTuner();
+
+		void setGroundTruth(const std::vector<int>& groundtruthIdxs, int dimension);
+
+		void setSampleSize(int sampleSize);
+
+		void setMaxTables(int maxL);
+
+		TuningResult tune(float targetRecall, size_t memoryBudget);
+
+		// mean fraction of the first min(numberOfNeighbors, exactDimension) exact neighbors of each query found in its results
+		static float measureRecall(const QueryResult& results, const std::vector<int>& exactIdxs, int exactDimension, unsigned numberOfNeighbors);
+
+	private:
+		// the intrinsic dimension is estimated from the distances to at least this many exact neighbors
+		static constexpr int MIN_DIMENSION_RANKS = 10;
+		// pairs predicted to need this many times the allowed tables are not built
+		static constexpr int PRUNE_FACTOR = 4;
+
+		Dataset * dataset;
+		Dataset * queries;
+		Dataset * sample;
+		unsigned numberOfNeighbors;
+		int sampleSize;
+		int maxL;
+		bool hasGroundTruth;
+		std::vector<int> exactIdxs;
+		// the exact distances of exactIdxs, only known when computed on the sample
+		std::vector<float> exactDistances;
+		int exactDimension;
+
+		void prepareSample();
+
+		void computeExactNeighbors();
+
+		float estimateNeighborDistance();
+
+		float estimateIntrinsicDimension();
+
+		int predictTables(int k, float w, float neighborDistance, float targetRecall) const;
+
+		void validate(TuningResult& best);
+
+		void releaseSample();
+	};
+}
+
+#endif /* __cuANN_PARAMETERTUNER_H_ */
@@ -0,0 +1,164 @@
+#ifndef __cuANN_PostingListCodec__
+#define __cuANN_PostingListCodec__
+
+#include <algorithm>
+#include <stdexcept>
+#include "PostingListCodec.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace cuANN {
+	constexpr unsigned PostingListCodec::BLOCK_LENGTH;
+	constexpr unsigned PostingListCodec::MIN_COMPRESSED_SIZE;
+
+	void PostingListCodec::encode(const unsigned* ids, unsigned size, std::vector<unsigned>& words) {
+		if (size < MIN_COMPRESSED_SIZE) {
+			words.insert(words.end(), ids, ids + size);
+			return;
+		}
+
+		unsigned gaps[BLOCK_LENGTH];
+		for (unsigned blockStart = 0; blockStart < size; blockStart += BLOCK_LENGTH) {
+			unsigned blockSize = std::min(BLOCK_LENGTH, size - blockStart);
+			const unsigned* block = ids + blockStart;
+
+			unsigned maxGap = 0;
+			for (unsigned i = 1; i < blockSize; ++i) {
+				if (block[i] <= block[i - 1]) {
+					throw std::runtime_error("Posting lists must be strictly increasing");
+				}
+				gaps[i - 1] = block[i] - block[i - 1] - 1;
+				maxGap = std::max(maxGap, gaps[i - 1]);
+			}
+
+			unsigned bits = bitWidth(maxGap);
+			words.push_back(block[0]);
+			words.push_back(bits);
+			pack(gaps, blockSize - 1, bits, words);
+		}
+	}
+
+	const unsigned* PostingListCodec::decode(const unsigned* words, unsigned size, unsigned* ids) {
+		if (size < MIN_COMPRESSED_SIZE) {
+			std::copy_n(words, size, ids);
+			return words + size;
+		}
+
+		for (unsigned blockStart = 0; blockStart < size; blockStart += BLOCK_LENGTH) {
+			unsigned blockSize = std::min(BLOCK_LENGTH, size - blockStart);
+			unsigned* block = ids + blockStart;
+			unsigned base = words[0];
+			unsigned bits = words[1];
+			words += 2;
+
+			block[0] = base;
+			unpack(words, blockSize - 1, bits, block + 1);
+			prefixSum(block + 1, blockSize - 1, base);
+			words += ((unsigned long long) (blockSize - 1) * bits + 31) / 32;
+		}
+		return words;
+	}
+
+	unsigned PostingListCodec::bitWidth(unsigned value) {
+		unsigned bits = 0;
+		while (value) {
+			++bits;
+			value >>= 1;
+		}
+		return bits;
+	}
+
+	void PostingListCodec::pack(const unsigned* values, unsigned size, unsigned bits, std::vector<unsigned>& words) {
+		if (bits == 0) {
+			return;
+		}
+
+		size_t firstWord = words.size();
+		words.resize(firstWord + ((unsigned long long) size * bits + 31) / 32, 0);
+		unsigned* packed = words.data() + firstWord;
+		for (unsigned i = 0; i < size; ++i) {
+			unsigned long long bitPosition = (unsigned long long) i * bits;
+			unsigned word = bitPosition / 32;
+			unsigned offset = bitPosition % 32;
+			packed[word] |= values[i] << offset;
+			if (offset + bits > 32) {
+				packed[word + 1] |= values[i] >> (32 - offset);
+			}
+		}
+	}
+
+	void PostingListCodec::unpack(const unsigned* words, unsigned size, unsigned bits, unsigned* values) {
+		if (bits == 0) {
+			std::fill_n(values, size, 0u);
+			return;
+		}
+
+		unsigned mask = bits == 32 ? ~0u : (1u << bits) - 1;
+		unsigned i = 0;
+#ifdef __AVX2__
+		// eight values at a time, each lane gathering the word its value starts in and the next one when
+		// it spills over; shifts by 32 give 0, so the lanes starting on a word boundary need no care
+		const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i widths = _mm256_set1_epi32(bits);
+		const __m256i thirtyOne = _mm256_set1_epi32(31);
+		const __m256i thirtyTwo = _mm256_set1_epi32(32);
+		const __m256i masks = _mm256_set1_epi32(mask);
+		for (; i + 8 <= size; i += 8) {
+			__m256i positions = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_set1_epi32(i), lanes), widths);
+			__m256i wordIdxs = _mm256_srli_epi32(positions, 5);
+			__m256i offsets = _mm256_and_si256(positions, thirtyOne);
+			__m256i spills = _mm256_cmpgt_epi32(_mm256_add_epi32(offsets, widths), thirtyTwo);
+			__m256i low = _mm256_i32gather_epi32(reinterpret_cast<const int*>(words), wordIdxs, 4);
+			__m256i high = _mm256_mask_i32gather_epi32(
+				_mm256_setzero_si256(), reinterpret_cast<const int*>(words + 1), wordIdxs, spills, 4
+			);
+			__m256i value = _mm256_or_si256(
+				_mm256_srlv_epi32(low, offsets),
+				_mm256_sllv_epi32(high, _mm256_sub_epi32(thirtyTwo, offsets))
+			);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(values + i), _mm256_and_si256(value, masks));
+		}
+#endif
+		for (; i < size; ++i) {
+			unsigned long long bitPosition = (unsigned long long) i * bits;
+			unsigned word = bitPosition / 32;
+			unsigned offset = bitPosition % 32;
+			unsigned value = words[word] >> offset;
+			if (offset + bits > 32) {
+				value |= words[word + 1] << (32 - offset);
+			}
+			values[i] = value & mask;
+		}
+	}
+
+	/*
+	 * Turns the gaps minus one back into ids, four at a time with SSE2 when available.
+	 */
+	void PostingListCodec::prefixSum(unsigned* values, unsigned size, unsigned base) {
+		unsigned i = 0;
+#ifdef __SSE2__
+		const __m128i ones = _mm_set1_epi32(1);
+		__m128i previous = _mm_set1_epi32(base);
+		for (; i + 4 <= size; i += 4) {
+			__m128i gaps = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i)), ones);
+			gaps = _mm_add_epi32(gaps, _mm_slli_si128(gaps, 4));
+			gaps = _mm_add_epi32(gaps, _mm_slli_si128(gaps, 8));
+			gaps = _mm_add_epi32(gaps, previous);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(values + i), gaps);
+			previous = _mm_shuffle_epi32(gaps, _MM_SHUFFLE(3, 3, 3, 3));
+		}
+		if (i > 0) {
+			base = values[i - 1];
+		}
+#endif
+		for (; i < size; ++i) {
+			base += values[i] + 1;
+			values[i] = base;
+		}
+	}
+}
+
+#endif // !__cuANN_PostingListCodec__
@@ -0,0 +1,36 @@
+#ifndef __cuANN_POSTINGLISTCODEC_H_
+#define __cuANN_POSTINGLISTCODEC_H_
+
+#include <vector>
+
+namespace cuANN {
+	/*
+	 * Delta + bit-packing codec for the sorted ids of a bin.
+	 * The ids are split in blocks of BLOCK_LENGTH; every block is stored as its first id,
+	 * the bit width of its largest gap and the gaps minus one packed at that width.
+	 * Lists shorter than MIN_COMPRESSED_SIZE are stored as they are, since the block
+	 * header would outweigh the savings. The decoder needs the list size to be known.
+	 */
+	class PostingListCodec {
+	public:
+		static constexpr unsigned BLOCK_LENGTH = 128;
+		static constexpr unsigned MIN_COMPRESSED_SIZE = 8;
+
+		static void encode(const unsigned* ids, unsigned size, std::vector<unsigned>& words);
+
+		static const unsigned* decode(const unsigned* words, unsigned size, unsigned* ids);
+
+	private:
+		PostingListCodec(){}
+
+		static unsigned bitWidth(unsigned value);
+
+		static void pack(const unsigned* values, unsigned size, unsigned bits, std::vector<unsigned>& words);
+
+		static void unpack(const unsigned* words, unsigned size, unsigned bits, unsigned* values);
+
+		static void prefixSum(unsigned* values, unsigned size, unsigned base);
+	};
+}
+
+#endif /* __cuANN_POSTINGLISTCODEC_H_ */
@@ -0,0 +1,231 @@
+#ifndef __cuANN_PrecisionConverter__
+#define __cuANN_PrecisionConverter__
+
+#include <cstring>
+#include <stdexcept>
+#include "PrecisionConverter.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CUANN_X86_DISPATCH
+#if __GNUC__ >= 10 && !defined(__clang__)
+#define CUANN_AVX512BF16_DISPATCH
+#endif
+#endif
+
+namespace cuANN {
+#ifdef CUANN_X86_DISPATCH
+	/*
+	 * The vector loops are compiled for their instruction sets whatever the target of the build and
+	 * only called when the CPU running it has them. Each returns how many values it converted,
+	 * the scalar code finishes the rest.
+	 */
+	__attribute__((target("avx,f16c")))
+	static size_t floatToHalfF16C(const float* source, size_t size, uint16_t* destination) {
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			__m128i halves = _mm256_cvtps_ph(_mm256_loadu_ps(source + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), halves);
+		}
+		return i;
+	}
+
+	__attribute__((target("avx,f16c")))
+	static size_t halfToFloatF16C(const uint16_t* source, size_t size, float* destination) {
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			__m128i halves = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+			_mm256_storeu_ps(destination + i, _mm256_cvtph_ps(halves));
+		}
+		return i;
+	}
+
+	// a bfloat16 is the upper half of the fp32 with the same value
+	__attribute__((target("avx2")))
+	static size_t bfloat16ToFloatAVX2(const uint16_t* source, size_t size, float* destination) {
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			__m256i words = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i)));
+			_mm256_storeu_ps(destination + i, _mm256_castsi256_ps(_mm256_slli_epi32(words, 16)));
+		}
+		return i;
+	}
+
+#ifdef CUANN_AVX512BF16_DISPATCH
+	// the instruction flushes subnormals to zero, which the scalar tail does not
+	__attribute__((target("avx512f,avx512bf16")))
+	static size_t floatToBfloat16AVX512(const float* source, size_t size, uint16_t* destination) {
+		size_t i = 0;
+		for (; i + 16 <= size; i += 16) {
+			__m256bh bfloats = _mm512_cvtneps_pbh(_mm512_loadu_ps(source + i));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), (__m256i) bfloats);
+		}
+		return i;
+	}
+#endif
+#endif
+
+	void PrecisionConverter::fromFloat(const float* source, size_t size, Precision precision, uint16_t* destination) {
+		size_t i = 0;
+		if (precision == FLOAT16) {
+#ifdef CUANN_X86_DISPATCH
+			if (__builtin_cpu_supports("f16c")) {
+				i = floatToHalfF16C(source, size, destination);
+			}
+#endif
+			for (; i < size; ++i) {
+				destination[i] = floatToHalf(source[i]);
+			}
+		} else if (precision == BFLOAT16) {
+#ifdef CUANN_AVX512BF16_DISPATCH
+			if (__builtin_cpu_supports("avx512bf16")) {
+				i = floatToBfloat16AVX512(source, size, destination);
+			}
+#endif
+			for (; i < size; ++i) {
+				destination[i] = floatToBfloat16(source[i]);
+			}
+		} else {
+			throw std::runtime_error("Only the 16 bit formats are converted");
+		}
+	}
+
+	void PrecisionConverter::toFloat(const uint16_t* source, size_t size, Precision precision, float* destination) {
+		size_t i = 0;
+		if (precision == FLOAT16) {
+#ifdef CUANN_X86_DISPATCH
+			if (__builtin_cpu_supports("f16c")) {
+				i = halfToFloatF16C(source, size, destination);
+			}
+#endif
+			for (; i < size; ++i) {
+				destination[i] = halfToFloat(source[i]);
+			}
+		} else if (precision == BFLOAT16) {
+#ifdef CUANN_X86_DISPATCH
+			if (__builtin_cpu_supports("avx2")) {
+				i = bfloat16ToFloatAVX2(source, size, destination);
+			}
+#endif
+			for (; i < size; ++i) {
+				destination[i] = bfloat16ToFloat(source[i]);
+			}
+		} else {
+			throw std::runtime_error("Only the 16 bit formats are converted");
+		}
+	}
+
+	size_t PrecisionConverter::getElementSize(Precision precision) {
+		return precision == FLOAT32 ? sizeof(float) : sizeof(uint16_t);
+	}
+
+	Precision PrecisionConverter::parse(const std::string& name) {
+		if (name == "fp32") {
+			return FLOAT32;
+		}
+		if (name == "fp16") {
+			return FLOAT16;
+		}
+		if (name == "bf16") {
+			return BFLOAT16;
+		}
+		throw std::runtime_error("Unknown precision " + name + ", expected fp32, fp16 or bf16");
+	}
+
+	const char* PrecisionConverter::getName(Precision precision) {
+		switch (precision) {
+		case FLOAT16:
+			return "fp16";
+		case BFLOAT16:
+			return "bf16";
+		default:
+			return "fp32";
+		}
+	}
+
+	uint16_t PrecisionConverter::floatToHalf(float value) {
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		uint16_t sign = (bits >> 16) & 0x8000;
+		uint32_t exponent = (bits >> 23) & 0xff;
+		uint32_t mantissa = bits & 0x7fffff;
+
+		if (exponent == 0xff) {
+			// infinities stay infinities, NaNs stay quiet NaNs
+			return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+		}
+
+		int halfExponent = (int) exponent - 127 + 15;
+		if (halfExponent >= 0x1f) {
+			return sign | 0x7c00;
+		}
+		if (halfExponent <= 0) {
+			if (halfExponent < -10) {
+				return sign;
+			}
+			// subnormal: the implicit bit becomes explicit and is shifted into place
+			mantissa |= 0x800000;
+			int shift = 14 - halfExponent;
+			uint32_t halfMantissa = mantissa >> shift;
+			uint32_t remainder = mantissa & ((1u << shift) - 1);
+			uint32_t halfway = 1u << (shift - 1);
+			if (remainder > halfway || (remainder == halfway && (halfMantissa & 1))) {
+				++halfMantissa;
+			}
+			return sign | halfMantissa;
+		}
+
+		uint32_t half = ((uint32_t) halfExponent << 10) | (mantissa >> 13);
+		uint32_t remainder = mantissa & 0x1fff;
+		if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+			// a carry into the exponent is still the right result, up to infinity
+			++half;
+		}
+		return sign | half;
+	}
+
+	float PrecisionConverter::halfToFloat(uint16_t value) {
+		uint32_t sign = (uint32_t) (value & 0x8000) << 16;
+		uint32_t exponent = (value >> 10) & 0x1f;
+		uint32_t mantissa = value & 0x3ff;
+		uint32_t bits;
+
+		if (exponent == 0x1f) {
+			bits = sign | 0x7f800000 | (mantissa << 13);
+		} else if (exponent != 0) {
+			bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+		} else if (mantissa == 0) {
+			bits = sign;
+		} else {
+			// subnormal half, normal as a float
+			exponent = 127 - 15 + 1;
+			while (!(mantissa & 0x400)) {
+				mantissa <<= 1;
+				--exponent;
+			}
+			bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+
+		float result;
+		std::memcpy(&result, &bits, sizeof(result));
+		return result;
+	}
+
+	uint16_t PrecisionConverter::floatToBfloat16(float value) {
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		if ((bits & 0x7fffffff) > 0x7f800000) {
+			return (bits >> 16) | 0x40;
+		}
+		bits += 0x7fff + ((bits >> 16) & 1);
+		return bits >> 16;
+	}
+
+	float PrecisionConverter::bfloat16ToFloat(uint16_t value) {
+		uint32_t bits = (uint32_t) value << 16;
+		float result;
+		std::memcpy(&result, &bits, sizeof(result));
+		return result;
+	}
+}
+
+#endif // !__cuANN_PrecisionConverter__
@@ -0,0 +1,42 @@
+#ifndef __cuANN_PRECISIONCONVERTER_H_
+#define __cuANN_PRECISIONCONVERTER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace cuANN {
+	// how the rows of the dataset are stored on the device, arithmetic is always done in fp32
+	enum Precision { FLOAT32, FLOAT16, BFLOAT16 };
+
+	/*
+	 * Host conversions between fp32 and the 16 bit formats, rounding to nearest even.
+	 * F16C, AVX2 and AVX-512 BF16 are used when the CPU has them, whatever the build targets.
+	 */
+	class PrecisionConverter
+	{
+	public:
+		static void fromFloat(const float* source, size_t size, Precision precision, uint16_t* destination);
+
+		static void toFloat(const uint16_t* source, size_t size, Precision precision, float* destination);
+
+		static size_t getElementSize(Precision precision);
+
+		static Precision parse(const std::string& name);
+
+		static const char* getName(Precision precision);
+
+	private:
+		PrecisionConverter() {}
+
+		static uint16_t floatToHalf(float value);
+
+		static float halfToFloat(uint16_t value);
+
+		static uint16_t floatToBfloat16(float value);
+
+		static float bfloat16ToFloat(uint16_t value);
+	};
+}
+
+#endif /* __cuANN_PRECISIONCONVERTER_H_ */
@@ -2,39 +2,23 @@
 #define __cuANN_QUERYBINCALCULATOR_H_
 
 #include "commons.h"
+#include "ExecutionContext.h"
 
 namespace cuANN {
 
 class QueryBinCalculator {
 public:
-	static ThrustIntV getBinsForQueryHashes(
-		const ThrustSizetV& dProjectedQueries, int Q,
-		int binsNumber, const size_t* binCodes
+	/*
+	 * Writes in binIdxs the index of the bin whose code equals each query hash, -1 if there is none.
+	 * binCodes must be sorted, as calcBins leaves them.
+	 */
+	static void getBinsForQueryHashes(
+		const size_t* dQueryHashes, int Q,
+		int binsNumber, const size_t* dBinCodes,
+		int* dBinIdxs, ExecutionContext& context
 	);
 private:
 	QueryBinCalculator(){}
-
-	static ThrustSizetV concatenateBinCodesAndQueryHashes(
-		const ThrustSizetV& dProjectedQueries, int Q,
-		int binsNumber, const ThrustSizetV& dBinCodes
-	);
-
-	static ThrustUnsignedV sortHashes(ThrustSizetV& hashes, unsigned size);
-
-	static ThrustIntV calcBinIdxs(
-			const ThrustUnsignedV& permutationIdxsVec,
-			const ThrustSizetV& queryHahes,
-			const ThrustSizetV& dBinCodes,
-			int Q, int binsNumber
-	);
-
-	static ThrustIntV calcIdxsCandidates(const ThrustUnsignedV& permutationIdxsVec, int binsNumber, int Q);
-
-	static bool isAQueryIdx(const int idx, const thrust::host_vector<unsigned>& concatenatedPermutationIdxs, const int binsNumber);
-
-	static int getQueryIdx(int idx, const thrust::host_vector<unsigned>& concatenatedPermutationIdxs, const int binsNumber);
-
-	static bool idxIsNotAboutQuery(const int binIdx, const int binsNumber);
 };
 
 } /* namespace cuANN */
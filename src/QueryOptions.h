@@ -0,0 +1,48 @@
+#ifndef __cuANN_QUERYOPTIONS_H_
+#define __cuANN_QUERYOPTIONS_H_
+
+#include "Bitmap.h"
+
+namespace cuANN {
+	/*
+	 * Per query batch choices of the Index.
+	 */
+	struct QueryOptions {
+		static constexpr unsigned AUTO_CANDIDATE_BUDGET = ~0u;
+
+		// only the vectors in the bitmap may be returned, by their original ids; none to allow them all
+		const Bitmap * filter;
+
+		// filters matching at most this fraction of the dataset are searched exhaustively,
+		// the buckets would hold too few of their vectors to keep the recall up
+		float bruteForceSelectivity;
+
+		// only the candidates found in at least this many tables are reranked
+		unsigned minCollisions;
+
+		// at most this many candidates per query are reranked, the ones found in the most tables; 0 for all
+		unsigned maxRerankCandidates;
+
+		// bins looked up per table and query, the closest ones first; more than one only for cross-polytope
+		// tables that do not share their functions
+		int probes;
+
+		// a query stops probing tables once it has this many candidates, 0 for no limit as by default,
+		// AUTO_CANDIDATE_BUDGET for 3*L*K as in E2LSH
+		unsigned candidateBudget;
+
+		// a query stops probing tables once its kth neighbor is at most this far, 0 to never stop early
+		float stopDistance;
+
+		// how many tables are probed between two reranks when probing is bounded
+		int tablesPerRound;
+
+		// range queries stop looking for matches of a query once they have this many, 0 for no limit
+		unsigned maxMatches;
+
+		QueryOptions() : filter(0), bruteForceSelectivity(0.01f), minCollisions(1), maxRerankCandidates(0), probes(1),
+			candidateBudget(0), stopDistance(0.0f), tablesPerRound(4), maxMatches(0) {}
+	};
+}
+
+#endif /* __cuANN_QUERYOPTIONS_H_ */
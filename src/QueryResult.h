@@ -1,15 +1,56 @@
 #ifndef __cuANN_QUERYRESULT_H__
 #define __cuANN_QUERYRESULT_H__
 
+#include <algorithm>
+#include <vector>
+
 namespace cuANN {
+	/*
+	 * The results of all the queries of a batch in compressed sparse rows: those of query q are
+	 * idxs and distances from offsets[q] to offsets[q + 1]. The rows of a k-NN query are sorted by
+	 * distance, the ones of a range query or of a join are in no particular order.
+	 * The buffers are sized once per batch and only ever moved, never copied.
+	 */
 	struct QueryResult {
-		unsigned queryIdx;
-		std::vector<unsigned> resultIdx;
-		unsigned resultSize;
+		std::vector<unsigned> offsets;
+		std::vector<unsigned> idxs;
+		std::vector<float> distances;
+
+		QueryResult() {}
+
+		QueryResult(const QueryResult &) = delete;
+
+		QueryResult& operator=(const QueryResult &) = delete;
+
+		QueryResult(QueryResult &&) = default;
+
+		QueryResult& operator=(QueryResult &&) = default;
+
+		unsigned getQueriesNumber() const {
+			return offsets.empty() ? 0 : offsets.size() - 1;
+		}
+
+		unsigned getMatchesNumber(unsigned query) const {
+			return offsets[query + 1] - offsets[query];
+		}
+
+		const unsigned* getIdxs(unsigned query) const {
+			return idxs.data() + offsets[query];
+		}
+
+		const float* getDistances(unsigned query) const {
+			return distances.data() + offsets[query];
+		}
 
-		QueryResult(unsigned idx, std::vector<unsigned>&& result, unsigned numbersOfNeighbors) :
-			queryIdx(idx), resultIdx(std::move(result)), resultSize(numbersOfNeighbors)
-		{}
+		// the first maxMatches matches of a query as a result of its own
+		QueryResult getRow(unsigned query, unsigned maxMatches) const {
+			unsigned size = std::min(getMatchesNumber(query), maxMatches);
+			QueryResult row;
+			row.offsets = { 0, size };
+			row.idxs.assign(getIdxs(query), getIdxs(query) + size);
+			row.distances.assign(getDistances(query), getDistances(query) + size);
+			return row;
+		}
 	};
 }
 
@@ -0,0 +1,189 @@
+#ifndef __cuANN_QueryServer__
+#define __cuANN_QueryServer__
+
+#include <algorithm>
+#include <stdexcept>
+#include "QueryServer.h"
+
+namespace cuANN {
+	QueryServer::QueryServer(const Index* index, int dimension, int workersNumber, unsigned maxBatchSize, std::chrono::microseconds maxDelay)
+		: current(new Version { index, std::function<void()>() }), epoch(1), workerEpochs(new std::atomic<unsigned long long>[workersNumber]), isDraining(false) {
+		this->dimension = dimension;
+		this->maxBatchSize = std::max(1u, maxBatchSize);
+		this->maxDelay = maxDelay;
+		this->isStopping = false;
+		this->workersNumber = workersNumber;
+
+		for (int i = 0; i < workersNumber; ++i) {
+			workerEpochs[i] = 0;
+		}
+		for (int i = 0; i < workersNumber; ++i) {
+			workers.emplace_back(&QueryServer::workerLoop, this, i);
+		}
+	}
+
+	QueryServer::~QueryServer() {
+		stop();
+		releaseVersion(current.load());
+	}
+
+	std::future<QueryResult> QueryServer::submit(const float* query, unsigned numberOfNeighbors) {
+		Request request;
+		request.numberOfNeighbors = numberOfNeighbors;
+		request.query.assign(query, query + dimension);
+		request.arrival = std::chrono::steady_clock::now();
+		auto result = request.result.get_future();
+
+		{
+			std::lock_guard<std::mutex> lock(pendingMutex);
+			if (isStopping) {
+				throw std::runtime_error("The query server is stopped");
+			}
+			pending.push_back(std::move(request));
+		}
+		pendingChanged.notify_one();
+
+		return result;
+	}
+
+	/*
+	 * Pending requests are still answered before the workers exit.
+	 */
+	void QueryServer::stop() {
+		{
+			std::lock_guard<std::mutex> lock(pendingMutex);
+			isStopping = true;
+		}
+		pendingChanged.notify_all();
+
+		for (auto& worker : workers) {
+			if (worker.joinable()) {
+				worker.join();
+			}
+		}
+		workers.clear();
+	}
+
+	/*
+	 * A worker that read the old index announced an epoch read before the swap advanced it, so the
+	 * old index is drained once every worker is between batches or announces a later epoch.
+	 */
+	void QueryServer::swapIndex(const Index* index, std::function<void()> release) {
+		std::lock_guard<std::mutex> swapLock(swapMutex);
+		Version * previous = current.exchange(new Version { index, std::move(release) });
+		unsigned long long retiredEpoch = epoch.fetch_add(1);
+
+		{
+			std::unique_lock<std::mutex> lock(drainMutex);
+			isDraining = true;
+			drained.wait(lock, [&] { return isDrained(retiredEpoch); });
+			isDraining = false;
+		}
+		releaseVersion(previous);
+	}
+
+	void QueryServer::workerLoop(int worker) {
+		ExecutionContext context;
+		std::vector<Request> batch;
+
+		while (takeBatch(batch)) {
+			// announced before the index is read, so a swap waits for the batch to finish on it
+			workerEpochs[worker] = epoch.load();
+			runBatch(batch, current.load()->index, context);
+			workerEpochs[worker] = 0;
+			// the lock is only taken while a swap waits
+			if (isDraining) {
+				std::lock_guard<std::mutex> lock(drainMutex);
+				drained.notify_all();
+			}
+			batch.clear();
+		}
+	}
+
+	bool QueryServer::takeBatch(std::vector<Request>& batch) {
+		std::unique_lock<std::mutex> lock(pendingMutex);
+		do {
+			pendingChanged.wait(lock, [this] { return isStopping || !pending.empty(); });
+			if (pending.empty()) {
+				return false;
+			}
+
+			// give concurrent clients until the deadline of the oldest request to fill the batch,
+			// another worker may take the whole queue in the meantime
+			auto deadline = pending.front().arrival + maxDelay;
+			pendingChanged.wait_until(lock, deadline, [this] { return isStopping || pending.size() >= maxBatchSize; });
+		} while (pending.empty());
+
+		unsigned batchSize = std::min<size_t>(maxBatchSize, pending.size());
+		for (unsigned i = 0; i < batchSize; ++i) {
+			batch.push_back(std::move(pending.front()));
+			pending.pop_front();
+		}
+
+		// another worker can start on what is left right away
+		if (!pending.empty()) {
+			pendingChanged.notify_one();
+		}
+		return true;
+	}
+
+	void QueryServer::runBatch(std::vector<Request>& batch, const Index* index, ExecutionContext& context) {
+		unsigned Q = batch.size();
+		unsigned numberOfNeighbors = 0;
+		float * queries = (float *)HostAllocator::allocate((size_t) Q * dimension * sizeof(float));
+		if (!queries)
+		{
+			auto error = std::make_exception_ptr(std::runtime_error("Cannot allocate the query batch"));
+			for (auto& request : batch) {
+				request.result.set_exception(error);
+			}
+			return;
+		}
+		for (unsigned i = 0; i < Q; ++i) {
+			std::copy(batch[i].query.begin(), batch[i].query.end(), queries + (size_t) i * dimension);
+			numberOfNeighbors = std::max(numberOfNeighbors, batch[i].numberOfNeighbors);
+		}
+		Dataset batchDataset(queries, Q, dimension, dimension);
+
+		try
+		{
+			auto results = index->query(&batchDataset, numberOfNeighbors, context);
+			for (unsigned i = 0; i < Q; ++i) {
+				batch[i].result.set_value(results.getRow(i, batch[i].numberOfNeighbors));
+			}
+		}
+		catch (...)
+		{
+			auto error = std::current_exception();
+			for (auto& request : batch) {
+				try
+				{
+					request.result.set_exception(error);
+				}
+				catch (const std::future_error&)
+				{
+					// already answered before the failure
+				}
+			}
+		}
+	}
+
+	bool QueryServer::isDrained(unsigned long long retiredEpoch) const {
+		for (int worker = 0; worker < workersNumber; ++worker) {
+			unsigned long long workerEpoch = workerEpochs[worker];
+			if (workerEpoch != 0 && workerEpoch <= retiredEpoch) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void QueryServer::releaseVersion(Version* version) {
+		if (version->release) {
+			version->release();
+		}
+		delete version;
+	}
+}
+
+#endif // !__cuANN_QueryServer__
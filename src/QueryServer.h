@@ -0,0 +1,91 @@
+#ifndef __cuANN_QUERYSERVER_H_
+#define __cuANN_QUERYSERVER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Index.h"
+#include "QueryResult.h"
+
+namespace cuANN {
+	/*
+	 * In-process query server over a built Index.
+	 * Clients submit single queries from any thread; worker threads coalesce the pending
+	 * ones into batches of up to maxBatchSize, waiting at most maxDelay after the oldest
+	 * arrival, and run each batch through Index::query with their own ExecutionContext.
+	 * The index can be swapped while serving. Reclamation is epoch based: a worker announces the
+	 * epoch before taking the current index for a batch, and a swap advances the epoch and waits
+	 * until no worker still announces the old one, so the batches never wait for a swap.
+	 */
+	class QueryServer
+	{
+	public:
+		QueryServer(const Index* index, int dimension, int workersNumber, unsigned maxBatchSize, std::chrono::microseconds maxDelay);
+
+		QueryServer(const QueryServer &) = delete;
+
+		~QueryServer();
+
+		// the query is copied, the returned result holds its row alone
+		std::future<QueryResult> submit(const float* query, unsigned numberOfNeighbors);
+
+		void stop();
+
+		// serves index from now on: the batches already running finish on the previous index,
+		// released once they have, on the calling thread. The first index is never released.
+		void swapIndex(const Index* index, std::function<void()> release = std::function<void()>());
+
+	private:
+		struct Request {
+			unsigned numberOfNeighbors;
+			std::vector<float> query;
+			std::promise<QueryResult> result;
+			std::chrono::steady_clock::time_point arrival;
+		};
+
+		// an index and how to free it
+		struct Version {
+			const Index* index;
+			std::function<void()> release;
+		};
+
+		int dimension;
+		unsigned maxBatchSize;
+		std::chrono::microseconds maxDelay;
+
+		std::mutex pendingMutex;
+		std::condition_variable pendingChanged;
+		std::deque<Request> pending;
+		bool isStopping;
+		std::vector<std::thread> workers;
+
+		std::atomic<Version*> current;
+		std::atomic<unsigned long long> epoch;
+		// the epoch every worker announced for its running batch, 0 between batches
+		std::unique_ptr<std::atomic<unsigned long long>[]> workerEpochs;
+		int workersNumber;
+		std::mutex swapMutex;
+		std::mutex drainMutex;
+		std::condition_variable drained;
+		std::atomic<bool> isDraining;
+
+		void workerLoop(int worker);
+
+		bool takeBatch(std::vector<Request>& batch);
+
+		void runBatch(std::vector<Request>& batch, const Index* index, ExecutionContext& context);
+
+		bool isDrained(unsigned long long retiredEpoch) const;
+
+		static void releaseVersion(Version* version);
+	};
+}
+
+#endif /* __cuANN_QUERYSERVER_H_ */
@@ -0,0 +1,211 @@
+#ifndef __cuANN_QueryStream__
+#define __cuANN_QueryStream__
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include "QueryStream.h"
+
+namespace cuANN {
+	constexpr unsigned QueryStream::READ_AHEAD;
+	constexpr int QueryStream::STEP_SIZE;
+
+	QueryStream::QueryStream(const std::string& fileName, const std::string& extension, unsigned batchSize, long long maxQueries) {
+		input = std::make_shared<Input>();
+		std::string format = extension.empty() ? fileName.substr(fileName.find_last_of('.') + 1) : extension;
+		if (!VectorFileReader::parseFormat(format, input->layout, input->type)) {
+			throw std::runtime_error("Unknown query format " + format + ", expected one of the vector file extensions");
+		}
+		input->componentSize = input->type == VectorFileReader::ComponentType::UINT8 ? 1 : 4;
+		input->dimension = 0;
+		input->batchSize = std::max(1u, batchSize);
+		input->remaining = maxQueries > 0 ? maxQueries : -1;
+		input->hasPrefix = false;
+		input->isDone = false;
+		input->isStopping = false;
+
+		input->in = &std::cin;
+		if (fileName != "-") {
+			input->file.open(fileName, std::ios::in | std::ios::binary);
+			if (input->file.fail())
+			{
+				throw std::runtime_error("The file " + fileName + " cannot be opened");
+			}
+			input->in = &input->file;
+		}
+		input->readHeader();
+
+		reader = std::thread(&Input::readerLoop, input);
+	}
+
+	QueryStream::~QueryStream() {
+		{
+			std::lock_guard<std::mutex> lock(input->readyMutex);
+			input->isStopping = true;
+		}
+		input->readyChanged.notify_all();
+		if (!reader.joinable()) {
+			return;
+		}
+		if (input->in == &std::cin) {
+			reader.detach();
+		} else {
+			reader.join();
+		}
+	}
+
+	std::unique_ptr<Dataset> QueryStream::next() {
+		std::unique_lock<std::mutex> lock(input->readyMutex);
+		input->readyChanged.wait(lock, [this] { return input->isDone || !input->ready.empty(); });
+		if (!input->ready.empty()) {
+			std::unique_ptr<Dataset> batch = std::move(input->ready.front());
+			input->ready.pop_front();
+			input->readyChanged.notify_all();
+			return batch;
+		}
+		if (input->error) {
+			std::rethrow_exception(input->error);
+		}
+		return std::unique_ptr<Dataset>();
+	}
+
+	/*
+	 * Only the .bin files have a header: the number of vectors and their dimension.
+	 */
+	void QueryStream::Input::readHeader() {
+		if (layout != VectorFileReader::Layout::BIN) {
+			return;
+		}
+
+		int header[2] = { 0, 0 };
+		in->read(reinterpret_cast<char*>(header), 2 * STEP_SIZE);
+		if (!*in || header[1] <= 0) {
+			throw std::runtime_error("The queries have an invalid header");
+		}
+		long long vectorsNumber = (unsigned) header[0];
+		remaining = remaining < 0 ? vectorsNumber : std::min(remaining, vectorsNumber);
+		dimension = header[1];
+	}
+
+	/*
+	 * Reads the dimension prefix of the next .vecs row, whose end is the only sign of the end of the input.
+	 */
+	bool QueryStream::Input::hasNextRow() {
+		if (remaining == 0) {
+			return false;
+		}
+		if (layout == VectorFileReader::Layout::BIN || hasPrefix) {
+			return true;
+		}
+
+		int rowDimension;
+		in->read(reinterpret_cast<char*>(&rowDimension), STEP_SIZE);
+		if (in->gcount() == 0 && in->eof()) {
+			return false;
+		}
+		if (!*in) {
+			throw std::runtime_error("The queries end in the middle of a vector");
+		}
+		if (rowDimension <= 0 || (dimension && rowDimension != dimension)) {
+			throw std::runtime_error("The queries do not share the same dimension");
+		}
+		dimension = rowDimension;
+		hasPrefix = true;
+		return true;
+	}
+
+	Dataset* QueryStream::Input::readBatch() {
+		if (!hasNextRow()) {
+			return 0;
+		}
+
+		// uint8 queries stay bytes, as the dataset ones do, the others become floats
+		bool isBytes = type == VectorFileReader::ComponentType::UINT8;
+		size_t outputSize = isBytes ? sizeof(uint8_t) : sizeof(float);
+		row.resize((size_t) dimension * componentSize);
+		int ld = HostAllocator::getPaddedDimension(dimension);
+		char * vectors = (char *)HostAllocator::allocate((size_t) batchSize * ld * outputSize);
+		if (!vectors)
+		{
+			throw std::runtime_error("Cannot allocate memory for a batch of queries");
+		}
+
+		unsigned rows = 0;
+		try
+		{
+			do {
+				in->read(row.data(), row.size());
+				if (!*in) {
+					throw std::runtime_error("The queries end in the middle of a vector");
+				}
+				char * vector = vectors + (size_t) rows * ld * outputSize;
+				convertRow(vector);
+				std::memset(vector + dimension * outputSize, 0, (ld - dimension) * outputSize);
+				hasPrefix = false;
+				if (remaining > 0) {
+					--remaining;
+				}
+			} while (++rows < batchSize && hasNextRow());
+		}
+		catch (const std::exception&)
+		{
+			HostAllocator::release(vectors);
+			throw;
+		}
+
+		if (isBytes) {
+			return new Dataset((uint8_t *) vectors, rows, dimension, ld);
+		}
+		return new Dataset((float *) vectors, rows, dimension, ld);
+	}
+
+	// floats and uint8 components are copied as they are, ints converted to floats
+	void QueryStream::Input::convertRow(char* vector) const {
+		const char * components = row.data();
+		if (type != VectorFileReader::ComponentType::INT32) {
+			std::memcpy(vector, components, row.size());
+			return;
+		}
+		for (int i = 0; i < dimension; ++i) {
+			int component;
+			std::memcpy(&component, components + i * STEP_SIZE, STEP_SIZE);
+			float value = (float) component;
+			std::memcpy(vector + i * sizeof(float), &value, sizeof(float));
+		}
+	}
+
+	void QueryStream::Input::readerLoop() {
+		try
+		{
+			while (true) {
+				{
+					std::unique_lock<std::mutex> lock(readyMutex);
+					readyChanged.wait(lock, [this] { return isStopping || ready.size() < READ_AHEAD; });
+					if (isStopping) {
+						return;
+					}
+				}
+
+				std::unique_ptr<Dataset> batch(readBatch());
+				std::lock_guard<std::mutex> lock(readyMutex);
+				if (!batch) {
+					isDone = true;
+					readyChanged.notify_all();
+					return;
+				}
+				ready.push_back(std::move(batch));
+				readyChanged.notify_all();
+			}
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(readyMutex);
+			error = std::current_exception();
+			isDone = true;
+			readyChanged.notify_all();
+		}
+	}
+}
+
+#endif // !__cuANN_QueryStream__
@@ -0,0 +1,83 @@
+#ifndef __cuANN_QUERYSTREAM_H_
+#define __cuANN_QUERYSTREAM_H_
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Dataset.h"
+#include "VectorFileReader.h"
+
+namespace cuANN {
+	/*
+	 * Queries read front to back from a vector file or from stdin, batchSize at a time, by a thread
+	 * reading at most READ_AHEAD batches ahead of the caller. Nothing needs seeking: the rows of the
+	 * .vecs files carry their dimension and the header of the .bin ones comes first, so at most
+	 * READ_AHEAD + 1 batches are ever in memory however many queries there are.
+	 */
+	class QueryStream
+	{
+	public:
+		// "-" reads stdin, in the format named by extension (fvecs, bvecs, fbin, u8bin...); a file is
+		// read in the format of its own extension unless one is given. At most maxQueries are read,
+		// 0 for all of them.
+		QueryStream(const std::string& fileName, const std::string& extension, unsigned batchSize, long long maxQueries = 0);
+
+		QueryStream(const QueryStream &) = delete;
+
+		// waits for the read in progress of a file, if any, before returning; a read of stdin may block
+		// until more input comes, so the reader is left to finish it on its own
+		~QueryStream();
+
+		// the next batch in the order of the input, null once it is exhausted; rethrows a failed read
+		std::unique_ptr<Dataset> next();
+
+	private:
+		static constexpr unsigned READ_AHEAD = 2;
+		static constexpr int STEP_SIZE = 4;
+
+		// what the reader works on, shared with it so that it outlives the stream when left behind
+		struct Input {
+			std::ifstream file;
+			std::istream * in;
+			VectorFileReader::Layout layout;
+			VectorFileReader::ComponentType type;
+			int componentSize;
+			int dimension;
+			unsigned batchSize;
+			// queries left to read, negative when unbounded
+			long long remaining;
+			// whether the dimension prefix of the next .vecs row was already read
+			bool hasPrefix;
+			std::vector<char> row;
+
+			std::mutex readyMutex;
+			std::condition_variable readyChanged;
+			std::deque<std::unique_ptr<Dataset>> ready;
+			bool isDone;
+			bool isStopping;
+			std::exception_ptr error;
+
+			void readHeader();
+
+			bool hasNextRow();
+
+			Dataset* readBatch();
+
+			void convertRow(char* vector) const;
+
+			void readerLoop();
+		};
+
+		std::shared_ptr<Input> input;
+		std::thread reader;
+	};
+}
+
+#endif /* __cuANN_QUERYSTREAM_H_ */
@@ -0,0 +1,158 @@
+#ifndef __cuANN_ResultSink__
+#define __cuANN_ResultSink__
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include "ResultSink.h"
+
+namespace cuANN {
+	constexpr size_t BufferedResultSink::FLUSH_SIZE;
+
+	ResultFormat ResultSink::parseFormat(const std::string& name) {
+		if (name == "text") {
+			return TEXT;
+		}
+		if (name == "jsonl") {
+			return JSON_LINES;
+		}
+		if (name == "vecs") {
+			return VECS;
+		}
+		throw std::runtime_error("Unknown result format " + name + ", expected text, jsonl or vecs");
+	}
+
+	BufferedResultSink::BufferedResultSink(const std::string& fileName) {
+		out = &std::cout;
+		if (!fileName.empty() && fileName != "-") {
+			file.open(fileName, std::ios::out | std::ios::trunc);
+			if (file.fail())
+			{
+				throw std::runtime_error("The file " + fileName + " cannot be opened");
+			}
+			out = &file;
+		}
+		buffer.reserve(FLUSH_SIZE + FLUSH_SIZE / 4);
+	}
+
+	void BufferedResultSink::close() {
+		flush();
+		out->flush();
+		if (!*out)
+		{
+			throw std::runtime_error("Couldn't write the results");
+		}
+	}
+
+	void BufferedResultSink::append(const char* text) {
+		buffer += text;
+	}
+
+	void BufferedResultSink::appendFormatted(const char* format, ...) {
+		char text[64];
+		va_list arguments;
+		va_start(arguments, format);
+		int length = vsnprintf(text, sizeof(text), format, arguments);
+		va_end(arguments);
+		buffer.append(text, std::min<size_t>(length, sizeof(text) - 1));
+	}
+
+	void BufferedResultSink::flushIfFull() {
+		if (buffer.size() >= FLUSH_SIZE) {
+			flush();
+		}
+	}
+
+	void BufferedResultSink::flush() {
+		out->write(buffer.data(), buffer.size());
+		buffer.clear();
+	}
+
+	TextResultSink::TextResultSink(const std::string& fileName, const std::vector<int>& groundtruthIdxs, int groundtruthDimension)
+		: BufferedResultSink(fileName), groundtruthIdxs(groundtruthIdxs), groundtruthDimension(groundtruthDimension) {
+	}
+
+	void TextResultSink::write(unsigned firstQuery, const QueryResult& results) {
+		for (unsigned row = 0; row < results.getQueriesNumber(); ++row) {
+			unsigned query = firstQuery + row;
+			bool hasGroundTruth = groundtruthDimension > 0 && (size_t) (query + 1) * groundtruthDimension <= groundtruthIdxs.size();
+			appendFormatted("Query idx: %u, %u results\n", query, results.getMatchesNumber(row));
+			append(hasGroundTruth ? "Result idx    Distance   Groundtruth\n" : "Result idx    Distance\n");
+			for (unsigned i = 0; i < results.getMatchesNumber(row); ++i) {
+				appendFormatted("%10u%12g", results.getIdxs(row)[i], results.getDistances(row)[i]);
+				if (hasGroundTruth && (int) i < groundtruthDimension) {
+					appendFormatted("%14d", groundtruthIdxs[(size_t) query * groundtruthDimension + i]);
+				}
+				append("\n");
+			}
+			append("==========================\n");
+			flushIfFull();
+		}
+	}
+
+	JsonLinesResultSink::JsonLinesResultSink(const std::string& fileName) : BufferedResultSink(fileName) {
+	}
+
+	void JsonLinesResultSink::write(unsigned firstQuery, const QueryResult& results) {
+		for (unsigned row = 0; row < results.getQueriesNumber(); ++row) {
+			appendFormatted("{\"query\":%u,\"ids\":[", firstQuery + row);
+			for (unsigned i = 0; i < results.getMatchesNumber(row); ++i) {
+				appendFormatted(i ? ",%u" : "%u", results.getIdxs(row)[i]);
+			}
+			append("],\"distances\":[");
+			// distances are finite, so every one of them is a valid JSON number
+			for (unsigned i = 0; i < results.getMatchesNumber(row); ++i) {
+				appendFormatted(i ? ",%.9g" : "%.9g", results.getDistances(row)[i]);
+			}
+			append("]}\n");
+			flushIfFull();
+		}
+	}
+
+	/*
+	 * A name ending in .ivecs or .fvecs gives the other file its other extension.
+	 */
+	VecsResultSink::VecsResultSink(const std::string& fileName) {
+		std::string baseName = fileName;
+		for (const char* extension : { ".ivecs", ".fvecs" }) {
+			std::string suffix(extension);
+			if (baseName.size() > suffix.size() && baseName.compare(baseName.size() - suffix.size(), suffix.size(), suffix) == 0) {
+				baseName.resize(baseName.size() - suffix.size());
+				break;
+			}
+		}
+		openFile(idsFile, baseName + ".ivecs");
+		openFile(distancesFile, baseName + ".fvecs");
+	}
+
+	void VecsResultSink::write(unsigned /*firstQuery*/, const QueryResult& results) {
+		for (unsigned row = 0; row < results.getQueriesNumber(); ++row) {
+			int dimension = results.getMatchesNumber(row);
+			idsFile.write(reinterpret_cast<const char*>(&dimension), sizeof(int));
+			idsFile.write(reinterpret_cast<const char*>(results.getIdxs(row)), dimension * sizeof(unsigned));
+			distancesFile.write(reinterpret_cast<const char*>(&dimension), sizeof(int));
+			distancesFile.write(reinterpret_cast<const char*>(results.getDistances(row)), dimension * sizeof(float));
+		}
+	}
+
+	void VecsResultSink::close() {
+		idsFile.flush();
+		distancesFile.flush();
+		if (!idsFile || !distancesFile)
+		{
+			throw std::runtime_error("Couldn't write the results");
+		}
+	}
+
+	void VecsResultSink::openFile(std::ofstream& file, const std::string& fileName) {
+		file.open(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (file.fail())
+		{
+			throw std::runtime_error("The file " + fileName + " cannot be opened");
+		}
+	}
+}
+
+#endif // !__cuANN_ResultSink__
@@ -0,0 +1,103 @@
+#ifndef __cuANN_RESULTSINK_H_
+#define __cuANN_RESULTSINK_H_
+
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "QueryResult.h"
+
+namespace cuANN {
+	enum ResultFormat { TEXT, JSON_LINES, VECS };
+
+	/*
+	 * Destination of the results of consecutive query batches, written in the order they are given.
+	 */
+	class ResultSink
+	{
+	public:
+		virtual ~ResultSink() {}
+
+		// the rows of results are the queries from firstQuery on
+		virtual void write(unsigned firstQuery, const QueryResult& results) = 0;
+
+		// writes out what is still buffered, throws if any write failed
+		virtual void close() = 0;
+
+		static ResultFormat parseFormat(const std::string& name);
+	};
+
+	/*
+	 * Text sinks format into a buffer written out FLUSH_SIZE bytes at a time, to a file or to stdout
+	 * when the file name is empty or "-".
+	 */
+	class BufferedResultSink : public ResultSink
+	{
+	public:
+		void close() override;
+
+	protected:
+		explicit BufferedResultSink(const std::string& fileName);
+
+		void append(const char* text);
+
+		void appendFormatted(const char* format, ...);
+
+		void flushIfFull();
+
+	private:
+		static constexpr size_t FLUSH_SIZE = 1 << 20;
+
+		std::ofstream file;
+		std::ostream * out;
+		std::string buffer;
+
+		void flush();
+	};
+
+	/*
+	 * The ids and distances of every query in columns, next to the ground truth when there is one.
+	 */
+	class TextResultSink : public BufferedResultSink
+	{
+	public:
+		TextResultSink(const std::string& fileName, const std::vector<int>& groundtruthIdxs, int groundtruthDimension);
+
+		void write(unsigned firstQuery, const QueryResult& results) override;
+
+	private:
+		const std::vector<int>& groundtruthIdxs;
+		int groundtruthDimension;
+	};
+
+	// one JSON object per query and per line: {"query":q,"ids":[...],"distances":[...]}
+	class JsonLinesResultSink : public BufferedResultSink
+	{
+	public:
+		explicit JsonLinesResultSink(const std::string& fileName);
+
+		void write(unsigned firstQuery, const QueryResult& results) override;
+	};
+
+	/*
+	 * The ids of every query as a .ivecs vector and their distances as a .fvecs one, in two files
+	 * named after fileName with these extensions. Rows may differ in length, as range results do.
+	 */
+	class VecsResultSink : public ResultSink
+	{
+	public:
+		explicit VecsResultSink(const std::string& fileName);
+
+		void write(unsigned firstQuery, const QueryResult& results) override;
+
+		void close() override;
+
+	private:
+		std::ofstream idsFile;
+		std::ofstream distancesFile;
+
+		static void openFile(std::ofstream& file, const std::string& fileName);
+	};
+}
+
+#endif /* __cuANN_RESULTSINK_H_ */
@@ -0,0 +1,101 @@
+#ifndef __cuANN_ResultWriter__
+#define __cuANN_ResultWriter__
+
+#include <algorithm>
+#include "ResultWriter.h"
+
+namespace cuANN {
+	ResultWriter::ResultWriter(std::unique_ptr<ResultSink> sink, size_t maxPending) : sink(std::move(sink)) {
+		this->maxPending = std::max<size_t>(1, maxPending);
+		this->nextQuery = 0;
+		this->isFinishing = false;
+
+		writer = std::thread(&ResultWriter::writerLoop, this);
+	}
+
+	ResultWriter::~ResultWriter() {
+		try
+		{
+			finish();
+		}
+		catch (...)
+		{
+		}
+	}
+
+	/*
+	 * A failed write is reported to the next submission, the batches after it are dropped.
+	 */
+	void ResultWriter::submit(QueryResult&& results) {
+		std::unique_lock<std::mutex> lock(pendingMutex);
+		pendingChanged.wait(lock, [this] { return error || pending.size() < maxPending; });
+		if (error) {
+			std::rethrow_exception(error);
+		}
+
+		unsigned firstQuery = nextQuery;
+		nextQuery += results.getQueriesNumber();
+		pending.push_back(Batch { firstQuery, std::move(results) });
+		pendingChanged.notify_all();
+	}
+
+	void ResultWriter::finish() {
+		{
+			std::lock_guard<std::mutex> lock(pendingMutex);
+			isFinishing = true;
+		}
+		pendingChanged.notify_all();
+		if (writer.joinable()) {
+			writer.join();
+		}
+
+		std::lock_guard<std::mutex> lock(pendingMutex);
+		if (error) {
+			std::exception_ptr failure = error;
+			error = nullptr;
+			std::rethrow_exception(failure);
+		}
+	}
+
+	void ResultWriter::writerLoop() {
+		while (true) {
+			Batch batch;
+			{
+				std::unique_lock<std::mutex> lock(pendingMutex);
+				pendingChanged.wait(lock, [this] { return isFinishing || !pending.empty(); });
+				if (pending.empty()) {
+					break;
+				}
+				batch = std::move(pending.front());
+				pending.pop_front();
+			}
+			// a submitter may be waiting for room
+			pendingChanged.notify_all();
+
+			try
+			{
+				sink->write(batch.firstQuery, batch.results);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(pendingMutex);
+				error = std::current_exception();
+				pending.clear();
+				pendingChanged.notify_all();
+				return;
+			}
+		}
+
+		try
+		{
+			sink->close();
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(pendingMutex);
+			error = std::current_exception();
+		}
+	}
+}
+
+#endif // !__cuANN_ResultWriter__
@@ -0,0 +1,56 @@
+#ifndef __cuANN_RESULTWRITER_H_
+#define __cuANN_RESULTWRITER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "QueryResult.h"
+#include "ResultSink.h"
+
+namespace cuANN {
+	/*
+	 * Writes the results of query batches to a sink from a thread of its own, in the order they are
+	 * submitted, so the output of a batch overlaps the search of the next ones. At most maxPending
+	 * batches wait to be written, submitting another one blocks until the oldest is out.
+	 */
+	class ResultWriter
+	{
+	public:
+		ResultWriter(std::unique_ptr<ResultSink> sink, size_t maxPending = 4);
+
+		ResultWriter(const ResultWriter &) = delete;
+
+		// finishes the pending writes, the errors are only reported by finish
+		~ResultWriter();
+
+		// the rows of results are the queries following those of the previous batch
+		void submit(QueryResult&& results);
+
+		// waits for the pending batches, closes the sink and rethrows the first failed write
+		void finish();
+
+	private:
+		struct Batch {
+			unsigned firstQuery;
+			QueryResult results;
+		};
+
+		std::unique_ptr<ResultSink> sink;
+		size_t maxPending;
+		unsigned nextQuery;
+
+		std::mutex pendingMutex;
+		std::condition_variable pendingChanged;
+		std::deque<Batch> pending;
+		bool isFinishing;
+		std::exception_ptr error;
+		std::thread writer;
+
+		void writerLoop();
+	};
+}
+
+#endif /* __cuANN_RESULTWRITER_H_ */
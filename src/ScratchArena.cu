@@ -0,0 +1,97 @@
+#ifndef __cuANN_ScratchArena__
+#define __cuANN_ScratchArena__
+
+#include <stdexcept>
+#include <cuda_runtime.h>
+#include "ScratchArena.h"
+
+namespace cuANN {
+	constexpr int ScratchArena::MIN_SIZE_CLASS;
+	constexpr int ScratchArena::SIZE_CLASSES;
+
+	ScratchArena::ScratchArena(Kind kind) : freeBlocks(SIZE_CLASSES) {
+		this->kind = kind;
+		this->cachedBytes = 0;
+		this->allocationsNumber = 0;
+	}
+
+	ScratchArena::~ScratchArena() {
+		release();
+	}
+
+	char* ScratchArena::allocate(std::ptrdiff_t bytes) {
+		int sizeClass = getSizeClass(bytes);
+		auto& blocks = freeBlocks[sizeClass];
+		if (!blocks.empty()) {
+			char * block = blocks.back();
+			blocks.pop_back();
+			cachedBytes -= (size_t) 1 << sizeClass;
+			return block;
+		}
+
+		return allocateBlock((size_t) 1 << sizeClass);
+	}
+
+	/*
+	 * The block is only cached: work already queued on the stream of the owner
+	 * still runs before whatever the next user of the block queues after it.
+	 */
+	void ScratchArena::deallocate(char* block, size_t bytes) {
+		int sizeClass = getSizeClass(bytes);
+		freeBlocks[sizeClass].push_back(block);
+		cachedBytes += (size_t) 1 << sizeClass;
+	}
+
+	void ScratchArena::release() {
+		for (auto& blocks : freeBlocks) {
+			for (char * block : blocks) {
+				freeBlock(block);
+			}
+			blocks.clear();
+		}
+		cachedBytes = 0;
+	}
+
+	size_t ScratchArena::getCachedBytes() const {
+		return cachedBytes;
+	}
+
+	unsigned long long ScratchArena::getAllocationsNumber() const {
+		return allocationsNumber;
+	}
+
+	int ScratchArena::getSizeClass(size_t bytes) {
+		int sizeClass = MIN_SIZE_CLASS;
+		while (((size_t) 1 << sizeClass) < bytes) {
+			++sizeClass;
+		}
+		return sizeClass;
+	}
+
+	char* ScratchArena::allocateBlock(size_t bytes) {
+		void * block = 0;
+		cudaError_t status = kind == DEVICE ? cudaMalloc(&block, bytes) : cudaMallocHost(&block, bytes);
+		if (status != cudaSuccess) {
+			// the cached blocks of the other classes may be enough to make room
+			cudaGetLastError();
+			release();
+			status = kind == DEVICE ? cudaMalloc(&block, bytes) : cudaMallocHost(&block, bytes);
+			if (status != cudaSuccess) {
+				throw std::runtime_error("Cannot allocate scratch memory");
+			}
+		}
+
+		++allocationsNumber;
+		return (char *) block;
+	}
+
+	void ScratchArena::freeBlock(char* block) {
+		if (kind == DEVICE) {
+			cudaFree(block);
+		} else {
+			cudaFreeHost(block);
+		}
+	}
+}
+
+#endif // !__cuANN_ScratchArena__
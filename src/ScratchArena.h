@@ -0,0 +1,106 @@
+#ifndef __cuANN_SCRATCHARENA_H_
+#define __cuANN_SCRATCHARENA_H_
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace cuANN {
+	/*
+	 * Caching allocator for short-lived buffers, either on the device or in pinned host memory.
+	 * Requests are rounded up to a power of two and released blocks are kept in a free list
+	 * per size class, so once the largest request has been seen no more memory is allocated.
+	 * Its interface is the one thrust expects from a temporary storage allocator.
+	 * An arena must never be used by two threads at once.
+	 */
+	class ScratchArena
+	{
+	public:
+		enum Kind { DEVICE, PINNED_HOST };
+
+		typedef char value_type;
+
+		explicit ScratchArena(Kind kind);
+
+		ScratchArena(const ScratchArena &) = delete;
+
+		~ScratchArena();
+
+		char* allocate(std::ptrdiff_t bytes);
+
+		void deallocate(char* block, size_t bytes);
+
+		// returns the cached blocks to the system, the ones still in use are not affected
+		void release();
+
+		size_t getCachedBytes() const;
+
+		unsigned long long getAllocationsNumber() const;
+
+	private:
+		static constexpr int MIN_SIZE_CLASS = 8;
+		static constexpr int SIZE_CLASSES = 64;
+
+		Kind kind;
+		std::vector<std::vector<char*>> freeBlocks;
+		size_t cachedBytes;
+		unsigned long long allocationsNumber;
+
+		static int getSizeClass(size_t bytes);
+
+		char* allocateBlock(size_t bytes);
+
+		void freeBlock(char* block);
+	};
+
+	/*
+	 * Typed block borrowed from an arena and given back when it goes out of scope.
+	 */
+	template<typename T>
+	class ScratchBuffer
+	{
+	public:
+		ScratchBuffer(ScratchArena& arena, size_t size)
+			: arena(&arena), length(size),
+			  buffer(size ? (T *) arena.allocate(size * sizeof(T)) : 0) {
+		}
+
+		ScratchBuffer(const ScratchBuffer &) = delete;
+
+		~ScratchBuffer() {
+			if (buffer)
+			{
+				arena->deallocate((char *) buffer, length * sizeof(T));
+			}
+		}
+
+		T* data() const {
+			return buffer;
+		}
+
+		T* begin() const {
+			return buffer;
+		}
+
+		T* end() const {
+			return buffer + length;
+		}
+
+		size_t size() const {
+			return length;
+		}
+
+		void swap(ScratchBuffer& other) {
+			std::swap(arena, other.arena);
+			std::swap(length, other.length);
+			std::swap(buffer, other.buffer);
+		}
+
+	private:
+		ScratchArena * arena;
+		size_t length;
+		T * buffer;
+	};
+}
+
+#endif /* __cuANN_SCRATCHARENA_H_ */
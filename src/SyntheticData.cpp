@@ -0,0 +1,98 @@
+#ifndef __cuANN_SyntheticData__
+#define __cuANN_SyntheticData__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+#include "SyntheticData.h"
+
+namespace cuANN {
+	/*
+	 * With a mixture, every vector is a center drawn uniformly in [-1, 1)^d plus Gaussian noise of
+	 * standard deviation spread, the clusters taking the same share of the vectors on average.
+	 */
+	Dataset* SyntheticData::generateVectors(Distribution distribution, int N, int d, int clusters, float spread, unsigned long long seed) {
+		std::mt19937_64 generator(seed);
+		std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+		// packed rows, as the benchmark uploads them whole
+		float * vectors = (float *) HostAllocator::allocate((size_t) N * d * sizeof(float));
+		if (!vectors) {
+			throw std::runtime_error("Cannot allocate the synthetic vectors");
+		}
+
+		if (distribution == UNIFORM) {
+			for (size_t i = 0; i < (size_t) N * d; ++i) {
+				vectors[i] = uniform(generator);
+			}
+			return new Dataset(vectors, N, d, d);
+		}
+
+		clusters = std::max(1, clusters);
+		std::vector<float> centers((size_t) clusters * d);
+		for (auto& coordinate : centers) {
+			coordinate = uniform(generator);
+		}
+		std::uniform_int_distribution<int> pickCluster(0, clusters - 1);
+		std::normal_distribution<float> noise(0.0f, spread);
+		for (int row = 0; row < N; ++row) {
+			const float * center = centers.data() + (size_t) pickCluster(generator) * d;
+			for (int col = 0; col < d; ++col) {
+				vectors[(size_t) row * d + col] = center[col] + noise(generator);
+			}
+		}
+		return new Dataset(vectors, N, d, d);
+	}
+
+	/*
+	 * Bucket b is picked with a probability proportional to 1 / (b + 1)^exponent and stands for a
+	 * random 64 bit code, so the codes are not ordered by the size of their bucket.
+	 */
+	std::vector<size_t> SyntheticData::generateSkewedHashes(int N, int bins, float exponent, unsigned long long seed) {
+		std::mt19937_64 generator(seed);
+		bins = std::max(1, bins);
+		std::vector<size_t> codes(bins);
+		for (auto& code : codes) {
+			code = generator();
+		}
+
+		std::vector<double> weights(bins);
+		for (int bin = 0; bin < bins; ++bin) {
+			weights[bin] = 1.0 / std::pow(bin + 1.0, exponent);
+		}
+		std::discrete_distribution<int> pickBin(weights.begin(), weights.end());
+
+		std::vector<size_t> hashes(N);
+		for (auto& hash : hashes) {
+			hash = codes[pickBin(generator)];
+		}
+		return hashes;
+	}
+
+	std::vector<unsigned> SyntheticData::generateIdxs(int rows, int size, int N, unsigned long long seed) {
+		std::mt19937_64 generator(seed);
+		std::uniform_int_distribution<unsigned> pickIdx(0, N - 1);
+		std::vector<unsigned> idxs((size_t) rows * size);
+		for (int row = 0; row < rows; ++row) {
+			auto rowBegin = idxs.begin() + (size_t) row * size;
+			for (auto it = rowBegin; it != rowBegin + size; ++it) {
+				*it = pickIdx(generator);
+			}
+			std::sort(rowBegin, rowBegin + size);
+		}
+		return idxs;
+	}
+
+	Distribution SyntheticData::parse(const std::string& name) {
+		if (name == "uniform") {
+			return UNIFORM;
+		}
+		if (name == "gaussian") {
+			return GAUSSIAN_MIXTURE;
+		}
+		throw std::runtime_error("Unknown distribution " + name + ", expected uniform or gaussian");
+	}
+}
+
+#endif // !__cuANN_SyntheticData__
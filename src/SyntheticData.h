@@ -0,0 +1,35 @@
+#ifndef __cuANN_SYNTHETICDATA_H_
+#define __cuANN_SYNTHETICDATA_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "Dataset.h"
+
+namespace cuANN {
+	// how the synthetic vectors are spread: uniformly in [-1, 1)^d or in Gaussian clusters
+	enum Distribution { UNIFORM, GAUSSIAN_MIXTURE };
+
+	/*
+	 * Reproducible inputs for the benchmarks, drawn on the host from a seed.
+	 */
+	class SyntheticData
+	{
+	public:
+		static Dataset* generateVectors(Distribution distribution, int N, int d, int clusters, float spread, unsigned long long seed);
+
+		// N bucket codes over bins buckets whose sizes follow a Zipf law of the given exponent,
+		// 0 for buckets of the same expected size
+		static std::vector<size_t> generateSkewedHashes(int N, int bins, float exponent, unsigned long long seed);
+
+		// size ids in [0, N) for each of the rows, in increasing order within a row
+		static std::vector<unsigned> generateIdxs(int rows, int size, int N, unsigned long long seed);
+
+		static Distribution parse(const std::string& name);
+
+	private:
+		SyntheticData() {}
+	};
+}
+
+#endif /* __cuANN_SYNTHETICDATA_H_ */
@@ -0,0 +1,152 @@
+#ifndef __cuANN_TaskScheduler__
+#define __cuANN_TaskScheduler__
+
+#include <algorithm>
+#include "TaskScheduler.h"
+
+namespace cuANN {
+	thread_local TaskScheduler* TaskScheduler::currentScheduler = 0;
+	thread_local int TaskScheduler::currentWorkerIdx = -1;
+
+	TaskScheduler::TaskScheduler(int workersNumber) {
+		workersNumber = std::max(1, workersNumber);
+		this->queuedTasks = 0;
+		this->unfinishedTasks = 0;
+		this->sleepingWorkers = 0;
+		this->nextQueue = 0;
+		this->isStopping = false;
+
+		for (int i = 0; i < workersNumber; ++i) {
+			queues.emplace_back(new WorkerQueue());
+		}
+		for (int i = 0; i < workersNumber; ++i) {
+			workers.emplace_back(&TaskScheduler::workerLoop, this, i);
+		}
+	}
+
+	TaskScheduler::~TaskScheduler() {
+		{
+			std::lock_guard<std::mutex> lock(stateMutex);
+			isStopping = true;
+		}
+		taskAvailable.notify_all();
+
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+
+	int TaskScheduler::getWorkersNumber() const {
+		return workers.size();
+	}
+
+	/*
+	 * The task is counted as unfinished before it can be popped, so wait never sees zero while it
+	 * is pending. A worker going to sleep counts itself before checking the queued tasks, and this
+	 * counts the task before checking the sleepers: one of the two always sees the other.
+	 */
+	void TaskScheduler::submit(std::function<void()> task) {
+		int queueIdx = currentScheduler == this ? currentWorkerIdx : nextQueue++ % queues.size();
+		++unfinishedTasks;
+		{
+			std::lock_guard<std::mutex> queueLock(queues[queueIdx]->mutex);
+			queues[queueIdx]->tasks.push_back(std::move(task));
+		}
+		++queuedTasks;
+
+		if (sleepingWorkers > 0) {
+			std::lock_guard<std::mutex> lock(stateMutex);
+			taskAvailable.notify_one();
+		}
+	}
+
+	void TaskScheduler::wait() {
+		std::unique_lock<std::mutex> lock(stateMutex);
+		allDone.wait(lock, [this] { return unfinishedTasks == 0; });
+
+		if (firstError) {
+			std::exception_ptr error = firstError;
+			firstError = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+
+	int TaskScheduler::getWorkerIdx() {
+		return currentWorkerIdx;
+	}
+
+	void TaskScheduler::workerLoop(int workerIdx) {
+		currentScheduler = this;
+		currentWorkerIdx = workerIdx;
+
+		std::function<void()> task;
+		while (true) {
+			if (popLocal(workerIdx, task) || steal(workerIdx, task)) {
+				runTask(task);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(stateMutex);
+			++sleepingWorkers;
+			taskAvailable.wait(lock, [this] { return isStopping || queuedTasks > 0; });
+			--sleepingWorkers;
+			if (isStopping && queuedTasks <= 0) {
+				return;
+			}
+		}
+	}
+
+	bool TaskScheduler::popLocal(int workerIdx, std::function<void()>& task) {
+		std::lock_guard<std::mutex> lock(queues[workerIdx]->mutex);
+		auto& tasks = queues[workerIdx]->tasks;
+		if (tasks.empty()) {
+			return false;
+		}
+		task = std::move(tasks.back());
+		tasks.pop_back();
+		return true;
+	}
+
+	bool TaskScheduler::steal(int workerIdx, std::function<void()>& task) {
+		int queuesNumber = queues.size();
+		for (int i = 1; i < queuesNumber; ++i) {
+			auto& victim = *queues[(workerIdx + i) % queuesNumber];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tasks.empty()) {
+				task = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void TaskScheduler::runTask(std::function<void()>& task) {
+		// may briefly go below zero when the task is popped before its submitter counted it
+		--queuedTasks;
+
+		std::exception_ptr error;
+		try
+		{
+			task();
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+		task = nullptr;
+
+		if (error) {
+			std::lock_guard<std::mutex> lock(stateMutex);
+			if (!firstError) {
+				firstError = error;
+			}
+		}
+		if (--unfinishedTasks == 0) {
+			std::lock_guard<std::mutex> lock(stateMutex);
+			allDone.notify_all();
+		}
+	}
+}
+
+#endif // !__cuANN_TaskScheduler__
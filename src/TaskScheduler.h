@@ -0,0 +1,75 @@
+#ifndef __cuANN_TASKSCHEDULER_H_
+#define __cuANN_TASKSCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cuANN {
+	/*
+	 * Work-stealing thread pool.
+	 * Every worker owns a deque: tasks submitted from a worker go to the back of its own
+	 * deque and are popped from there, idle workers steal from the front of the others.
+	 * Tasks submitted from outside the pool are spread round-robin.
+	 * The task counts are atomic, the state lock is only taken to sleep, to wake a sleeping
+	 * worker or the waiter, and to record an error.
+	 */
+	class TaskScheduler
+	{
+	public:
+		explicit TaskScheduler(int workersNumber);
+
+		TaskScheduler(const TaskScheduler &) = delete;
+
+		~TaskScheduler();
+
+		int getWorkersNumber() const;
+
+		void submit(std::function<void()> task);
+
+		// blocks until every submitted task, and every task they submitted, has run;
+		// rethrows the first exception a task threw. Must not be called from a worker.
+		void wait();
+
+		// index of the worker running the caller, -1 outside of any pool
+		static int getWorkerIdx();
+
+	private:
+		struct WorkerQueue {
+			std::mutex mutex;
+			std::deque<std::function<void()>> tasks;
+		};
+
+		std::vector<std::unique_ptr<WorkerQueue>> queues;
+		std::vector<std::thread> workers;
+
+		std::mutex stateMutex;
+		std::condition_variable taskAvailable;
+		std::condition_variable allDone;
+		std::atomic<long long> queuedTasks;
+		std::atomic<long long> unfinishedTasks;
+		std::atomic<int> sleepingWorkers;
+		std::atomic<unsigned> nextQueue;
+		bool isStopping;
+		std::exception_ptr firstError;
+
+		static thread_local TaskScheduler* currentScheduler;
+		static thread_local int currentWorkerIdx;
+
+		void workerLoop(int workerIdx);
+
+		bool popLocal(int workerIdx, std::function<void()>& task);
+
+		bool steal(int workerIdx, std::function<void()>& task);
+
+		void runTask(std::function<void()>& task);
+	};
+}
+
+#endif /* __cuANN_TASKSCHEDULER_H_ */
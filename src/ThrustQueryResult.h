@@ -4,7 +4,15 @@
 #include "commons.h"
 
 namespace cuANN {
-
+	class HashTable;
+
+	/*
+	 * The candidates of a batch of queries on the host, those of query q from resultStartingIdxs[q]
+	 * for resultSizes[q]. Filled in place by the tables and the merge, whose contexts keep them
+	 * across batches, and only ever moved.
+	 * The results of a table leave resultSet empty: they keep the binsPerQuery bins of every query
+	 * in resultBins, -1 when missed, and table->copyQueryIdxs decodes them where the caller needs.
+	 */
 	struct ThrustQueryResult {
 		unsigned Q;
 		unsigned resultSetSize;
@@ -13,26 +21,20 @@ namespace cuANN {
 		ThrustHUnsignedV resultSizes;
 		ThrustHUnsignedV resultSet;
 
-		ThrustQueryResult(
-			const ThrustHUnsignedV& resultStartingIdxs,
-			const ThrustHUnsignedV& resultSizes,
-			const ThrustHUnsignedV& resultSet,
-			unsigned Q, unsigned resultSetSize
-		);
-	};
+		const HashTable* table;
+		int binsPerQuery;
+		ThrustHIntV resultBins;
+
+		ThrustQueryResult() : Q(0), resultSetSize(0), table(0), binsPerQuery(0) {}
+
+		ThrustQueryResult(const ThrustQueryResult &) = delete;
 
-	inline ThrustQueryResult::ThrustQueryResult(
-		const ThrustHUnsignedV& resultStartingIdxs,
-		const ThrustHUnsignedV& resultSizes,
-		const ThrustHUnsignedV& resultSet,
-		unsigned Q, unsigned resultSetSize
-	) {
-		this->Q = Q;
-		this->resultSetSize = resultSetSize;
-		this->resultSizes = resultSizes;
-		this->resultSet = resultSet;
-		this->resultStartingIdxs = resultStartingIdxs;
-	}
+		ThrustQueryResult& operator=(const ThrustQueryResult &) = delete;
+
+		ThrustQueryResult(ThrustQueryResult &&) = default;
+
+		ThrustQueryResult& operator=(ThrustQueryResult &&) = default;
+	};
 
 }  // namespace cuANN
 
@@ -0,0 +1,231 @@
+#ifndef __cuANN_VectorFileReader__
+#define __cuANN_VectorFileReader__
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "VectorFileReader.h"
+
+namespace cuANN {
+	constexpr int VectorFileReader::STEP_SIZE;
+	constexpr long long VectorFileReader::CHUNK_SIZE;
+
+	VectorFileReader::VectorFileReader(std::string fileName, Layout layout, ComponentType type) {
+		this->fileName = fileName;
+		this->layout = layout;
+		this->type = type;
+		this->componentSize = type == ComponentType::UINT8 ? 1 : 4;
+
+		vectorsFile.open(fileName, std::ios::in | std::ios::binary);
+		if (vectorsFile.fail())
+		{
+			throw std::runtime_error("The file " + fileName + " cannot be opened");
+		}
+		readHeader();
+	}
+
+	VectorFileReader::~VectorFileReader() {
+		vectorsFile.close();
+	}
+
+	VectorFileReader* VectorFileReader::open(std::string fileName) {
+		Layout layout;
+		ComponentType type;
+		if (!parseFormat(fileName.substr(fileName.find_last_of('.') + 1), layout, type)) {
+			throw std::runtime_error("Unknown vector file format: " + fileName);
+		}
+		return new VectorFileReader(fileName, layout, type);
+	}
+
+	bool VectorFileReader::parseFormat(const std::string& extension, Layout& layout, ComponentType& type) {
+		if (extension == "fvecs") { layout = Layout::VECS; type = ComponentType::FLOAT32; return true; }
+		if (extension == "ivecs") { layout = Layout::VECS; type = ComponentType::INT32; return true; }
+		if (extension == "bvecs") { layout = Layout::VECS; type = ComponentType::UINT8; return true; }
+		if (extension == "fbin") { layout = Layout::BIN; type = ComponentType::FLOAT32; return true; }
+		if (extension == "ibin") { layout = Layout::BIN; type = ComponentType::INT32; return true; }
+		if (extension == "u8bin") { layout = Layout::BIN; type = ComponentType::UINT8; return true; }
+		return false;
+	}
+
+	long long VectorFileReader::getVectorsNumber() const {
+		return vectorsNumber;
+	}
+
+	int VectorFileReader::getDimension() const {
+		return vectorDimension;
+	}
+
+	void VectorFileReader::readRange(long long start, long long howMany, float* vectors) {
+		readConverted(start, howMany, vectors);
+	}
+
+	void VectorFileReader::readRange(long long start, long long howMany, int* vectors) {
+		// ids and counts are integers: a float file would be silently truncated
+		if (type == ComponentType::FLOAT32) {
+			throw std::runtime_error("The file " + fileName + " does not hold integer vectors");
+		}
+		readConverted(start, howMany, vectors);
+	}
+
+	Dataset* VectorFileReader::readAllVectors() {
+		return readVectors(0, vectorsNumber);
+	}
+
+	Dataset* VectorFileReader::readVectors(long long howMany) {
+		return readVectors(0, howMany);
+	}
+
+	/*
+	 * uint8 files stay bytes, the others become floats.
+	 */
+	Dataset* VectorFileReader::readVectors(long long start, long long howMany) {
+		int ld = HostAllocator::getPaddedDimension(vectorDimension);
+		if (type == ComponentType::UINT8) {
+			return new Dataset(readPadded<uint8_t>(start, howMany, ld), howMany, vectorDimension, ld);
+		}
+		return new Dataset(readPadded<float>(start, howMany, ld), howMany, vectorDimension, ld);
+	}
+
+	/*
+	 * The rows are read packed, then moved to their padded place from the last one down, so no row
+	 * is overwritten before it is moved. Stored in row-major order, every row starting on a cache line
+	 * when the components are floats.
+	 */
+	template<typename T>
+	T* VectorFileReader::readPadded(long long start, long long howMany, int ld) {
+		T * vectors = (T *)HostAllocator::allocate(howMany * ld * sizeof(T));
+		if (!vectors)
+		{
+			throw std::runtime_error("Cannot allocate memory for the vectors of " + fileName);
+		}
+		try
+		{
+			readConverted(start, howMany, vectors);
+		}
+		catch (const std::exception&)
+		{
+			HostAllocator::release(vectors);
+			throw;
+		}
+
+		if (ld != vectorDimension) {
+			for (long long row = howMany - 1; row >= 0; --row) {
+				T * padded = vectors + row * ld;
+				std::memmove(padded, vectors + row * vectorDimension, vectorDimension * sizeof(T));
+				std::fill(padded + vectorDimension, padded + ld, T());
+			}
+		}
+		return vectors;
+	}
+
+	std::vector<int> VectorFileReader::readAllIdxs() {
+		return readIdxs(vectorsNumber);
+	}
+
+	std::vector<int> VectorFileReader::readIdxs(long long howMany) {
+		std::vector<int> idxs(howMany * vectorDimension);
+		readRange(0, howMany, idxs.data());
+		return idxs;
+	}
+
+	void VectorFileReader::readHeader() {
+		long long fileSize = getFileSize();
+		int header[2] = { 0, 0 };
+
+		if (layout == Layout::VECS) {
+			vectorsFile.read(reinterpret_cast<char*>(header), STEP_SIZE);
+			vectorDimension = header[0];
+			dataOffset = 0;
+			rowSize = STEP_SIZE + (long long) vectorDimension * componentSize;
+			vectorsNumber = fileSize / rowSize;
+		} else {
+			vectorsFile.read(reinterpret_cast<char*>(header), 2 * STEP_SIZE);
+			vectorsNumber = (unsigned) header[0];
+			vectorDimension = header[1];
+			dataOffset = 2 * STEP_SIZE;
+			rowSize = (long long) vectorDimension * componentSize;
+			if (dataOffset + vectorsNumber * rowSize > fileSize) {
+				throw std::runtime_error("The file " + fileName + " is shorter than its header states");
+			}
+		}
+
+		if (!vectorsFile || vectorDimension <= 0) {
+			throw std::runtime_error("The file " + fileName + " has an invalid header");
+		}
+	}
+
+	template<typename T>
+	void VectorFileReader::readConverted(long long start, long long howMany, T* vectors) {
+		if (start < 0 || howMany < 0 || start + howMany > vectorsNumber) {
+			throw std::runtime_error("Couldn't read the required number of vectors");
+		}
+
+		// a single seek for the whole range, then sequential reads of bounded chunks
+		long long rowsPerChunk = std::max(1LL, CHUNK_SIZE / rowSize);
+		chunk.resize(std::min(rowsPerChunk, std::max(howMany, 1LL)) * rowSize);
+		vectorsFile.clear();
+		vectorsFile.seekg(dataOffset + start * rowSize, std::ios::beg);
+
+		for (long long row = 0; row < howMany; row += rowsPerChunk) {
+			long long rows = std::min(rowsPerChunk, howMany - row);
+			vectorsFile.read(chunk.data(), rows * rowSize);
+			if (!vectorsFile) {
+				throw std::runtime_error("Couldn't read the required number of vectors");
+			}
+			for (long long i = 0; i < rows; ++i) {
+				convertRow(chunk.data() + i * rowSize, vectors + (row + i) * vectorDimension);
+			}
+		}
+	}
+
+	template<typename T>
+	void VectorFileReader::convertRow(const char* row, T* vector) const {
+		if (layout == Layout::VECS) {
+			int dimension;
+			std::memcpy(&dimension, row, STEP_SIZE);
+			if (dimension != vectorDimension) {
+				throw std::runtime_error("The vectors of " + fileName + " do not share the same dimension");
+			}
+			row += STEP_SIZE;
+		}
+
+		switch (type) {
+			case ComponentType::FLOAT32:
+				for (int i = 0; i < vectorDimension; ++i) {
+					float component;
+					std::memcpy(&component, row + i * STEP_SIZE, STEP_SIZE);
+					vector[i] = static_cast<T>(component);
+				}
+				break;
+			case ComponentType::INT32:
+				for (int i = 0; i < vectorDimension; ++i) {
+					int component;
+					std::memcpy(&component, row + i * STEP_SIZE, STEP_SIZE);
+					vector[i] = static_cast<T>(component);
+				}
+				break;
+			case ComponentType::UINT8:
+				for (int i = 0; i < vectorDimension; ++i) {
+					vector[i] = static_cast<T>(static_cast<uint8_t>(row[i]));
+				}
+				break;
+		}
+	}
+
+	long long VectorFileReader::getFileSize() {
+		std::streampos currentPosition = vectorsFile.tellg();
+		std::streampos begin, end;
+
+		vectorsFile.seekg(0, std::ios::beg);
+		begin = vectorsFile.tellg();
+
+		vectorsFile.seekg(0, std::ios::end);
+		end = vectorsFile.tellg();
+
+		vectorsFile.seekg(currentPosition, std::ios::beg);
+
+		return end - begin;
+	}
+}
+
+#endif // !__cuANN_VectorFileReader__
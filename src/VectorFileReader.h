@@ -0,0 +1,89 @@
+#ifndef __cuANN_VECTORFILEREADER_H_
+#define __cuANN_VECTORFILEREADER_H_
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "Dataset.h"
+
+namespace cuANN {
+	/*
+	 * Reads the vector files of the usual ANN benchmarks:
+	 *  - .fvecs/.ivecs/.bvecs: every vector is prefixed by its dimension as a 4 byte int,
+	 *    followed by float, int or uint8 components.
+	 *  - .fbin/.ibin/.u8bin: a header with the number of vectors and the dimension as
+	 *    4 byte ints, followed by all the float, int or uint8 components.
+	 * Any range of vectors can be read into a flat row-major buffer. Components are
+	 * converted to the requested type chunk by chunk, so converting a uint8 file to
+	 * float never holds more than a chunk of the raw data in memory. A Dataset keeps
+	 * the components of a uint8 file as bytes, a quarter of the floats: they are
+	 * widened where they are used, as the index computes in fp32. The device copy is
+	 * the one that can be narrowed, to 16 bits (see Precision).
+	 */
+	class VectorFileReader
+	{
+	public:
+		enum class Layout { VECS, BIN };
+		enum class ComponentType { FLOAT32, INT32, UINT8 };
+
+		VectorFileReader(std::string fileName, Layout layout, ComponentType type);
+
+		~VectorFileReader();
+
+		// picks the layout and the component type from the file extension
+		static VectorFileReader* open(std::string fileName);
+
+		// the layout and the component type of an extension such as fvecs or u8bin, false if unknown
+		static bool parseFormat(const std::string& extension, Layout& layout, ComponentType& type);
+
+		long long getVectorsNumber() const;
+
+		int getDimension() const;
+
+		void readRange(long long start, long long howMany, float* vectors);
+
+		// the integer files only, uint8 components are widened
+		void readRange(long long start, long long howMany, int* vectors);
+
+		Dataset* readAllVectors();
+
+		Dataset* readVectors(long long howMany);
+
+		Dataset* readVectors(long long start, long long howMany);
+
+		std::vector<int> readAllIdxs();
+
+		std::vector<int> readIdxs(long long howMany);
+
+	private:
+		std::ifstream vectorsFile;
+		std::string fileName;
+		Layout layout;
+		ComponentType type;
+		int vectorDimension;
+		long long vectorsNumber;
+		int componentSize;
+		long long dataOffset;
+		long long rowSize;
+		std::vector<char> chunk;
+
+		static constexpr int STEP_SIZE = 4;
+		static constexpr long long CHUNK_SIZE = 4 * 1024 * 1024;
+
+		void readHeader();
+
+		template<typename T>
+		void readConverted(long long start, long long howMany, T* vectors);
+
+		template<typename T>
+		T* readPadded(long long start, long long howMany, int ld);
+
+		template<typename T>
+		void convertRow(const char* row, T* vector) const;
+
+		long long getFileSize();
+	};
+}
+
+#endif /* __cuANN_VECTORFILEREADER_H_ */
@@ -0,0 +1,384 @@
+#ifndef __cuANN_VectorStore__
+#define __cuANN_VectorStore__
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include "VectorStore.h"
+#ifdef CUANN_WITH_LIBURING
+#include <liburing.h>
+#endif
+
+namespace cuANN {
+	constexpr size_t VectorStore::DISK_BLOCK_SIZE;
+	constexpr size_t VectorStore::ROW_ALIGNMENT;
+	constexpr size_t VectorStore::MAX_READ_SIZE;
+	constexpr size_t VectorStore::QUEUE_DEPTH;
+	constexpr uint64_t VectorStore::MAGIC;
+
+	static size_t roundUp(size_t value, size_t alignment) {
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	struct AlignedFree {
+		void operator()(char* buffer) const {
+			free(buffer);
+		}
+	};
+
+	static std::unique_ptr<char, AlignedFree> allocateAligned(size_t size, size_t alignment) {
+		void * buffer = 0;
+		if (posix_memalign(&buffer, alignment, std::max(size, alignment)) != 0) {
+			throw std::runtime_error("Cannot allocate the read buffers of the vector store");
+		}
+		return std::unique_ptr<char, AlignedFree>((char *) buffer);
+	}
+
+	VectorStore::VectorStore(const std::string& fileName, size_t cacheRows) {
+		this->fileName = fileName;
+		this->cacheRows = cacheRows;
+		clockHand = cacheHits = rowsRead = 0;
+
+		// file systems without direct I/O, like tmpfs, refuse the flag: the page cache is used there
+		fileDescriptor = open(fileName.c_str(), O_RDONLY | O_DIRECT);
+		if (fileDescriptor < 0) {
+			fileDescriptor = open(fileName.c_str(), O_RDONLY);
+		}
+		if (fileDescriptor < 0) {
+			throw std::runtime_error("The file " + fileName + " cannot be opened");
+		}
+
+		try
+		{
+			auto header = allocateAligned(DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+			preadFully(header.get(), DISK_BLOCK_SIZE, 0);
+			uint64_t magic, vectorsNumber, stride;
+			uint32_t dimension;
+			std::memcpy(&magic, header.get(), sizeof(magic));
+			std::memcpy(&vectorsNumber, header.get() + 8, sizeof(vectorsNumber));
+			std::memcpy(&dimension, header.get() + 16, sizeof(dimension));
+			std::memcpy(&stride, header.get() + 24, sizeof(stride));
+			if (magic != MAGIC || vectorsNumber > (uint64_t) std::numeric_limits<int>::max() || stride < dimension * sizeof(float)) {
+				throw std::runtime_error("The file " + fileName + " is not a vector store");
+			}
+			N = vectorsNumber;
+			d = dimension;
+			rowStride = stride;
+		}
+		catch (const std::exception&)
+		{
+			close(fileDescriptor);
+			throw;
+		}
+
+		cachedRows.resize(cacheRows * d);
+	}
+
+	VectorStore::~VectorStore() {
+#ifdef CUANN_WITH_LIBURING
+		for (struct io_uring * ring : idleRings) {
+			io_uring_queue_exit(ring);
+			delete ring;
+		}
+#endif
+		close(fileDescriptor);
+	}
+
+	void VectorStore::create(const std::string& fileName, VectorFileReader& reader) {
+		std::ofstream file(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (file.fail())
+		{
+			throw std::runtime_error("The file " + fileName + " cannot be opened");
+		}
+
+		uint64_t vectorsNumber = reader.getVectorsNumber();
+		uint32_t dimension = reader.getDimension();
+		uint64_t stride = roundUp(dimension * sizeof(float), ROW_ALIGNMENT);
+		std::vector<char> header(DISK_BLOCK_SIZE, 0);
+		std::memcpy(header.data(), &MAGIC, sizeof(MAGIC));
+		std::memcpy(header.data() + 8, &vectorsNumber, sizeof(vectorsNumber));
+		std::memcpy(header.data() + 16, &dimension, sizeof(dimension));
+		std::memcpy(header.data() + 24, &stride, sizeof(stride));
+		file.write(header.data(), header.size());
+
+		long long chunkRows = std::max<long long>(1, MAX_READ_SIZE / stride);
+		std::vector<float> rows(chunkRows * dimension);
+		std::vector<char> paddedRows(chunkRows * stride, 0);
+		for (long long start = 0; start < (long long) vectorsNumber; start += chunkRows) {
+			long long howMany = std::min<long long>(chunkRows, vectorsNumber - start);
+			reader.readRange(start, howMany, rows.data());
+			for (long long row = 0; row < howMany; ++row) {
+				std::memcpy(paddedRows.data() + row * stride, rows.data() + row * dimension, dimension * sizeof(float));
+			}
+			file.write(paddedRows.data(), howMany * stride);
+		}
+
+		// direct reads may ask for the whole last block
+		size_t size = DISK_BLOCK_SIZE + vectorsNumber * stride;
+		std::vector<char> padding(roundUp(size, DISK_BLOCK_SIZE) - size, 0);
+		file.write(padding.data(), padding.size());
+		file.flush();
+		if (!file)
+		{
+			throw std::runtime_error("Couldn't write the vector store " + fileName);
+		}
+	}
+
+	int VectorStore::getVectorsNumber() const {
+		return N;
+	}
+
+	int VectorStore::getDimension() const {
+		return d;
+	}
+
+	void VectorStore::readRange(long long start, long long howMany, float* rows) {
+		long long chunkRows = std::max<long long>(1, MAX_READ_SIZE / rowStride);
+		std::vector<unsigned> ids;
+		for (long long chunkStart = start; chunkStart < start + howMany; chunkStart += chunkRows) {
+			long long chunkSize = std::min(chunkRows, start + howMany - chunkStart);
+			ids.resize(chunkSize);
+			for (long long i = 0; i < chunkSize; ++i) {
+				ids[i] = chunkStart + i;
+			}
+			readRows(ids.data(), ids.size(), rows + (chunkStart - start) * d);
+		}
+	}
+
+	/*
+	 * The cache is only held to look the rows up and to insert the ones read, never during the reads.
+	 */
+	void VectorStore::fetch(const unsigned* ids, size_t count, float* rows) {
+		std::vector<size_t> missing;
+		{
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			for (size_t i = 0; i < count; ++i) {
+				if (ids[i] >= (unsigned) N) {
+					throw std::runtime_error("Row " + std::to_string(ids[i]) + " is not in the vector store");
+				}
+				if (!lookUp(ids[i], rows + i * d)) {
+					missing.push_back(i);
+				}
+			}
+		}
+		if (missing.empty()) {
+			return;
+		}
+
+		std::vector<unsigned> missingIds(missing.size());
+		for (size_t i = 0; i < missing.size(); ++i) {
+			missingIds[i] = ids[missing[i]];
+		}
+		std::vector<float> missingRows(missing.size() * d);
+		readRows(missingIds.data(), missingIds.size(), missingRows.data());
+
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		for (size_t i = 0; i < missing.size(); ++i) {
+			std::copy_n(missingRows.data() + i * d, d, rows + missing[i] * d);
+			insert(missingIds[i], missingRows.data() + i * d);
+		}
+		rowsRead += missing.size();
+	}
+
+	size_t VectorStore::getCacheHits() const {
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		return cacheHits;
+	}
+
+	size_t VectorStore::getRowsRead() const {
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		return rowsRead;
+	}
+
+	// the map is counted at a slot and a bucket per entry, its nodes are not visible
+	size_t VectorStore::getCacheBytes() const {
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		return cachedRows.capacity() * sizeof(float) + slotIds.capacity() * sizeof(unsigned) + slotReferenced.capacity()
+			+ cacheSlots.size() * (sizeof(std::pair<unsigned, size_t>) + 2 * sizeof(void*)) + cacheSlots.bucket_count() * sizeof(void*);
+	}
+
+	size_t VectorStore::getRowOffset(unsigned id) const {
+		return DISK_BLOCK_SIZE + (size_t) id * rowStride;
+	}
+
+	/*
+	 * Rows whose blocks touch are read together, up to MAX_READ_SIZE per read.
+	 */
+	void VectorStore::readRows(const unsigned* ids, size_t count, float* rows) {
+		size_t rowBytes = d * sizeof(float);
+		std::vector<Read> reads;
+		for (size_t i = 0; i < count; ++i) {
+			size_t rowOffset = getRowOffset(ids[i]);
+			size_t blockBegin = rowOffset / DISK_BLOCK_SIZE * DISK_BLOCK_SIZE;
+			size_t blockEnd = roundUp(rowOffset + rowBytes, DISK_BLOCK_SIZE);
+			if (!reads.empty()) {
+				Read& last = reads.back();
+				if (blockBegin <= last.offset + last.length && blockEnd - last.offset <= MAX_READ_SIZE) {
+					last.length = std::max(last.length, blockEnd - last.offset);
+					last.lastRow = i + 1;
+					continue;
+				}
+			}
+			reads.push_back({ blockBegin, blockEnd - blockBegin, i, i + 1, 0 });
+		}
+
+		size_t totalLength = 0;
+		for (const auto& read : reads) {
+			totalLength += read.length;
+		}
+		auto buffer = allocateAligned(totalLength, DISK_BLOCK_SIZE);
+		size_t bufferOffset = 0;
+		for (auto& read : reads) {
+			read.buffer = buffer.get() + bufferOffset;
+			bufferOffset += read.length;
+		}
+
+		readBlocks(reads);
+
+		for (const auto& read : reads) {
+			for (size_t i = read.firstRow; i < read.lastRow; ++i) {
+				std::memcpy(rows + i * d, read.buffer + getRowOffset(ids[i]) - read.offset, rowBytes);
+			}
+		}
+	}
+
+	void VectorStore::readBlocks(std::vector<Read>& reads) {
+#ifdef CUANN_WITH_LIBURING
+		struct io_uring * ring = acquireRing();
+		if (ring) {
+			size_t submitted = 0, completed = 0;
+			int error = 0;
+			while (completed < submitted || (submitted < reads.size() && !error)) {
+				while (submitted < reads.size() && submitted - completed < QUEUE_DEPTH && !error) {
+					struct io_uring_sqe * sqe = io_uring_get_sqe(ring);
+					if (!sqe) {
+						break;
+					}
+					Read& read = reads[submitted++];
+					io_uring_prep_read(sqe, fileDescriptor, read.buffer, read.length, read.offset);
+					io_uring_sqe_set_data(sqe, &read);
+				}
+				io_uring_submit_and_wait(ring, 1);
+
+				struct io_uring_cqe * cqe;
+				while (io_uring_peek_cqe(ring, &cqe) == 0) {
+					Read * read = (Read *) io_uring_cqe_get_data(cqe);
+					int result = cqe->res;
+					io_uring_cqe_seen(ring, cqe);
+					++completed;
+					if (result < 0) {
+						error = result;
+					} else if ((size_t) result < read->length) {
+						// short reads are finished synchronously, a failure waits for the ring to drain
+						try
+						{
+							preadFully(read->buffer + result, read->length - result, read->offset + result);
+						}
+						catch (const std::exception&)
+						{
+							error = -EIO;
+						}
+					}
+				}
+			}
+			releaseRing(ring);
+			if (error) {
+				throw std::runtime_error("Couldn't read the vector store " + fileName);
+			}
+			return;
+		}
+#endif
+		for (const auto& read : reads) {
+			preadFully(read.buffer, read.length, read.offset);
+		}
+	}
+
+#ifdef CUANN_WITH_LIBURING
+	/*
+	 * A fetch takes an idle ring, or sets up a new one when they are all busy. Null when the kernel
+	 * has no io_uring, the reads are then made with pread.
+	 */
+	struct io_uring* VectorStore::acquireRing() {
+		{
+			std::lock_guard<std::mutex> lock(ringsMutex);
+			if (!idleRings.empty()) {
+				struct io_uring * ring = idleRings.back();
+				idleRings.pop_back();
+				return ring;
+			}
+		}
+
+		std::unique_ptr<struct io_uring> ring(new struct io_uring());
+		if (io_uring_queue_init(QUEUE_DEPTH, ring.get(), 0) != 0) {
+			return 0;
+		}
+		return ring.release();
+	}
+
+	void VectorStore::releaseRing(struct io_uring* ring) {
+		std::lock_guard<std::mutex> lock(ringsMutex);
+		idleRings.push_back(ring);
+	}
+#endif
+
+	void VectorStore::preadFully(char* buffer, size_t length, size_t offset) {
+		while (length > 0) {
+			ssize_t result = pread(fileDescriptor, buffer, length, offset);
+			if (result <= 0) {
+				throw std::runtime_error("Couldn't read the vector store " + fileName);
+			}
+			buffer += result;
+			offset += result;
+			length -= result;
+		}
+	}
+
+	bool VectorStore::lookUp(unsigned id, float* row) {
+		auto slot = cacheSlots.find(id);
+		if (slot == cacheSlots.end()) {
+			return false;
+		}
+		slotReferenced[slot->second] = 1;
+		std::copy_n(cachedRows.data() + slot->second * d, d, row);
+		++cacheHits;
+		return true;
+	}
+
+	/*
+	 * CLOCK replacement: the hand clears the reference bits it passes and takes the first slot
+	 * not referenced since its last round.
+	 */
+	void VectorStore::insert(unsigned id, const float* row) {
+		if (cacheRows == 0 || cacheSlots.count(id)) {
+			return;
+		}
+
+		size_t slot;
+		if (slotIds.size() < cacheRows) {
+			slot = slotIds.size();
+			slotIds.push_back(id);
+			slotReferenced.push_back(1);
+		} else {
+			while (slotReferenced[clockHand]) {
+				slotReferenced[clockHand] = 0;
+				clockHand = (clockHand + 1) % cacheRows;
+			}
+			slot = clockHand;
+			clockHand = (clockHand + 1) % cacheRows;
+			cacheSlots.erase(slotIds[slot]);
+			slotIds[slot] = id;
+			slotReferenced[slot] = 1;
+		}
+		std::copy_n(row, d, cachedRows.data() + slot * d);
+		cacheSlots[id] = slot;
+	}
+}
+
+#endif // !__cuANN_VectorStore__
@@ -0,0 +1,105 @@
+#ifndef __cuANN_VECTORSTORE_H_
+#define __cuANN_VECTORSTORE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "VectorFileReader.h"
+
+struct io_uring;
+
+namespace cuANN {
+	/*
+	 * The fp32 rows of a dataset in a file laid out for direct I/O: a header block followed by the
+	 * rows, each padded to a multiple of ROW_ALIGNMENT bytes, the file padded to a whole block.
+	 * Rows are fetched in batches of sorted ids: neighbouring rows are coalesced into block aligned
+	 * reads, submitted together through io_uring when built with CUANN_WITH_LIBURING and with pread
+	 * otherwise. The rings are kept for the life of the store, one per concurrent fetch.
+	 * A CLOCK cache keeps the rows fetched most often in memory. Fetches may run concurrently.
+	 */
+	class VectorStore
+	{
+	public:
+		VectorStore(const std::string& fileName, size_t cacheRows);
+
+		VectorStore(const VectorStore &) = delete;
+
+		~VectorStore();
+
+		// writes the vectors of the reader into a store file, a chunk at a time
+		static void create(const std::string& fileName, VectorFileReader& reader);
+
+		int getVectorsNumber() const;
+
+		int getDimension() const;
+
+		// sequential read of the rows [start, start + howMany), past the cache
+		void readRange(long long start, long long howMany, float* rows);
+
+		// the rows of ids, which must be increasing, one after the other
+		void fetch(const unsigned* ids, size_t count, float* rows);
+
+		size_t getCacheHits() const;
+
+		size_t getRowsRead() const;
+
+		size_t getCacheBytes() const;
+
+	private:
+		static constexpr size_t DISK_BLOCK_SIZE = 4096;
+		static constexpr size_t ROW_ALIGNMENT = 512;
+		static constexpr size_t MAX_READ_SIZE = 1 << 20;
+		static constexpr size_t QUEUE_DEPTH = 64;
+		static constexpr uint64_t MAGIC = 0x6365764e4e417563ULL;
+
+		// blocks [offset, offset + length) holding the fetched rows [firstRow, lastRow)
+		struct Read {
+			size_t offset;
+			size_t length;
+			size_t firstRow;
+			size_t lastRow;
+			char * buffer;
+		};
+
+		int fileDescriptor;
+		std::string fileName;
+		int N;
+		int d;
+		size_t rowStride;
+
+		mutable std::mutex cacheMutex;
+		size_t cacheRows;
+		std::vector<float> cachedRows;
+		std::unordered_map<unsigned, size_t> cacheSlots;
+		std::vector<unsigned> slotIds;
+		std::vector<char> slotReferenced;
+		size_t clockHand;
+		size_t cacheHits;
+		size_t rowsRead;
+
+		// rings not in use by a fetch
+		std::mutex ringsMutex;
+		std::vector<struct io_uring*> idleRings;
+
+		size_t getRowOffset(unsigned id) const;
+
+		void readRows(const unsigned* ids, size_t count, float* rows);
+
+		void readBlocks(std::vector<Read>& reads);
+
+		struct io_uring* acquireRing();
+
+		void releaseRing(struct io_uring* ring);
+
+		void preadFully(char* buffer, size_t length, size_t offset);
+
+		bool lookUp(unsigned id, float* row);
+
+		void insert(unsigned id, const float* row);
+	};
+}
+
+#endif /* __cuANN_VECTORSTORE_H_ */
@@ -12,6 +12,8 @@ typedef thrust::device_vector<unsigned> ThrustUnsignedV;
 typedef thrust::device_vector<int> ThrustIntV;
 typedef thrust::device_vector<bool> ThrustBoolV;
 typedef thrust::device_vector<size_t> ThrustSizetV;
+// 16 bit floats kept as their bit patterns, see PrecisionConverter
+typedef thrust::device_vector<unsigned short> ThrustUshortV;
 
 typedef thrust::host_vector<int> ThrustHIntV;
 typedef thrust::host_vector<unsigned> ThrustHUnsignedV;
@@ -3,18 +3,14 @@
 
 #include <cublas_v2.h>
 #include <stdexcept>
+#include <cuda_fp16.h>
 #include <thrust/gather.h>
 #include "commons.h"
 #include "utils.h"
 
 namespace cuANN {
-	void multiplyMatrix(const float* A, const float* B, float* result, const int rowsA, const int colsA, const int colsB) {
+	void multiplyMatrix(cublasHandle_t handle, const float* A, const float* B, float* result, const int rowsA, const int colsA, const int colsB) {
 		const float alpha = 1.0, beta = 0.0;
-		
-		cublasHandle_t handle;
-		if (cublasCreate(&handle) != CUBLAS_STATUS_SUCCESS) {
-			throw std::runtime_error("Cannot create cuBLAS handle.");
-		}
 
 //		cublasStatus_t status = cublasSgemm(handle, CUBLAS_OP_N, CUBLAS_OP_N,
 //			rowsA, colsB, colsA,
@@ -34,13 +30,77 @@ namespace cuANN {
 			result, colsB
 		);
 
-		cublasDestroy(handle);
+		if (status != CUBLAS_STATUS_SUCCESS) {
+			throw std::runtime_error("Cannot perform matrix multiplication.");
+		}
+	}
+
+	/*
+	 * Same as multiplyMatrix with A and B in fp16 or bf16: the products are accumulated and returned in fp32.
+	 * cuBLAS only multiplies bf16 from CUDA 11 on.
+	 */
+	void multiplyMatrixHalf(cublasHandle_t handle, const unsigned short* A, const unsigned short* B, Precision precision, float* result, const int rowsA, const int colsA, const int colsB) {
+		const float alpha = 1.0, beta = 0.0;
+#if CUDART_VERSION >= 11000
+		cudaDataType type = precision == BFLOAT16 ? CUDA_R_16BF : CUDA_R_16F;
+#else
+		if (precision != FLOAT16) {
+			throw std::runtime_error("Multiplying bf16 matrices needs CUDA 11.");
+		}
+		cudaDataType type = CUDA_R_16F;
+#endif
+
+		cublasStatus_t status = cublasGemmEx(handle, CUBLAS_OP_N, CUBLAS_OP_N,
+			colsB, rowsA, colsA,
+			&alpha,
+			B, type, colsB,
+			A, type, colsA,
+			&beta,
+			result, CUDA_R_32F, colsB,
+			CUDA_R_32F, CUBLAS_GEMM_DEFAULT
+		);
 
 		if (status != CUBLAS_STATUS_SUCCESS) {
 			throw std::runtime_error("Cannot perform matrix multiplication.");
 		}
 	}
 
+	/*
+	 * result = A * B^T, all row-major. Used to get every dot product between the rows of A and the rows of B.
+	 */
+	void multiplyMatrixTransposed(cublasHandle_t handle, const float* A, const float* B, float* result, const int rowsA, const int colsA, const int rowsB) {
+		const float alpha = 1.0, beta = 0.0;
+
+		cublasStatus_t status = cublasSgemm(handle, CUBLAS_OP_T, CUBLAS_OP_N,
+			rowsB, rowsA, colsA,
+			&alpha,
+			B, colsA,
+			A, colsA,
+			&beta,
+			result, rowsB
+		);
+
+		if (status != CUBLAS_STATUS_SUCCESS) {
+			throw std::runtime_error("Cannot perform matrix multiplication.");
+		}
+	}
+
+	void uploadRows(const Dataset& rows, long long start, int count, float* dRows, ExecutionContext& context) {
+		cudaStream_t stream = context.getStream();
+		if (rows.dataset) {
+			cudaMemcpy2DAsync(dRows, rows.d * sizeof(float), rows.dataset + start * rows.ld, rows.ld * sizeof(float), rows.d * sizeof(float), count, cudaMemcpyHostToDevice, stream);
+			return;
+		}
+
+		// the bytes go back to the arena once queued: whatever takes them next runs after the widening
+		size_t size = (size_t) count * rows.d;
+		ScratchBuffer<uint8_t> dBytes(context.getDeviceArena(), size);
+		cudaMemcpy2DAsync(dBytes.data(), rows.d, rows.bytes + start * rows.ld, rows.ld, rows.d, count, cudaMemcpyHostToDevice, stream);
+		dim3 dimBlock(BLOCK_SIZE * BLOCK_SIZE);
+		dim3 dimGrid((size + dimBlock.x - 1)/dimBlock.x);
+		widenBytes<<<dimGrid, dimBlock, 0, stream>>>(dBytes.data(), size, dRows);
+	}
+
 	__global__ void addVectorFromMatrix(float* matrix, const float* vector, const int rowsA, const int colsA) {
 		int col = blockIdx.x * blockDim.x + threadIdx.x;
 		int row = blockIdx.y * blockDim.y + threadIdx.y;
@@ -50,7 +110,7 @@ namespace cuANN {
 		}
 	}
 
-	__global__ void divideMatrixByScalar(float* matrix, const int scalar, const int rowsA, const int colsA) {
+	__global__ void divideMatrixByScalar(float* matrix, const float scalar, const int rowsA, const int colsA) {
 		int col = blockIdx.x * blockDim.x + threadIdx.x;
 		int row = blockIdx.y * blockDim.y + threadIdx.y;
 
@@ -77,14 +137,27 @@ namespace cuANN {
 		int queryId = blockIdx.x * blockDim.x + threadIdx.x;
 
 		if(queryId < Q && binIdxsCandidates[queryId] >= 0) {
-			if (queryHashes[queryId] != binCodes[binIdxsCandidates[queryId]]) {
+			int candidate = binIdxsCandidates[queryId];
+			if (candidate >= binsNumber || queryHashes[queryId] != binCodes[candidate]) {
 				binIdxsCandidates[queryId] = -1;
 			}
 		}
 	}
 
-	__global__ void calcSquaredDistances(
-		const float* A,
+	__device__ __forceinline__ float loadValue(const float* values, size_t idx, Precision precision) {
+		return values[idx];
+	}
+
+	__device__ __forceinline__ float loadValue(const unsigned short* values, size_t idx, Precision precision) {
+		// a bfloat16 is the upper half of the fp32 with the same value
+		return precision == FLOAT16
+			? __half2float(__ushort_as_half(values[idx]))
+			: __uint_as_float((unsigned) values[idx] << 16);
+	}
+
+	template<typename T>
+	__device__ void calcSquaredDistancesOfRows(
+		const T* A, Precision precisionA,
 		const float* B,
 		int cols,
 		const unsigned* rowIdxsA,
@@ -96,12 +169,12 @@ namespace cuANN {
 
 		int distanceIdx = blockDim.x * blockIdx.x + threadIdx.x;
 		if (distanceIdx < distancesNumber) {
-			int ARowIdx = rowIdxsA[distanceIdx];
-			int BRowIdx = rowIdxsB[distanceIdx];
+			size_t ARowStart = (size_t) cols * rowIdxsA[distanceIdx];
+			size_t BRowStart = (size_t) cols * rowIdxsB[distanceIdx];
 
 			float distance = 0.0;
 			for (int strideIdx = threadIdx.y; strideIdx < cols; strideIdx += BLOCK_SIZE_STRIDE_Y) {
-				distance += powf(A[cols * ARowIdx + strideIdx] - B[cols * BRowIdx + strideIdx], 2);
+				distance += powf(loadValue(A, ARowStart + strideIdx, precisionA) - B[BRowStart + strideIdx], 2);
 			}
 
 			distances[threadIdx.x][threadIdx.y] = distance;
@@ -118,11 +191,407 @@ namespace cuANN {
 		}
 		__syncthreads();
 
-		if (threadIdx.y == 0) {
+		if (threadIdx.y == 0 && distanceIdx < distancesNumber) {
 			result[distanceIdx] = distances[threadIdx.x][0] + distances[threadIdx.x][1];
 		}
 	}
 
+	__global__ void calcSquaredDistances(
+		const float* A,
+		const float* B,
+		int cols,
+		const unsigned* rowIdxsA,
+		const unsigned* rowIdxsB,
+		unsigned distancesNumber,
+		float* result
+	) {
+		calcSquaredDistancesOfRows(A, FLOAT32, B, cols, rowIdxsA, rowIdxsB, distancesNumber, result);
+	}
+
+	/*
+	 * Same as above with the rows of A stored in 16 bits, the differences are accumulated in fp32.
+	 */
+	__global__ void calcSquaredDistances(
+		const unsigned short* A, Precision precisionA,
+		const float* B,
+		int cols,
+		const unsigned* rowIdxsA,
+		const unsigned* rowIdxsB,
+		unsigned distancesNumber,
+		float* result
+	) {
+		calcSquaredDistancesOfRows(A, precisionA, B, cols, rowIdxsA, rowIdxsB, distancesNumber, result);
+	}
+
+	/*
+	 * Distances of the pairs against a radius. A thread stops summing its stride once the partial sum is
+	 * past the radius, it can only grow. matchesCounts counts the matches of each row of B: pairs of a row
+	 * that already has maxMatches are not computed at all, and past the limit the matches are dropped.
+	 */
+	template<typename T>
+	__device__ void selectRowsWithinRadiusOf(
+		const T* A, Precision precisionA,
+		const float* B,
+		int cols,
+		const unsigned* rowIdxsA,
+		const unsigned* rowIdxsB,
+		unsigned distancesNumber,
+		float squaredRadius,
+		unsigned maxMatches,
+		unsigned* matchesCounts,
+		float* result,
+		bool* matched
+	) {
+		__shared__ float distances[BLOCK_SIZE_STRIDE_X][BLOCK_SIZE_STRIDE_Y];
+
+		int distanceIdx = blockDim.x * blockIdx.x + threadIdx.x;
+		bool isActive = distanceIdx < distancesNumber
+			&& *((volatile unsigned*) matchesCounts + rowIdxsB[distanceIdx]) < maxMatches;
+
+		float distance = isActive ? 0.0 : squaredRadius + 1.0f;
+		if (isActive) {
+			size_t ARowStart = (size_t) cols * rowIdxsA[distanceIdx];
+			size_t BRowStart = (size_t) cols * rowIdxsB[distanceIdx];
+
+			for (int strideIdx = threadIdx.y; strideIdx < cols && distance <= squaredRadius; strideIdx += BLOCK_SIZE_STRIDE_Y) {
+				distance += powf(loadValue(A, ARowStart + strideIdx, precisionA) - B[BRowStart + strideIdx], 2);
+			}
+		}
+		distances[threadIdx.x][threadIdx.y] = distance;
+		__syncthreads();
+
+		if (threadIdx.y < 4) {
+			distances[threadIdx.x][threadIdx.y] += distances[threadIdx.x][threadIdx.y + 4];
+		}
+		__syncthreads();
+
+		if (threadIdx.y < 2) {
+			distances[threadIdx.x][threadIdx.y] += distances[threadIdx.x][threadIdx.y + 2];
+		}
+		__syncthreads();
+
+		if (threadIdx.y == 0 && distanceIdx < distancesNumber) {
+			distance = distances[threadIdx.x][0] + distances[threadIdx.x][1];
+			bool isMatch = isActive && distance <= squaredRadius
+				&& atomicAdd(matchesCounts + rowIdxsB[distanceIdx], 1u) < maxMatches;
+			result[distanceIdx] = distance;
+			matched[distanceIdx] = isMatch;
+		}
+	}
+
+	__global__ void selectRowsWithinRadius(
+		const float* A,
+		const float* B,
+		int cols,
+		const unsigned* rowIdxsA,
+		const unsigned* rowIdxsB,
+		unsigned distancesNumber,
+		float squaredRadius,
+		unsigned maxMatches,
+		unsigned* matchesCounts,
+		float* result,
+		bool* matched
+	) {
+		selectRowsWithinRadiusOf(A, FLOAT32, B, cols, rowIdxsA, rowIdxsB, distancesNumber, squaredRadius, maxMatches, matchesCounts, result, matched);
+	}
+
+	__global__ void selectRowsWithinRadius(
+		const unsigned short* A, Precision precisionA,
+		const float* B,
+		int cols,
+		const unsigned* rowIdxsA,
+		const unsigned* rowIdxsB,
+		unsigned distancesNumber,
+		float squaredRadius,
+		unsigned maxMatches,
+		unsigned* matchesCounts,
+		float* result,
+		bool* matched
+	) {
+		selectRowsWithinRadiusOf(A, precisionA, B, cols, rowIdxsA, rowIdxsB, distancesNumber, squaredRadius, maxMatches, matchesCounts, result, matched);
+	}
+
+	__global__ void expandToFloat(const unsigned short* source, size_t size, Precision precision, float* destination) {
+		size_t idx = (size_t) blockIdx.x * blockDim.x + threadIdx.x;
+
+		if (idx < size) {
+			destination[idx] = loadValue(source, idx, precision);
+		}
+	}
+
+	__global__ void widenBytes(const uint8_t* source, size_t size, float* destination) {
+		size_t idx = (size_t) blockIdx.x * blockDim.x + threadIdx.x;
+
+		if (idx < size) {
+			destination[idx] = source[idx];
+		}
+	}
+
+	__global__ void calcSquaredNorms(const float* matrix, const int rows, const int cols, float* norms) {
+		int row = blockIdx.x * blockDim.x + threadIdx.x;
+
+		if (row < rows) {
+			float norm = 0.0;
+			for (int col = 0; col < cols; ++col) {
+				norm += matrix[cols * row + col] * matrix[cols * row + col];
+			}
+			norms[row] = norm;
+		}
+	}
+
+	/*
+	 * Turns a tile of dot products into squared distances, ||x||^2 - 2x*q + ||q||^2, and merges them
+	 * into the running top K of each query, kept sorted by increasing distance. One block of
+	 * SELECTION_THREADS per query: the row of dot products is read coalesced a chunk at a time, and
+	 * the distances of a chunk below the current K-th are merged into the top by their ranks, from
+	 * one of the top and spare buffers into the other. Few chunks pass once the top is full.
+	 */
+	__global__ void selectTopKFromTile(
+		const float* dots,
+		const float* tileNorms,
+		const float* queryNorms,
+		int Q, int tileRows, unsigned tileOffset, int K,
+		float* topDistances,
+		int* topIdxs,
+		float* spareDistances,
+		int* spareIdxs
+	) {
+		__shared__ float candidateDistances[SELECTION_THREADS];
+		__shared__ int candidateIdxs[SELECTION_THREADS];
+		__shared__ int candidatesNumber;
+
+		int query = blockIdx.x;
+		float* distances = topDistances + (size_t) K * query;
+		int* idxs = topIdxs + (size_t) K * query;
+		float* nextDistances = spareDistances + (size_t) K * query;
+		int* nextIdxs = spareIdxs + (size_t) K * query;
+		const float* queryDots = dots + (size_t) tileRows * query;
+		float queryNorm = queryNorms[query];
+		float worst = distances[K - 1];
+
+		for (int chunk = 0; chunk < tileRows; chunk += SELECTION_THREADS) {
+			if (threadIdx.x == 0) {
+				candidatesNumber = 0;
+			}
+			__syncthreads();
+
+			int row = chunk + threadIdx.x;
+			if (row < tileRows) {
+				float distance = fmaxf(tileNorms[row] - 2 * queryDots[row] + queryNorm, 0.0f);
+				if (distance < worst) {
+					int slot = atomicAdd(&candidatesNumber, 1);
+					candidateDistances[slot] = distance;
+					candidateIdxs[slot] = tileOffset + row;
+				}
+			}
+			__syncthreads();
+
+			// ties keep the top entries first, then the candidates in slot order
+			int candidates = candidatesNumber;
+			if (candidates > 0) {
+				if (threadIdx.x < candidates) {
+					float distance = candidateDistances[threadIdx.x];
+					int rank = 0;
+					for (int other = 0; other < candidates; ++other) {
+						rank += candidateDistances[other] < distance || (candidateDistances[other] == distance && other < threadIdx.x);
+					}
+					int low = 0, high = K;
+					while (low < high) {
+						int middle = (low + high) / 2;
+						if (distances[middle] <= distance) {
+							low = middle + 1;
+						} else {
+							high = middle;
+						}
+					}
+					rank += low;
+					if (rank < K) {
+						nextDistances[rank] = distance;
+						nextIdxs[rank] = candidateIdxs[threadIdx.x];
+					}
+				}
+				for (int i = threadIdx.x; i < K; i += SELECTION_THREADS) {
+					float distance = distances[i];
+					int rank = i;
+					for (int other = 0; other < candidates; ++other) {
+						rank += candidateDistances[other] < distance;
+					}
+					if (rank < K) {
+						nextDistances[rank] = distance;
+						nextIdxs[rank] = idxs[i];
+					}
+				}
+			}
+			__syncthreads();
+
+			if (candidates > 0) {
+				float* swapDistances = distances;
+				distances = nextDistances;
+				nextDistances = swapDistances;
+				int* swapIdxs = idxs;
+				idxs = nextIdxs;
+				nextIdxs = swapIdxs;
+				worst = distances[K - 1];
+			}
+		}
+
+		// an odd number of merges leaves the top in the spare buffers
+		if (distances != topDistances + (size_t) K * query) {
+			for (int i = threadIdx.x; i < K; i += SELECTION_THREADS) {
+				nextDistances[i] = distances[i];
+				nextIdxs[i] = idxs[i];
+			}
+		}
+	}
+
+	/*
+	 * Unnormalized Walsh-Hadamard transform of a shared array by the whole block, in the butterfly
+	 * order of FastHadamard. Ends synchronized.
+	 */
+	__device__ void transformHadamard(float* values, const int size) {
+		for (int half = 1; half < size; half *= 2) {
+			for (int pair = threadIdx.x; pair < size / 2; pair += blockDim.x) {
+				int i = (pair / half) * 2 * half + pair % half;
+				float a = values[i];
+				float b = values[i + half];
+				values[i] = a + b;
+				values[i + half] = a - b;
+			}
+			__syncthreads();
+		}
+	}
+
+	/*
+	 * One block per row. Each of the k functions rotates the row, zero padded to paddedCols, with three
+	 * rounds of sign flips and Walsh-Hadamard butterflies in shared memory, then takes the largest
+	 * coordinate in magnitude, the lower one on ties. blockDim.x must be a power of two.
+	 */
+	template<typename T>
+	__device__ void hashCrossPolytopeRowsOf(const T* matrix, Precision precision, const int rows, const int cols, const int paddedCols, const int k, const float* signs, size_t* hashes) {
+		extern __shared__ float shared[];
+		float* values = shared;
+		float* largestValues = values + paddedCols;
+		int* largestCoordinates = (int*) (largestValues + blockDim.x);
+
+		int row = blockIdx.x;
+		size_t seed = 0;
+		for (int function = 0; function < k; ++function) {
+			for (int i = threadIdx.x; i < paddedCols; i += blockDim.x) {
+				values[i] = i < cols ? loadValue(matrix, (size_t) row * cols + i, precision) : 0.0f;
+			}
+			__syncthreads();
+
+			for (int round = 0; round < 3; ++round) {
+				const float* roundSigns = signs + ((size_t) function * 3 + round) * paddedCols;
+				for (int i = threadIdx.x; i < paddedCols; i += blockDim.x) {
+					values[i] *= roundSigns[i];
+				}
+				__syncthreads();
+				transformHadamard(values, paddedCols);
+			}
+
+			float largest = -1.0f;
+			int largestCoordinate = 0;
+			for (int i = threadIdx.x; i < paddedCols; i += blockDim.x) {
+				if (fabsf(values[i]) > largest) {
+					largest = fabsf(values[i]);
+					largestCoordinate = i;
+				}
+			}
+			largestValues[threadIdx.x] = largest;
+			largestCoordinates[threadIdx.x] = largestCoordinate;
+			__syncthreads();
+
+			for (int stride = blockDim.x / 2; stride > 0; stride /= 2) {
+				if (threadIdx.x < stride) {
+					float other = largestValues[threadIdx.x + stride];
+					int otherCoordinate = largestCoordinates[threadIdx.x + stride];
+					if (other > largestValues[threadIdx.x] || (other == largestValues[threadIdx.x] && otherCoordinate < largestCoordinates[threadIdx.x])) {
+						largestValues[threadIdx.x] = other;
+						largestCoordinates[threadIdx.x] = otherCoordinate;
+					}
+				}
+				__syncthreads();
+			}
+
+			if (threadIdx.x == 0) {
+				int coordinate = largestCoordinates[0];
+				seed = mixCrossPolytopeVertex(seed, toCrossPolytopeVertex(coordinate, values[coordinate]));
+			}
+			// values is overwritten by the next function
+			__syncthreads();
+		}
+
+		if (threadIdx.x == 0) {
+			hashes[row] = seed;
+		}
+	}
+
+	__global__ void hashCrossPolytope(const float* matrix, const int rows, const int cols, const int paddedCols, const int k, const float* signs, size_t* hashes) {
+		hashCrossPolytopeRowsOf(matrix, FLOAT32, rows, cols, paddedCols, k, signs, hashes);
+	}
+
+	__global__ void hashCrossPolytope(const unsigned short* matrix, Precision precision, const int rows, const int cols, const int paddedCols, const int k, const float* signs, size_t* hashes) {
+		hashCrossPolytopeRowsOf(matrix, precision, rows, cols, paddedCols, k, signs, hashes);
+	}
+
+	/*
+	 * One block per row, k structured projections in blocks of paddedCols: each block computes
+	 * H G P H B x / sqrt(paddedCols) with B random signs, P a permutation and G a Gaussian diagonal.
+	 * Given B and P every output is, over G, exactly a Gaussian projection of x; the first H spreads
+	 * x over all the coordinates so that the outputs of a block are close to independent.
+	 */
+	template<typename T>
+	__device__ void projectStructuredRowsOf(const T* matrix, Precision precision, const int rows, const int cols, const int paddedCols, const int k, const float* signs, const int* permutations, const float* gaussians, float* projected) {
+		extern __shared__ float shared[];
+		float* values = shared;
+		float* permuted = values + paddedCols;
+
+		int row = blockIdx.x;
+		float scale = 1.0f / sqrtf((float) paddedCols);
+		int blocks = (k + paddedCols - 1) / paddedCols;
+		for (int block = 0; block < blocks; ++block) {
+			size_t blockStart = (size_t) block * paddedCols;
+			for (int i = threadIdx.x; i < paddedCols; i += blockDim.x) {
+				values[i] = i < cols ? loadValue(matrix, (size_t) row * cols + i, precision) * signs[blockStart + i] : 0.0f;
+			}
+			__syncthreads();
+			transformHadamard(values, paddedCols);
+
+			for (int i = threadIdx.x; i < paddedCols; i += blockDim.x) {
+				permuted[i] = values[permutations[blockStart + i]] * gaussians[blockStart + i];
+			}
+			__syncthreads();
+			transformHadamard(permuted, paddedCols);
+
+			for (int i = threadIdx.x; i < paddedCols && blockStart + i < k; i += blockDim.x) {
+				projected[(size_t) row * k + blockStart + i] = permuted[i] * scale;
+			}
+			__syncthreads();
+		}
+	}
+
+	__global__ void projectStructured(const float* matrix, const int rows, const int cols, const int paddedCols, const int k, const float* signs, const int* permutations, const float* gaussians, float* projected) {
+		projectStructuredRowsOf(matrix, FLOAT32, rows, cols, paddedCols, k, signs, permutations, gaussians, projected);
+	}
+
+	__global__ void projectStructured(const unsigned short* matrix, Precision precision, const int rows, const int cols, const int paddedCols, const int k, const float* signs, const int* permutations, const float* gaussians, float* projected) {
+		projectStructuredRowsOf(matrix, precision, rows, cols, paddedCols, k, signs, permutations, gaussians, projected);
+	}
+
+	/*
+	 * Mixes two hashes of a row the way hashRange mixes the values of one.
+	 */
+	__global__ void combineHashes(const size_t* first, const size_t* second, const int rows, size_t* hashes) {
+		int row = blockIdx.x * blockDim.x + threadIdx.x;
+
+		if (row < rows) {
+			size_t seed = first[row];
+			seed ^= second[row] + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+			hashes[row] = seed;
+		}
+	}
+
 	__device__ void hashRange(const float* iteratorBegin, const float* iteratorEnd, size_t& result) {
 		size_t seed = 0;
 		while(iteratorBegin != iteratorEnd) {
@@ -132,6 +601,68 @@ namespace cuANN {
 		result = seed;
 	}
 
+	template<typename T>
+	__device__ void gatherRowsOf(const T* source, const unsigned* rowIdxs, const int rows, const int cols, T* destination) {
+		int col = blockIdx.x * blockDim.x + threadIdx.x;
+		int row = blockIdx.y * blockDim.y + threadIdx.y;
+
+		if (row < rows && col < cols) {
+			destination[(size_t) row * cols + col] = source[(size_t) rowIdxs[row] * cols + col];
+		}
+	}
+
+	/*
+	 * destination[row] = source[rowIdxs[row]], for row-major matrices with the same number of columns.
+	 */
+	__global__ void gatherRows(const float* source, const unsigned* rowIdxs, const int rows, const int cols, float* destination) {
+		gatherRowsOf(source, rowIdxs, rows, cols, destination);
+	}
+
+	__global__ void gatherRows(const unsigned short* source, const unsigned* rowIdxs, const int rows, const int cols, unsigned short* destination) {
+		gatherRowsOf(source, rowIdxs, rows, cols, destination);
+	}
+
+	/*
+	 * For each candidate the query it belongs to, found by binary search in the starting indices of the queries.
+	 */
+	__global__ void mapCandidatesToQueries(const unsigned* startingIdxs, unsigned Q, unsigned candidatesNumber, unsigned* queryIdxs) {
+		unsigned candidate = blockIdx.x * blockDim.x + threadIdx.x;
+
+		if (candidate < candidatesNumber) {
+			// last query starting at or before the candidate, empty queries share the start of the next one
+			unsigned low = 0, high = Q;
+			while (high - low > 1) {
+				unsigned middle = (low + high) / 2;
+				if (startingIdxs[middle] <= candidate) {
+					low = middle;
+				} else {
+					high = middle;
+				}
+			}
+			queryIdxs[candidate] = low;
+		}
+	}
+
+	/*
+	 * Keys ordering the candidates by query and then by distance: the distances are not negative,
+	 * so their bit patterns compare as their values do.
+	 */
+	__global__ void makeQueryDistanceKeys(const unsigned* queryIdxs, const float* distances, unsigned size, unsigned long long* keys) {
+		unsigned idx = blockIdx.x * blockDim.x + threadIdx.x;
+
+		if (idx < size) {
+			keys[idx] = ((unsigned long long) queryIdxs[idx] << 32) | __float_as_uint(distances[idx]);
+		}
+	}
+
+	__global__ void splitQueryDistanceKeys(const unsigned long long* keys, unsigned size, float* distances) {
+		unsigned idx = blockIdx.x * blockDim.x + threadIdx.x;
+
+		if (idx < size) {
+			distances[idx] = __uint_as_float((unsigned) keys[idx]);
+		}
+	}
+
 	__global__ void hashMatrixRows(const float* matrix, const int rows, const int cols, size_t* hashes) {
 		int row = blockIdx.x * blockDim.x + threadIdx.x;
 
@@ -142,6 +673,143 @@ namespace cuANN {
 		}
 	}
 
+	__device__ __forceinline__ unsigned long long mixPairKey(unsigned long long key) {
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		key *= 0xc4ceb9fe1a85ec53ULL;
+		return key ^ (key >> 33);
+	}
+
+	/*
+	 * Open addressing with linear probing, the set must never fill up. True if the key was not in it yet.
+	 */
+	__device__ bool insertPairKey(unsigned long long* pairKeys, unsigned long long keysMask, unsigned long long key) {
+		unsigned long long slot = mixPairKey(key) & keysMask;
+		while (true) {
+			unsigned long long previous = atomicCAS(pairKeys + slot, EMPTY_PAIR_KEY, key);
+			if (previous == EMPTY_PAIR_KEY) {
+				return true;
+			}
+			if (previous == key) {
+				return false;
+			}
+			slot = (slot + 1) & keysMask;
+		}
+	}
+
+	/*
+	 * One block of BLOCK_SIZE x BLOCK_SIZE threads per tile: the rows of both sides are loaded in shared
+	 * memory BLOCK_SIZE columns at a time and thread (x, y) sums the distance between row y of the first
+	 * side and row x of the second. Pairs within the radius are inserted in the pair set by their ids, the
+	 * smaller first, and only the ones it did not hold yet are appended to the output.
+	 */
+	template<typename T>
+	__device__ void joinBinTilesOf(
+		const T* A, Precision precisionA,
+		int cols,
+		const unsigned* sortedIdxs,
+		const JoinTile* tiles,
+		float squaredRadius,
+		unsigned long long* pairKeys,
+		unsigned long long keysMask,
+		unsigned* pairsNumber,
+		unsigned* firstIdxs,
+		unsigned* secondIdxs,
+		float* distances
+	) {
+		// padded so the threads of a warp read the second side from different banks
+		__shared__ float firstRows[BLOCK_SIZE][BLOCK_SIZE + 1];
+		__shared__ float secondRows[BLOCK_SIZE][BLOCK_SIZE + 1];
+
+		JoinTile tile = tiles[blockIdx.x];
+		unsigned firstRow = tile.firstRow + threadIdx.y;
+		unsigned secondRow = tile.secondRow + threadIdx.x;
+
+		// thread (x, y) loads column x of the row y of both sides
+		unsigned firstLoadedRow = tile.firstRow + threadIdx.y;
+		unsigned secondLoadedRow = tile.secondRow + threadIdx.y;
+		size_t firstRowStart = firstLoadedRow < tile.binSize ? (size_t) cols * sortedIdxs[tile.binStart + firstLoadedRow] : 0;
+		size_t secondRowStart = secondLoadedRow < tile.binSize ? (size_t) cols * sortedIdxs[tile.binStart + secondLoadedRow] : 0;
+
+		float distance = 0.0f;
+		for (int colsStart = 0; colsStart < cols; colsStart += BLOCK_SIZE) {
+			int col = colsStart + threadIdx.x;
+			firstRows[threadIdx.y][threadIdx.x] = firstLoadedRow < tile.binSize && col < cols ? loadValue(A, firstRowStart + col, precisionA) : 0.0f;
+			secondRows[threadIdx.y][threadIdx.x] = secondLoadedRow < tile.binSize && col < cols ? loadValue(A, secondRowStart + col, precisionA) : 0.0f;
+			__syncthreads();
+
+			for (int i = 0; i < BLOCK_SIZE; ++i) {
+				float difference = firstRows[threadIdx.y][i] - secondRows[threadIdx.x][i];
+				distance += difference * difference;
+			}
+			__syncthreads();
+		}
+
+		// a tile on the diagonal holds every pair twice and the rows with themselves
+		bool isPair = firstRow < tile.binSize && secondRow < tile.binSize && (tile.firstRow != tile.secondRow || threadIdx.y < threadIdx.x);
+		if (!isPair || distance > squaredRadius) {
+			return;
+		}
+
+		unsigned first = sortedIdxs[tile.binStart + firstRow];
+		unsigned second = sortedIdxs[tile.binStart + secondRow];
+		if (first > second) {
+			unsigned swapped = first;
+			first = second;
+			second = swapped;
+		}
+		if (insertPairKey(pairKeys, keysMask, ((unsigned long long) first << 32) | second)) {
+			unsigned position = atomicAdd(pairsNumber, 1u);
+			firstIdxs[position] = first;
+			secondIdxs[position] = second;
+			distances[position] = distance;
+		}
+	}
+
+	__global__ void joinBinTiles(
+		const float* A,
+		int cols,
+		const unsigned* sortedIdxs,
+		const JoinTile* tiles,
+		float squaredRadius,
+		unsigned long long* pairKeys,
+		unsigned long long keysMask,
+		unsigned* pairsNumber,
+		unsigned* firstIdxs,
+		unsigned* secondIdxs,
+		float* distances
+	) {
+		joinBinTilesOf(A, FLOAT32, cols, sortedIdxs, tiles, squaredRadius, pairKeys, keysMask, pairsNumber, firstIdxs, secondIdxs, distances);
+	}
+
+	__global__ void joinBinTiles(
+		const unsigned short* A, Precision precisionA,
+		int cols,
+		const unsigned* sortedIdxs,
+		const JoinTile* tiles,
+		float squaredRadius,
+		unsigned long long* pairKeys,
+		unsigned long long keysMask,
+		unsigned* pairsNumber,
+		unsigned* firstIdxs,
+		unsigned* secondIdxs,
+		float* distances
+	) {
+		joinBinTilesOf(A, precisionA, cols, sortedIdxs, tiles, squaredRadius, pairKeys, keysMask, pairsNumber, firstIdxs, secondIdxs, distances);
+	}
+
+	/*
+	 * Moves the keys of a full pair set into a larger one.
+	 */
+	__global__ void rehashPairKeys(const unsigned long long* oldKeys, size_t oldCapacity, unsigned long long* pairKeys, unsigned long long keysMask) {
+		size_t slot = (size_t) blockIdx.x * blockDim.x + threadIdx.x;
+
+		if (slot < oldCapacity && oldKeys[slot] != EMPTY_PAIR_KEY) {
+			insertPairKey(pairKeys, keysMask, oldKeys[slot]);
+		}
+	}
+
 }
 
 #endif // !__cuANN_utils__
@@ -1,11 +1,37 @@
 #ifndef __cuANN_UTILS_H_
 #define __cuANN_UTILS_H_
 
+#include <cublas_v2.h>
 #include <thrust/device_vector.h>
 #include <thrust/functional.h>
+#include "PrecisionConverter.h"
+#include "Dataset.h"
+#include "ExecutionContext.h"
 
 namespace cuANN {
-	void multiplyMatrix(const float* A, const float* B, float* result, const int rowsA, const int colsA, const int colsB);
+	void multiplyMatrix(cublasHandle_t handle, const float* A, const float* B, float* result, const int rowsA, const int colsA, const int colsB);
+
+	void multiplyMatrixHalf(cublasHandle_t handle, const unsigned short* A, const unsigned short* B, Precision precision, float* result, const int rowsA, const int colsA, const int colsB);
+
+	void multiplyMatrixTransposed(cublasHandle_t handle, const float* A, const float* B, float* result, const int rowsA, const int colsA, const int rowsB);
+
+	// the rows [start, start + count) of a host dataset into dRows, d floats apart, on the stream of the context;
+	// uint8 rows cross as bytes and are widened on the device
+	void uploadRows(const Dataset& rows, long long start, int count, float* dRows, ExecutionContext& context);
+
+	// a square of BLOCK_SIZE x BLOCK_SIZE pairs of rows of a bin, those of the rows [firstRow, firstRow + BLOCK_SIZE)
+	// with those of [secondRow, secondRow + BLOCK_SIZE), as offsets in the bin
+	struct JoinTile {
+		unsigned binStart;
+		unsigned binSize;
+		unsigned firstRow;
+		unsigned secondRow;
+	};
+
+	// a free slot of the pair set, never a key: the first id of a pair is always the smaller one
+	constexpr unsigned long long EMPTY_PAIR_KEY = ~0ULL;
+	// the threads of a block of selectTopKFromTile, one per query
+	constexpr int SELECTION_THREADS = 128;
 
 	struct isTrue {
 		__host__ __device__
@@ -21,9 +47,26 @@ namespace cuANN {
 		}
 	};
 
+	struct toRandomSign {
+		__host__ __device__
+		float operator()(const float uniform) {
+			return uniform < 0.5f ? -1.0f : 1.0f;
+		}
+	};
+
+	// the vertex of the cross-polytope closest to a rotated vector with its largest coordinate there
+	__host__ __device__ inline unsigned toCrossPolytopeVertex(int coordinate, float value) {
+		return 2 * coordinate + (value < 0);
+	}
+
+	// mixed the way hashRange mixes the values of a row, on both sides
+	__host__ __device__ inline size_t mixCrossPolytopeVertex(size_t seed, unsigned vertex) {
+		return seed ^ (vertex + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+	}
+
 	__global__ void addVectorFromMatrix(float* matrix, const float* vector, const int rowsA, const int colsA);
 
-	__global__ void divideMatrixByScalar(float* matrix, const int scalar, const int rowsA, const int colsA);
+	__global__ void divideMatrixByScalar(float* matrix, const float scalar, const int rowsA, const int colsA);
 
 	__global__ void floorMatrix(float* matrix, const int rowsA, const int colsA);
 
@@ -44,8 +87,113 @@ namespace cuANN {
 		float* result
 	);
 
+	__global__ void calcSquaredDistances(
+		const unsigned short* A, Precision precisionA,
+		const float* B,
+		int cols,
+		const unsigned* rowIdxsA,
+		const unsigned* rowIdxsB,
+		unsigned distancesNumber,
+		float* result
+	);
+
+	__global__ void selectRowsWithinRadius(
+		const float* A,
+		const float* B,
+		int cols,
+		const unsigned* rowIdxsA,
+		const unsigned* rowIdxsB,
+		unsigned distancesNumber,
+		float squaredRadius,
+		unsigned maxMatches,
+		unsigned* matchesCounts,
+		float* result,
+		bool* matched
+	);
+
+	__global__ void selectRowsWithinRadius(
+		const unsigned short* A, Precision precisionA,
+		const float* B,
+		int cols,
+		const unsigned* rowIdxsA,
+		const unsigned* rowIdxsB,
+		unsigned distancesNumber,
+		float squaredRadius,
+		unsigned maxMatches,
+		unsigned* matchesCounts,
+		float* result,
+		bool* matched
+	);
+
+	__global__ void expandToFloat(const unsigned short* source, size_t size, Precision precision, float* destination);
+
+	__global__ void widenBytes(const uint8_t* source, size_t size, float* destination);
+
+	__global__ void calcSquaredNorms(const float* matrix, const int rows, const int cols, float* norms);
+
+	__global__ void selectTopKFromTile(
+		const float* dots,
+		const float* tileNorms,
+		const float* queryNorms,
+		int Q, int tileRows, unsigned tileOffset, int K,
+		float* topDistances,
+		int* topIdxs,
+		float* spareDistances,
+		int* spareIdxs
+	);
+
+	__global__ void gatherRows(const float* source, const unsigned* rowIdxs, const int rows, const int cols, float* destination);
+
+	__global__ void gatherRows(const unsigned short* source, const unsigned* rowIdxs, const int rows, const int cols, unsigned short* destination);
+
+	__global__ void mapCandidatesToQueries(const unsigned* startingIdxs, unsigned Q, unsigned candidatesNumber, unsigned* queryIdxs);
+
+	__global__ void makeQueryDistanceKeys(const unsigned* queryIdxs, const float* distances, unsigned size, unsigned long long* keys);
+
+	__global__ void splitQueryDistanceKeys(const unsigned long long* keys, unsigned size, float* distances);
+
 	__global__ void hashMatrixRows(const float* matrix, const int rows, const int cols, size_t* hashes);
 
+	__global__ void hashCrossPolytope(const float* matrix, const int rows, const int cols, const int paddedCols, const int k, const float* signs, size_t* hashes);
+
+	__global__ void hashCrossPolytope(const unsigned short* matrix, Precision precision, const int rows, const int cols, const int paddedCols, const int k, const float* signs, size_t* hashes);
+
+	__global__ void projectStructured(const float* matrix, const int rows, const int cols, const int paddedCols, const int k, const float* signs, const int* permutations, const float* gaussians, float* projected);
+
+	__global__ void projectStructured(const unsigned short* matrix, Precision precision, const int rows, const int cols, const int paddedCols, const int k, const float* signs, const int* permutations, const float* gaussians, float* projected);
+
+	__global__ void combineHashes(const size_t* first, const size_t* second, const int rows, size_t* hashes);
+
+	__global__ void joinBinTiles(
+		const float* A,
+		int cols,
+		const unsigned* sortedIdxs,
+		const JoinTile* tiles,
+		float squaredRadius,
+		unsigned long long* pairKeys,
+		unsigned long long keysMask,
+		unsigned* pairsNumber,
+		unsigned* firstIdxs,
+		unsigned* secondIdxs,
+		float* distances
+	);
+
+	__global__ void joinBinTiles(
+		const unsigned short* A, Precision precisionA,
+		int cols,
+		const unsigned* sortedIdxs,
+		const JoinTile* tiles,
+		float squaredRadius,
+		unsigned long long* pairKeys,
+		unsigned long long keysMask,
+		unsigned* pairsNumber,
+		unsigned* firstIdxs,
+		unsigned* secondIdxs,
+		float* distances
+	);
+
+	__global__ void rehashPairKeys(const unsigned long long* oldKeys, size_t oldCapacity, unsigned long long* pairKeys, unsigned long long keysMask);
+
 	__device__ void hashRange(const float* iteratorBegin, const float* iteratorEnd, size_t& result);
 
 }